@@ -0,0 +1,126 @@
+#ifndef ANALYSIS_INDEX_HPP
+#define ANALYSIS_INDEX_HPP
+
+#include "crop_spool.hpp"
+#include "cropped_image.hpp"
+#include "planet_detector.hpp"
+#include "video_processor.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <opencv2/core/types.hpp>
+#include <string>
+#include <vector>
+
+// What analysing one frame of a capture found
+struct FrameAnalysis {
+  int index = 0; // frame number in the capture
+  Centroid centroid{0, 0};
+  double contrast = 0.0;
+  double sharpness = 0.0;
+  double snr = 0.0;
+  bool aligned = false;  // shift and response are known
+  cv::Point2d shift;     // onto frame reference
+  double response = 0.0; // phase correlation peak of the shift
+  int reference = -1;    // frame number the shift was estimated against
+};
+
+// Sidecar index of a capture holding every frame's centroid, quality terms
+// and global shift. Stacking the same capture again, with other weights,
+// another selection or another rejection, ranks the frames from the index,
+// decodes only the selected ones straight at their known centroids and
+// goes directly to stacking. The index is keyed by a fingerprint of the
+// capture and by every setting the analysis depends on, anything else
+// starts over and rewrites it, as does a sidecar whose records are out of
+// order, out of the capture's range or otherwise malformed
+class AnalysisIndex {
+public:
+  static bool enabled; // read and write sidecar indexes (default: true)
+
+  AnalysisIndex(std::string capture_path, int crop_size, int frame_skip);
+
+  // output/<capture>.analysis next to the capture
+  static std::string sidecar_path(const std::string &capture_path);
+
+  // Crops of the frames to stack in frame order, the same frames
+  // VideoProcessor::processBestFrames keeps
+  std::vector<CroppedImage> crop_best(double keep_percent, size_t keep_count);
+
+  // Same selection with the crops written to a spool in directory instead
+  // of held in memory, kept receives their entries in frame order.
+  // Analysing spools each crop as it is scored, so the capture is decoded
+  // once either way
+  std::unique_ptr<CropSpool> spool_best(double keep_percent, size_t keep_count,
+                                        const std::string &directory,
+                                        std::vector<CropSpool::Entry> &kept);
+
+  // Select the frames crop_best would crop from a current index without
+  // decoding anything. False if the capture has to be analysed first
+  bool select_indexed(double keep_percent, size_t keep_count);
+
+  // Crops of the last selection handed to sink one at a time in frame
+  // order, cut at their stored centroids
+  void crop_selected(const VideoProcessor::CropSink &sink) const;
+
+  // Global shifts of the crops of the last selection, as
+  // ImageAligner::compute_shifts gives them
+  std::vector<cv::Point2d> shifts(const std::vector<CroppedImage> &crops);
+
+  // Shifts of the last selection as shifts() serves them from the index,
+  // without needing its crops. Empty if the index holds none for the
+  // current alignment settings
+  std::vector<cv::Point2d> stored_shifts();
+
+  // Record shifts and responses estimated elsewhere for the last
+  // selection, in its order, as shifts() does with its own. Frames outside
+  // the selection keep theirs, moved onto the new template where a
+  // selected frame links the two
+  void store_shifts(const std::vector<cv::Point2d> &shifts,
+                    const std::vector<double> &responses);
+
+  // True if the last selection or shifts were answered by the sidecar
+  [[nodiscard]] bool reused() const;
+
+  [[nodiscard]] const std::vector<FrameAnalysis> &frames() const;
+
+private:
+  bool load();
+  bool save() const;
+
+  // Positions in analysis of the frames to keep, in frame order
+  [[nodiscard]] std::vector<size_t> select(double keep_percent,
+                                           size_t keep_count) const;
+
+  // Crops to keep while streaming the capture, 0 if its length is unknown
+  // and every crop has to be kept until the selection can be made
+  [[nodiscard]] size_t stream_capacity(double keep_percent,
+                                       size_t keep_count) const;
+
+  // Place in the last selection of the crop ImageAligner uses as template
+  [[nodiscard]] size_t template_position() const;
+
+  // Positions in analysis of the given frame indices
+  [[nodiscard]] std::vector<size_t>
+  positions_of(const std::vector<int> &indices) const;
+
+  // Decode and score every frame of the capture, replacing the analysis.
+  // Each crop is handed to keep, concurrently from the crop workers
+  using CropKeeper = std::function<void(int frame_index, CroppedImage &&cropped)>;
+  void analyse(const CropKeeper &keep);
+
+  std::string capture_path;
+  std::string path;
+  int crop_size;
+  int frame_skip;
+  uint64_t fingerprint = 0;
+
+  std::vector<FrameAnalysis> analysis; // in frame order
+  std::vector<size_t> selected;        // positions of the last selection
+  int32_t pyramid_levels = -1;         // alignment settings of the shifts
+  int32_t pyramid_window = -1;
+  bool current = false; // analysis matches the capture and settings
+  bool served = false;
+};
+
+#endif
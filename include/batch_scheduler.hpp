@@ -0,0 +1,64 @@
+#ifndef BATCH_SCHEDULER_HPP
+#define BATCH_SCHEDULER_HPP
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Settings shared by every capture of a batch
+struct BatchOptions {
+  int crop_size = 0;
+  int frame_skip = 1;
+  double keep_percent = 0.0;
+  size_t keep_count = 0;
+  std::string output_format = "png";
+};
+
+// Outcome of one capture
+struct JobStatus {
+  std::string input;
+  std::string output;
+  bool ok = false;
+  std::string error;
+  size_t frames = 0;  // frames that were aligned and stacked
+  double crop_ms = 0.0;
+  double stack_ms = 0.0; // alignment, stacking and saving
+};
+
+// Runs many captures in one process as a two-lane pipeline: one lane
+// decodes and crops the next capture while the other aligns, stacks and
+// saves the previous one. The machine's threads are split between the
+// lanes instead of every job claiming all of them, and at most
+// max_pending cropped captures wait between the lanes, which bounds the
+// memory of the whole batch
+class BatchScheduler {
+public:
+  static int max_pending; // cropped captures waiting for the stack lane (default: 1)
+
+  // Called from the stack lane as soon as a job has finished or failed
+  using StatusCallback = std::function<void(const JobStatus &status)>;
+
+  explicit BatchScheduler(BatchOptions options);
+
+  // True for SER files and the video containers a batch picks up
+  static bool is_capture(const std::string &path);
+
+  // Captures in a directory (videos and SER files, sorted by name) or
+  // listed one per line in a text file, blank lines and # comments skipped
+  static std::vector<std::string> collect_inputs(const std::string &source);
+
+  // <input dir>/output/<input stem>_stacked.<format>, as for single runs
+  static std::string output_path_for(const std::string &input,
+                                     const std::string &format);
+
+  // Process every input, failures are reported per job and do not stop
+  // the batch. Statuses are returned in input order
+  std::vector<JobStatus> run(const std::vector<std::string> &inputs,
+                             const StatusCallback &on_status = {}) const;
+
+private:
+  BatchOptions options;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// Fixed-capacity blocking queue used to hand work between pipeline stages
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(const size_t capacity)
+    : capacity(capacity > 0 ? capacity : 1) {}
+
+  // Blocks while the queue is full, returns false once the queue is closed
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+    if (closed) {
+      return false;
+    }
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  // Blocks while the queue is empty, returns false once closed and drained
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this] { return closed || !items.empty(); });
+    if (items.empty()) {
+      return false;
+    }
+    item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  // Stop accepting items, pending items can still be popped
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+  // Stop accepting items and drop everything still pending
+  void cancel() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    items.clear();
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+private:
+  const size_t capacity;
+  std::deque<T> items;
+  std::mutex mutex;
+  std::condition_variable not_full;
+  std::condition_variable not_empty;
+  bool closed = false;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef CROP_SPOOL_HPP
+#define CROP_SPOOL_HPP
+
+#include "cropped_image.hpp"
+#include <cstddef>
+#include <mutex>
+#include <opencv2/core/mat.hpp>
+#include <string>
+#include <vector>
+
+// Scratch file holding the color crops of a stream one after another, for
+// captures whose crops do not fit in memory. With a capacity only the best
+// crops by quality score are kept, ranked like FrameSelector, and the slot
+// of an evicted crop is reused so the file never grows past capacity
+// crops. The file is removed when the spool is destroyed
+class CropSpool {
+public:
+  struct Entry {
+    int frame_index;
+    size_t slot;
+    double score;
+  };
+
+  // Spool in directory keeping the best capacity crops, 0 keeps every crop
+  CropSpool(const std::string &directory, size_t capacity);
+
+  ~CropSpool();
+
+  CropSpool(const CropSpool &) = delete;
+  CropSpool &operator=(const CropSpool &) = delete;
+
+  // Thread-safe, returns true if the crop is (currently) among the best.
+  // Every crop must have the size and type of the first one
+  bool offer(int frame_index, const CroppedImage &image);
+
+  // Kept crops in frame order, only the best keep of them if nonzero
+  [[nodiscard]] std::vector<Entry> kept(size_t keep = 0) const;
+
+  [[nodiscard]] size_t offered() const;
+
+  // Geometry of the crops, set by the first offer
+  [[nodiscard]] cv::Size frame_size() const;
+
+  [[nodiscard]] int type() const;
+
+  // Color crop stored in slot, thread-safe
+  void read(size_t slot, cv::Mat &crop) const;
+
+private:
+  static bool ranks_higher(const Entry &a, const Entry &b);
+
+  void write_slot(size_t slot, const cv::Mat &crop);
+
+  const size_t capacity;
+  size_t offered_count = 0;
+  std::vector<Entry> entries; // heap with the worst crop in front if capacity is set
+  std::vector<size_t> free_slots;
+  size_t slot_count = 0;
+  cv::Size size;
+  int mat_type = -1;
+  size_t frame_bytes = 0;
+  mutable std::mutex mutex;
+
+  int fd = -1;
+  std::vector<std::vector<uchar>> fallback_slots;
+};
+
+#endif
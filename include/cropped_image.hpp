@@ -6,24 +6,54 @@
 
 class CroppedImage : public Image {
 public:
+  // Operator behind the sharpness term of the quality score
+  enum class SharpnessMetric {
+    Laplacian,     // standard deviation of the 4-neighbour Laplacian
+    GradientEnergy // RMS of the forward-difference gradient, cheaper
+  };
+
   static float contrast_weight;
   static float sharpness_weight;
   static float snr_weight;
+  static SharpnessMetric sharpness_metric; // (default: Laplacian)
+  static int sample_step; // score every n-th row only (default: 1)
+
+  // Weights of the quality score terms, for callers that keep their own
+  // instead of the process-wide ones
+  struct QualityWeights {
+    float contrast;
+    float sharpness;
+    float snr;
+  };
+
+  // Process-wide weights as they are now
+  static QualityWeights current_weights();
 
   CroppedImage(const cv::Mat &color_img, const cv::Mat &grayscale_img);
 
   [[nodiscard]] double get_quality_score() const;
 
-  bool operator<(const CroppedImage &other) const;
-
-private:
-  double quality_score;
+  // Score again from the measured terms with other weights
+  void reweigh(const QualityWeights &weights);
 
+  // Standard deviation of pixel intensities
   [[nodiscard]] double get_contrast() const;
 
   [[nodiscard]] double get_sharpness() const;
 
+  // Mean over standard deviation of pixel intensities
   [[nodiscard]] double get_snr() const;
+
+  bool operator<(const CroppedImage &other) const;
+
+private:
+  double quality_score;
+  double contrast;
+  double sharpness;
+  double snr;
+
+  // Contrast, sharpness and SNR in one pass over the grayscale crop
+  void measure_quality();
 };
 
 #endif
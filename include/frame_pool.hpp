@@ -0,0 +1,72 @@
+#ifndef FRAME_POOL_HPP
+#define FRAME_POOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <opencv2/core/mat.hpp>
+#include <unordered_map>
+#include <vector>
+
+// cv::Mat allocator that recycles buffers by byte size. Pipeline stages
+// produce the same geometries frame after frame (full frames, crops, float
+// copies), so after warm-up a released buffer is handed straight to the
+// next frame instead of going back to the heap and faulting in again.
+// Every thread first reuses its own idle buffers without locking. A buffer
+// released on another thread than the one that allocated it (decoded on a
+// reader, freed on a worker) goes to the shared, locked lists, where its
+// producer finds it again. max_cached_bytes bounds all idle buffers, the
+// per-thread ones included. Mats keep working after release on any
+// thread, the pool is never destroyed
+class FramePool : public cv::MatAllocator {
+public:
+  static size_t max_cached_bytes;    // idle bytes kept in total (default: 512 MiB)
+  static size_t thread_cached_bytes; // idle bytes kept per thread, out of the total (default: 64 MiB)
+
+  static FramePool &instance();
+
+  // Mat of the given geometry, backed by a recycled buffer when one is idle
+  static cv::Mat acquire(cv::Size size, int type);
+
+  // Make later create() calls on mat (including OpenCV output arguments)
+  // draw from the pool
+  static void attach(cv::Mat &mat);
+
+  // Free the idle buffers of the shared lists and of the calling thread
+  void trim();
+
+  // Idle bytes of the shared lists and of the calling thread
+  [[nodiscard]] size_t cached_bytes() const;
+
+  cv::UMatData *allocate(int dims, const int *sizes, int type, void *data,
+                         size_t *step, cv::AccessFlag flags,
+                         cv::UMatUsageFlags usage_flags) const override;
+
+  bool allocate(cv::UMatData *data, cv::AccessFlag access_flags,
+                cv::UMatUsageFlags usage_flags) const override;
+
+  void deallocate(cv::UMatData *data) const override;
+
+private:
+  // Idle buffers of one thread, handed to the shared lists when it exits
+  struct ThreadCache;
+
+  FramePool() = default;
+
+  // The calling thread's cache, nullptr once it has been destroyed
+  static ThreadCache *thread_cache();
+
+  void *take(size_t bytes) const;
+
+  // owner is the cache of the thread that allocated the buffer
+  void give_back(void *buffer, size_t bytes, const void *owner) const;
+
+  void give_back_shared(void *buffer, size_t bytes) const;
+
+  mutable std::mutex mutex;
+  mutable std::unordered_map<size_t, std::vector<void *> > idle;
+  mutable size_t idle_bytes = 0;                    // in the shared lists
+  mutable std::atomic<size_t> thread_idle_bytes{0}; // in every thread cache
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef FRAME_SELECTOR_HPP
+#define FRAME_SELECTOR_HPP
+
+#include "cropped_image.hpp"
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Keeps the best frames of a stream by quality score using a bounded
+// min-heap, rejected frames release their pixel data immediately
+class FrameSelector {
+public:
+  explicit FrameSelector(size_t capacity);
+
+  // Number of frames to keep out of total_frames for a keep-percent setting
+  static size_t capacity_for_percent(size_t total_frames, double keep_percent);
+
+  // Select from frames that are already in memory, result is in frame order
+  static std::vector<CroppedImage> select(std::vector<CroppedImage> &&images,
+                                          size_t keep_count);
+
+  // Thread-safe, returns true if the frame is (currently) among the best
+  bool offer(int frame_index, CroppedImage &&image);
+
+  // Kept frames in frame order, leaves the selector empty. frame_indices
+  // receives the index each kept frame was offered with
+  [[nodiscard]] std::vector<CroppedImage>
+  take(std::vector<int> *frame_indices = nullptr);
+
+  [[nodiscard]] size_t offered() const;
+
+private:
+  struct Entry {
+    int frame_index;
+    CroppedImage image;
+  };
+
+  static bool ranks_higher(const Entry &a, const Entry &b);
+
+  const size_t capacity;
+  size_t offered_count = 0;
+  std::vector<Entry> heap;
+  mutable std::mutex mutex;
+};
+
+#endif
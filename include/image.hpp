@@ -4,6 +4,9 @@
 #include <opencv2/core/mat.hpp>
 #include <string>
 
+// Grayscale and binary representations are generated on first use, so
+// stages that never ask for them never pay for them. First use is not
+// synchronized, an Image must not be shared between threads before then
 class Image {
 public:
   [[nodiscard]] cv::Mat get_color() const;
@@ -16,16 +19,20 @@ public:
 
   explicit Image(const cv::Mat &img);
 
+  // 8-bit copy of a 16-bit (full range) or float (0 to 1) image, 8-bit
+  // input is returned as is
+  static cv::Mat to_8bit(const cv::Mat &gray);
+
 protected:
   Image() = default;
 
-  void generate_grayscale();
+  void generate_grayscale() const;
 
-  void generate_binary();
+  void generate_binary() const;
 
   cv::Mat color;
-  cv::Mat grayscale;
-  cv::Mat binary;
+  mutable cv::Mat grayscale;
+  mutable cv::Mat binary;
 };
 
 #endif
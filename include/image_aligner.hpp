@@ -2,20 +2,204 @@
 #define IMAGE_ALIGNER_HPP
 
 #include "cropped_image.hpp"
+#include <functional>
 #include <opencv2/core/mat.hpp>
 #include <vector>
 
 class ImageAligner {
 public:
+  static int ap_grid;     // alignment points per side, 0 for global only (default: 0)
+  static int ap_box_size; // side of each alignment box in pixels (default: 64)
+  static int pyramid_levels; // halvings for the coarse estimate, 0 for full resolution (default: 0)
+  static int pyramid_window; // side of the full-resolution refinement window (default: 256)
+
+  // The settings above as one value, for callers that keep their own
+  // instead of the process-wide ones
+  struct Settings {
+    int ap_grid;
+    int ap_box_size;
+    int pyramid_levels;
+    int pyramid_window;
+  };
+
+  // Process-wide settings as they are now
+  static Settings current();
+
+  // Receives each aligned frame as soon as it exists, called concurrently
+  // from the alignment workers so it must be thread-safe
+  using AlignedSink = std::function<void(int index, cv::Mat &&aligned)>;
+
   static std::vector<cv::Mat> align_images(std::vector<CroppedImage> &images);
 
+  // Same alignment, handing frames to sink instead of keeping them all
+  static void align_images(std::vector<CroppedImage> &images,
+                           const AlignedSink &sink,
+                           const Settings &settings = current());
+
+  // Returns the color crop of frame index, read again on every call
+  using CropSource = std::function<cv::Mat(int index)>;
+
+  // Same alignment for count crops too many to hold in memory, each thread
+  // reads one crop from source at a time. template_index is the crop the
+  // others are aligned onto, the best-quality one for the same result as
+  // above. All crops must have the same size. shifts and responses, when
+  // given, receive each crop's global shift and correlation peak as
+  // compute_shifts reports them
+  static void align_images(int count, int template_index,
+                           const CropSource &source, const AlignedSink &sink,
+                           std::vector<cv::Point2d> *shifts = nullptr,
+                           std::vector<double> *responses = nullptr);
+
+  // Global shift that moves each frame onto the best-quality frame, the
+  // same estimate align_images warps with. responses receives each frame's
+  // phase correlation peak, 1 for a perfect match (the coarse level's with
+  // pyramid_levels set)
+  static std::vector<cv::Point2d>
+  compute_shifts(const std::vector<CroppedImage> &images,
+                 std::vector<double> *responses = nullptr,
+                 const Settings &settings = current());
+
+  // Color frame translated by shift, like warpAffine
+  static void translate(const cv::Mat &color, const cv::Point2d &shift,
+                        cv::Mat &aligned);
+
+  class FixedReference;
+
 private:
+  // Windowed, zero-padded template spectrum, computed once per alignment run
+  struct Reference {
+    cv::Size image_size;
+    cv::Size dft_size;
+    cv::Mat window;
+    cv::Mat spectrum;
+  };
+
+  // Per-thread buffers reused across frames, cv::Mat::create keeps the
+  // allocation as long as the size does not change. They draw from the
+  // FramePool, so later alignment runs start with warm buffers too
+  struct Scratch {
+    Scratch();
+
+    cv::Mat resized;
+    cv::Mat padded;
+    cv::Mat spectrum;
+    cv::Mat cross_power;
+    cv::Mat correlation;
+  };
+
+  // One box of the multi-point grid, boxes without signal follow the
+  // global shift
+  struct AlignmentPoint {
+    cv::Rect box;
+    Reference reference;
+    bool valid;
+  };
+
   // Private constructor to prevent instantiation
   ImageAligner() = default;
 
-  static cv::Point2d compute_phase_correlation(const cv::Mat &img1,
-                                               const cv::Mat &img2);
+  static Reference prepare_reference(const cv::Mat &template_gray);
+
+  // Shift that moves img onto the reference, one forward and one inverse
+  // FFT. response, when given, receives the correlation peak
+  static cv::Point2d compute_phase_correlation(const cv::Mat &img,
+                                               const Reference &reference,
+                                               Scratch &scratch,
+                                               double *response = nullptr);
+  // Global shift of one frame at a time onto a template. With
+  // pyramid_levels a downsampled frame is correlated for the coarse shift,
+  // which is then refined on a central full-resolution window, otherwise
+  // one full-resolution correlation is made
+  class ShiftEstimator {
+  public:
+    // Per-thread buffers
+    struct Buffers {
+      Scratch coarse;
+      Scratch fine;
+      cv::Mat coarse_gray;
+    };
+
+    ShiftEstimator(const cv::Mat &template_gray, const Settings &settings);
+
+    // response, when given, receives the correlation peak (the coarse
+    // level's for a pyramid estimate)
+    cv::Point2d estimate(const cv::Mat &gray, Buffers &buffers,
+                         double *response) const;
+
+  private:
+    bool pyramid;
+    Reference reference; // full frame, or the fine window of a pyramid
+    cv::Rect fine_box;
+    cv::Size coarse_size;
+    cv::Point2d coarse_to_full;
+    Reference coarse_reference;
+  };
+
+  // Buffers for turning box shifts into a dense field, reused across frames
+  struct RemapBuffers {
+    cv::Mat grid_shifts;
+    cv::Mat field;
+    cv::Mat map;
+  };
+
+  static std::vector<cv::Point2d>
+  estimate_global_shifts(const std::vector<CroppedImage> &images,
+                         const cv::Mat &template_gray,
+                         const Settings &settings,
+                         std::vector<double> *responses = nullptr);
+
+  // Correlate the template box against the frame box offset by estimate,
+  // false if the refined shift disagrees with the estimate
+  static bool refine_in_box(const cv::Mat &gray, const cv::Rect &box,
+                            const Reference &reference,
+                            const cv::Point2d &estimate, Scratch &scratch,
+                            cv::Point2d &refined);
+
+  static std::vector<AlignmentPoint>
+  place_alignment_points(const cv::Mat &template_gray, const Settings &settings);
+
+  // Shift of one box of a frame, the global shift where the box has no
+  // signal or its refinement fails
+  static cv::Point2f point_shift(const cv::Mat &gray, const AlignmentPoint &point,
+                                 const cv::Point2d &global, Scratch &scratch);
+
+  // Warp color with a dense field interpolated from the shifts of the
+  // grid x grid boxes
+  static void remap_with_shifts(const cv::Mat &color, const cv::Point2f *shifts,
+                                int grid, RemapBuffers &buffers,
+                                cv::Mat &aligned);
+
+  // Refine the global shifts per alignment box, then warp every frame with
+  // a dense shift field interpolated from the box shifts
+  static void align_multi_point(std::vector<CroppedImage> &images,
+                                const cv::Mat &template_gray,
+                                const std::vector<cv::Point2d> &global_shifts,
+                                const Settings &settings,
+                                const AlignedSink &sink);
+
   static CroppedImage select_template(const std::vector<CroppedImage> &images);
 };
 
+// Template chosen once for frames that arrive one at a time, its spectrum
+// is computed up front so each frame costs one forward and one inverse FFT.
+// Global shift only, not thread-safe
+class ImageAligner::FixedReference {
+public:
+  explicit FixedReference(const cv::Mat &template_gray);
+
+  // Shift that moves gray onto the template
+  cv::Point2d shift(const cv::Mat &gray);
+
+  // Color crop of image translated onto the template, aligned keeps its
+  // allocation across calls
+  void align(const CroppedImage &image, cv::Mat &aligned);
+
+  [[nodiscard]] cv::Mat template_gray() const;
+
+private:
+  cv::Mat gray;
+  Reference reference;
+  Scratch scratch;
+};
+
 #endif
@@ -1,29 +1,73 @@
 #ifndef IMAGE_STACKER_HPP
 #define IMAGE_STACKER_HPP
 
+#include "cropped_image.hpp"
+#include "tile_store.hpp"
 #include <opencv2/opencv.hpp>
 #include <vector>
 
 class ImageStacker {
 public:
+  // How samples further than sigma_threshold standard deviations from the
+  // mean are treated before averaging. Percentile and MinMax reject by rank
+  // instead and average the samples that are left
+  enum class RejectionMode {
+    ReplaceWithMedian, // substitute the pixel's median
+    KappaSigma,        // drop the sample
+    Winsorized,        // clamp the sample to the clipping bound
+    Percentile,        // drop samples outside [percentile_low, percentile_high]
+    MinMax             // drop the lowest and the highest sample
+  };
+
   static float sigma_threshold; // kappa value for sigma clipping (default: 3.0)
+  static int sigma_iterations;  // clip/re-estimate passes per pixel (default: 1)
+  static RejectionMode rejection_mode; // (default: ReplaceWithMedian)
+  static float percentile_low;  // lowest rank kept by Percentile, as a fraction (default: 0.1)
+  static float percentile_high; // highest rank kept by Percentile, as a fraction (default: 0.9)
+
+  // The rejection settings above as one value, for callers that keep their
+  // own instead of the process-wide ones
+  struct Settings {
+    float sigma_threshold;
+    int sigma_iterations;
+    RejectionMode rejection_mode;
+    float percentile_low;
+    float percentile_high;
+  };
+
+  // Process-wide settings as they are now
+  static Settings current();
 
-  static cv::Mat stack_images(const std::vector<cv::Mat> &images);
+  // Stack of 8U, 16U or 32F frames, converted back to the input type
+  static cv::Mat stack_images(const std::vector<cv::Mat> &images,
+                              const Settings &settings = current());
 
-private:
-  static std::vector<cv::Mat>
+  // Same stack kept at CV_32F precision, in the input's sample scale
+  static cv::Mat stack_images_float(const std::vector<cv::Mat> &images,
+                                    const Settings &settings = current());
 
-  convert_to_float(const std::vector<cv::Mat> &images);
+  // Stack of the crops translated by shifts (ImageAligner::compute_shifts),
+  // as if each had been warped with warpAffine first. The translation is
+  // applied while the passes read the crops, so no aligned copy is made:
+  // whole-pixel shifts read the crop rows in place and fractional ones are
+  // interpolated one row segment at a time
+  static cv::Mat stack_shifted(const std::vector<CroppedImage> &crops,
+                               const std::vector<cv::Point2d> &shifts,
+                               const Settings &settings = current());
 
-  static void compute_mean_and_std(const std::vector<cv::Mat> &float_images,
-                                   cv::Mat &mean_img, cv::Mat &std_img);
+  // Out-of-core stack as CV_32F: one band of all frames is streamed from
+  // the store at a time and released once it is stacked
+  static cv::Mat stack_tiles(const TileStore &store,
+                             const Settings &settings = current());
 
-  static cv::Mat compute_median(const std::vector<cv::Mat> &float_images);
+  // Per-pixel median as CV_32F of 8U, 16U or 32F frames, computed tile by tile
+  static cv::Mat compute_median(const std::vector<cv::Mat> &images);
 
-  static cv::Mat
-  apply_sigma_clipping_and_mean(const std::vector<cv::Mat> &float_images,
-                                const cv::Mat &mean_img, const cv::Mat &std_img,
-                                const cv::Mat &median_img);
+  // Per-pixel mean of the samples ranked lo..hi (inclusive, 0 is the
+  // darkest) as CV_32F. 8- and 16-bit frames are ranked with per-pixel
+  // histograms in O(frames) instead of being widened and sorted
+  static cv::Mat compute_rank_mean(const std::vector<cv::Mat> &images,
+                                   size_t lo, size_t hi);
 };
 
 #endif
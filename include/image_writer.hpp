@@ -0,0 +1,25 @@
+#ifndef IMAGE_WRITER_HPP
+#define IMAGE_WRITER_HPP
+
+#include <opencv2/core/mat.hpp>
+#include <string>
+
+// Saves the CV_32F stack without first crushing it to the input depth
+class ImageWriter {
+public:
+  // Format follows the extension: .fits/.fit/.fts as 32-bit float FITS in
+  // the input's sample scale, .tif/.tiff as 16-bit TIFF, anything else
+  // through cv::imwrite at the input depth (16-bit for float input).
+  // source_depth is the depth of the frames that were stacked
+  static bool write(const std::string &path, const cv::Mat &stack,
+                    int source_depth);
+
+  // Mono or BGR float image as a FITS primary HDU, colour as an RGB cube
+  static bool write_fits(const std::string &path, const cv::Mat &image);
+
+private:
+  // Private constructor to prevent instantiation
+  ImageWriter() = default;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef LIVE_STACKER_HPP
+#define LIVE_STACKER_HPP
+
+#include "cropped_image.hpp"
+#include "image_aligner.hpp"
+#include "online_stacker.hpp"
+#include "planet_detector.hpp"
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <opencv2/core/mat.hpp>
+#include <string>
+#include <vector>
+
+// Stack that grows while a capture is running. Each new frame is cropped
+// around the tracked target, shifted onto a fixed reference and folded into
+// running accumulators, so an update costs O(frame) however many frames
+// came before. Checkpoints hold the accumulators, the reference and how
+// far every source has been read, a later run resumes from one and only
+// stacks the frames that are new
+class LiveStacker {
+public:
+  static int reference_frames;    // first frames the best-quality reference is picked from (default: 10)
+  static int preview_interval;    // stacked frames between preview writes, 0 only at the end (default: 10)
+  static int checkpoint_interval; // stacked frames between checkpoints, 0 only at the end (default: 100)
+  static int poll_ms;             // pause between scans of a source without new frames (default: 500)
+  static int idle_timeout_s;      // stop after this long without a new frame, 0 to never stop (default: 60)
+
+  // Called after every preview write with the number of stacked frames
+  using PreviewCallback = std::function<void(size_t frames)>;
+
+  // Called for every frame skipped because no target was found in it, with
+  // its source and frame number
+  using SkipCallback = std::function<void(const std::string &source, size_t frame)>;
+
+  LiveStacker(int crop_size, std::string preview_path,
+              std::string checkpoint_path,
+              PreviewCallback on_preview = {}, SkipCallback on_skip = {});
+
+  // Continue the stack saved at the checkpoint path, false if there is none
+  bool resume();
+
+  // Scan a capture (SER or video) or a directory of captures and still
+  // images once, stacking every frame not seen before. Returns the number
+  // of new frames
+  size_t poll(const std::string &source);
+
+  // Poll until idle_timeout_s passes without a new frame, then finish
+  void watch(const std::string &source);
+
+  // Locate, crop, align and accumulate one 8- or 16-bit mono or BGR frame.
+  // The first reference_frames frames are held back until the reference is
+  // set. False if no target was found, the frame is dropped and the next
+  // one is detected from scratch
+  bool add_frame(const cv::Mat &frame);
+
+  // Stack the held-back frames and write the final preview and checkpoint
+  void finish();
+
+  void write_preview() const;
+
+  // Written to a temporary file and renamed, a crash never leaves a torn
+  // checkpoint behind
+  void write_checkpoint();
+
+  // Frames in the stack, not counting the ones held back for the reference
+  [[nodiscard]] size_t frame_count() const;
+
+  // Current stack as CV_32F in the frames' sample scale
+  [[nodiscard]] cv::Mat stack() const;
+
+private:
+  size_t poll_capture(const std::string &path);
+
+  size_t poll_image(const std::string &path);
+
+  // add_frame for frame `index` of a source, reporting a skipped frame
+  void consume(const cv::Mat &frame, const std::string &source, size_t index);
+
+  // Start tracking from scratch when frames come from another source
+  void switch_source(const std::string &path);
+
+  void choose_reference();
+
+  void stack_crop(const CroppedImage &crop);
+
+  int crop_size;
+  std::string preview_path;
+  std::string checkpoint_path;
+  PreviewCallback on_preview;
+  SkipCallback on_skip;
+
+  PlanetTracker tracker;
+  std::string current_source;
+  std::unique_ptr<ImageAligner::FixedReference> reference;
+  std::vector<CroppedImage> held_back;
+  OnlineStacker accumulator;
+  cv::Mat aligned;
+
+  // Frames consumed per source, keyed by canonical path
+  std::map<std::string, size_t> progress;
+};
+
+#endif
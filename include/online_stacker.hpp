@@ -0,0 +1,57 @@
+#ifndef ONLINE_STACKER_HPP
+#define ONLINE_STACKER_HPP
+
+#include <cstddef>
+#include <functional>
+#include <opencv2/core/mat.hpp>
+
+// Incremental stacker keeping per-pixel Welford mean/M2 accumulators, so
+// mean and standard deviation take one pass and O(1) frames of memory
+class OnlineStacker {
+public:
+  // Returns frame `index` of the sequence that was added, used to re-read
+  // frames for the clipping pass instead of keeping them in memory
+  using FrameSource = std::function<cv::Mat(size_t index)>;
+
+  OnlineStacker() = default;
+
+  // Fold one frame into the running mean and M2 (8U, 16U or 32F input)
+  void add(const cv::Mat &frame);
+
+  // Plain mean of all frames added so far, in the input type
+  [[nodiscard]] cv::Mat finalize() const;
+
+  // Second pass: average only the samples within kappa standard deviations
+  // of the mean, pixels with every sample rejected keep the mean
+  [[nodiscard]] cv::Mat finalize_clipped(const FrameSource &source,
+                                         float kappa) const;
+
+  [[nodiscard]] size_t count() const;
+
+  // Copy of the running mean as CV_32F, later adds do not change it
+  [[nodiscard]] cv::Mat mean() const;
+
+  // Population standard deviation as CV_32F
+  [[nodiscard]] cv::Mat std_dev() const;
+
+  // Copy of the sum of squared deviations as CV_32F, with mean() and
+  // count() the whole state of the accumulator
+  [[nodiscard]] cv::Mat m2() const;
+
+  // Type of the frames that were added, -1 before the first one
+  [[nodiscard]] int type() const;
+
+  // Continue from a state saved with mean(), m2(), count() and type()
+  void restore(const cv::Mat &mean, const cv::Mat &m2, size_t count,
+               int frame_type);
+
+  void reset();
+
+private:
+  cv::Mat mean_acc;
+  cv::Mat m2_acc;
+  size_t frame_count = 0;
+  int input_type = -1;
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef OUT_OF_CORE_STACKER_HPP
+#define OUT_OF_CORE_STACKER_HPP
+
+#include "analysis_index.hpp"
+#include "crop_spool.hpp"
+#include "tile_store.hpp"
+#include <cstddef>
+#include <memory>
+#include <opencv2/core/mat.hpp>
+#include <string>
+#include <vector>
+
+// Crops of one capture held in a scratch spool instead of memory, or
+// already aligned into a tile store when their shifts were known
+struct ScratchCrops {
+  std::unique_ptr<CropSpool> spool;
+  std::vector<CropSpool::Entry> kept; // selected crops in frame order
+  int template_index = 0;             // best kept crop, the one ImageAligner would pick
+  int source_depth = CV_8U;
+  size_t count = 0;                   // selected crops
+  std::unique_ptr<TileStore> aligned; // set instead of the spool by stored shifts
+};
+
+// Stacking with --scratch: the capture is decoded once and its best crops
+// are spooled to disk as they are scored, then aligned one frame per
+// thread into a TileStore and stacked one band at a time. Resident memory
+// is one band of every frame plus a crop per thread, never all the crops.
+// When the analysis index already holds the shifts only the selected
+// frames are decoded and each one is translated straight into the store
+class OutOfCoreStacker {
+public:
+  // Crops of the frames index.crop_best would return, written to a spool
+  // in directory as they are decoded, or aligned right away with the
+  // index's shifts when there are no alignment points
+  static ScratchCrops crop(AnalysisIndex &index, double keep_percent,
+                           size_t keep_count, const std::string &directory);
+
+  // Aligned crops in a tile store in directory, the shifts estimated on
+  // the way are recorded in index
+  static std::unique_ptr<TileStore> align(ScratchCrops &crops,
+                                          AnalysisIndex &index,
+                                          const std::string &directory);
+
+  // Stack the aligned crops as CV_32F
+  static cv::Mat stack(const TileStore &store);
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "cropped_image.hpp"
 #include "image.hpp"
+#include <opencv2/core/mat.hpp>
 
 struct Centroid {
   int x;
@@ -13,11 +14,60 @@ class PlanetDetector {
 public:
   static CroppedImage crop(const Image &image, int crop_size);
 
+  // Centroid of the thresholded target in a full frame
+  static Centroid detect(const Image &image);
+
+  // Square crop of crop_size around centroid, black padded where it leaves
+  // the frame. The grayscale crop is derived from the color crop when gray
+  // is empty, so the full-frame grayscale is never needed
+  static CroppedImage crop_around(const cv::Mat &color, const cv::Mat &gray,
+                                  Centroid centroid, int crop_size);
+
+  // Square crop of a raw Bayer mosaic, demosaiced with bayer_code after
+  // cropping. The ROI starts on an even pixel so the pattern phase and the
+  // cvtColor code stay valid, and carries a small margin so the demosaic
+  // border never reaches the crop. 16-bit samples of a smaller bit_depth
+  // are stretched to the full 16-bit range
+  static CroppedImage crop_bayer(const cv::Mat &mosaic, int bayer_code,
+                                 Centroid centroid, int crop_size,
+                                 int bit_depth = 8);
+
 private:
   // Private constructor to prevent instantiation
   PlanetDetector() = default;
+};
 
-  static Centroid detect(const Image &image);
+// Stateful detector for consecutive frames of one capture. The first frame
+// (and any frame where tracking is lost) is thresholded on a downsampled
+// copy, later frames only look at a window around the previous centroid.
+// Frames must be passed in capture order from a single thread
+class PlanetTracker {
+public:
+  static int detection_size; // longest side of the downsampled frame (default: 512)
+
+  explicit PlanetTracker(int crop_size);
+
+  Centroid locate(const cv::Mat &frame);
+
+  // Forget the previous centroid, the next frame is detected from scratch
+  void reset();
+
+private:
+  Centroid detect_full(const cv::Mat &frame);
+
+  bool track(const cv::Mat &frame, Centroid &centroid);
+
+  int crop_size;
+  bool tracking = false;
+  Centroid last{0, 0};
+  double threshold = 0.0;
+  double window_area = -1.0;
+
+  // Scratch buffers reused across frames
+  cv::Mat small;
+  cv::Mat small_gray;
+  cv::Mat window_gray;
+  cv::Mat mask;
 };
 
 #endif
@@ -0,0 +1,86 @@
+#ifndef PLANETSTACK_H
+#define PLANETSTACK_H
+
+/* C interface to StackingEngine for services that cannot link C++ APIs.
+ * Functions returning int give 0 on success and -1 on failure, the message
+ * of the last failure is kept per engine. An engine must not be used from
+ * two threads at once, separate engines may run in parallel on separate
+ * threads. threads sets the OpenMP threads of each call */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ps_engine ps_engine;
+
+/* Mirrors ImageStacker::RejectionMode */
+typedef enum {
+  PS_REJECT_MEDIAN = 0,      /* replace rejected samples with the median */
+  PS_REJECT_KAPPA_SIGMA = 1, /* drop rejected samples */
+  PS_REJECT_WINSORIZED = 2,  /* clamp rejected samples to the bound */
+  PS_REJECT_PERCENTILE = 3,  /* keep ranks percentile_low to percentile_high */
+  PS_REJECT_MINMAX = 4       /* drop each pixel's lowest and highest sample */
+} ps_rejection_mode;
+
+/* Mirrors EngineOptions, fill with ps_options_init before changing fields */
+typedef struct {
+  int crop_size;
+  int frame_skip;
+  double keep_percent;
+  size_t keep_count;
+  float contrast_weight;
+  float sharpness_weight;
+  float snr_weight;
+  float sigma_threshold;
+  int sigma_iterations;
+  int rejection_mode; /* a ps_rejection_mode */
+  float percentile_low;
+  float percentile_high;
+  int ap_grid;
+  int ap_box_size;
+  int pyramid_levels;
+  int pyramid_window;
+  int track_target; /* nonzero to track the target across frames */
+  int threads;
+} ps_options;
+
+/* Interleaved float samples in the input's sample scale (0-255 for 8-bit
+ * frames, 0-65535 for 16-bit), owned by the engine and valid until its
+ * next stack call or its destruction */
+typedef struct {
+  int width;
+  int height;
+  int channels;
+  size_t stride; /* bytes between rows */
+  const float *data;
+} ps_image;
+
+void ps_options_init(ps_options *options);
+
+/* NULL if the options are invalid */
+ps_engine *ps_engine_create(const ps_options *options);
+
+void ps_engine_destroy(ps_engine *engine);
+
+/* One frame of interleaved mono (1) or BGR (3) samples, bits_per_sample 8
+ * or 16, stride in bytes between rows. The samples are copied */
+int ps_engine_add_frame(ps_engine *engine, const void *data, int width,
+                        int height, int channels, int bits_per_sample,
+                        size_t stride);
+
+/* Stack the frames added since the last stack */
+int ps_engine_stack(ps_engine *engine, ps_image *result);
+
+/* Stack a whole video or SER capture */
+int ps_engine_stack_capture(ps_engine *engine, const char *path,
+                            ps_image *result);
+
+const char *ps_engine_last_error(const ps_engine *engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+// Process-wide stage timings, off by default. When disabled a ScopedStage
+// costs one relaxed load, when enabled every stage records wall time,
+// thread CPU time and the bytes it produced into a per-thread buffer
+class Profiler {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  static void enable();
+
+  // Stop recording, events recorded so far are kept for the writers
+  static void disable();
+
+  static bool enabled();
+
+  // Drop everything recorded so far and restart the session clock
+  static void reset();
+
+  static void record(const char *stage, Clock::time_point start,
+                     Clock::time_point end, double cpu_ms, size_t bytes);
+
+  // Per-stage and per-thread totals, throughput and peak RSS as JSON
+  static bool write_summary(const std::string &path);
+
+  // Chrome trace-event file, open with chrome://tracing or Perfetto
+  static bool write_trace(const std::string &path);
+
+  // CPU time consumed by the calling thread so far
+  static double thread_cpu_ms();
+
+  // Peak resident set size of the process
+  static size_t peak_rss_bytes();
+
+private:
+  // Private constructor to prevent instantiation
+  Profiler() = default;
+};
+
+// Times the enclosing scope as one event of the named stage, name must be
+// a string literal or otherwise outlive the profiling session
+class ScopedStage {
+public:
+  explicit ScopedStage(const char *stage);
+
+  ~ScopedStage();
+
+  ScopedStage(const ScopedStage &) = delete;
+  ScopedStage &operator=(const ScopedStage &) = delete;
+
+  // Attribute bytes allocated for the stage's output to this event
+  void add_bytes(size_t count);
+
+private:
+  const char *stage;
+  bool active;
+  size_t bytes = 0;
+  double cpu_start_ms = 0.0;
+  Profiler::Clock::time_point start;
+};
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef SER_FILE_HPP
+#define SER_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <opencv2/core/mat.hpp>
+#include <string>
+#include <vector>
+
+// Colour layouts of the SER format (ColorID header field)
+enum class SerColor {
+  Mono = 0,
+  BayerRGGB = 8,
+  BayerGRBG = 9,
+  BayerGBRG = 10,
+  BayerBGGR = 11,
+  RGB = 100,
+  BGR = 101
+};
+
+// Memory-mapped reader for SER captures: a 178-byte header, fixed-size raw
+// frames (mono, Bayer or RGB at 8 or 16 bits) and an optional trailer of
+// per-frame timestamps. Frames are addressed by index in O(1) and handed
+// out without decoding
+class SerReader {
+public:
+  explicit SerReader(const std::string &path);
+
+  ~SerReader();
+
+  SerReader(const SerReader &) = delete;
+  SerReader &operator=(const SerReader &) = delete;
+
+  // True for paths with a .ser extension (any case)
+  static bool is_ser_file(const std::string &path);
+
+  [[nodiscard]] int frame_count() const;
+
+  [[nodiscard]] cv::Size frame_size() const;
+
+  [[nodiscard]] int bit_depth() const;
+
+  [[nodiscard]] SerColor color() const;
+
+  [[nodiscard]] bool is_bayer() const;
+
+  // Frame as stored in the file. A zero-copy view into the mapping that
+  // stays valid while the reader lives, only 16-bit data in the non-native
+  // byte order is swapped into a copy
+  [[nodiscard]] cv::Mat raw_frame(int index) const;
+
+  // Frame as mono or BGR in the file's bit depth, Bayer mosaics are
+  // demosaiced and RGB is reordered, mono and BGR stay zero-copy
+  [[nodiscard]] cv::Mat frame(int index) const;
+
+  [[nodiscard]] bool has_timestamps() const;
+
+  // Capture time in 100 ns ticks since 0001-01-01 UTC
+  [[nodiscard]] uint64_t timestamp(int index) const;
+
+  // cv::cvtColor code demosaicing the given Bayer layout to BGR
+  static int bayer_to_bgr_code(SerColor color);
+
+private:
+  void map_file(const std::string &path);
+
+  void parse_header(const std::string &path);
+
+  const uchar *data = nullptr;
+  size_t file_size = 0;
+  bool mapped = false;
+  std::vector<uchar> fallback_buffer;
+
+  int width = 0;
+  int height = 0;
+  int depth = 0;
+  int frames = 0;
+  SerColor color_id = SerColor::Mono;
+  bool swap_bytes = false;
+  size_t frame_bytes = 0;
+  int raw_type = 0;
+};
+
+// Minimal SER writer, used to produce synthetic captures for tests and
+// benchmarks. Frame count and timestamps are written on close
+class SerWriter {
+public:
+  SerWriter(const std::string &path, cv::Size size, SerColor color,
+            int bit_depth);
+
+  ~SerWriter();
+
+  SerWriter(const SerWriter &) = delete;
+  SerWriter &operator=(const SerWriter &) = delete;
+
+  void add(const cv::Mat &frame, uint64_t timestamp = 0);
+
+  void close();
+
+private:
+  std::ofstream out;
+  cv::Size size;
+  SerColor color;
+  int bit_depth;
+  int frames = 0;
+  std::vector<uint64_t> timestamps;
+};
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef STACKING_ENGINE_HPP
+#define STACKING_ENGINE_HPP
+
+#include "cropped_image.hpp"
+#include "image_aligner.hpp"
+#include "image_stacker.hpp"
+#include "planet_detector.hpp"
+#include "video_processor.hpp"
+#include <cstddef>
+#include <opencv2/core/mat.hpp>
+#include <string>
+#include <vector>
+
+// Settings of one engine, fixed when it is created
+struct EngineOptions {
+  int crop_size = 0;
+  int frame_skip = 1;         // stack_capture only
+  double keep_percent = 0.0;  // keep the best percent of frames, 0 keeps all
+  size_t keep_count = 0;      // keep the best count of frames, 0 keeps all
+  float contrast_weight = 0.2f;
+  float sharpness_weight = 0.5f;
+  float snr_weight = 0.3f;
+  float sigma_threshold = 3.0f;
+  int sigma_iterations = 1;
+  ImageStacker::RejectionMode rejection_mode =
+      ImageStacker::RejectionMode::ReplaceWithMedian;
+  float percentile_low = 0.1f;  // ranks kept by Percentile rejection
+  float percentile_high = 0.9f;
+  int ap_grid = 0;
+  int ap_box_size = 64;
+  int pyramid_levels = 0;
+  int pyramid_window = 256;
+  bool track_target = true;
+  int threads = 0; // OpenMP threads for this engine's work, 0 keeps the default
+};
+
+// The whole pipeline behind one object that is configured once and reused
+// for many stacks, as a capture service does. Frames are fed one at a time
+// or a capture file is stacked in one call. Crops, aligned frames (only
+// warped for multi-point alignment) and the alignment scratch come from
+// the FramePool and the frame vectors keep their capacity, so every run
+// after the first reuses the buffers of the one before. The engine hands
+// its own settings to every stage and never changes the process-wide ones,
+// which only supply what EngineOptions does not cover (scoring metric,
+// decode queue), so engines with different options can run in parallel on
+// separate threads
+class StackingEngine {
+public:
+  explicit StackingEngine(EngineOptions options);
+
+  [[nodiscard]] const EngineOptions &options() const;
+
+  // Locate the target in one 8- or 16-bit mono or BGR frame, in capture
+  // order, and keep its crop for the next stack
+  void add_frame(const cv::Mat &frame);
+
+  // Frames added since the last stack
+  [[nodiscard]] size_t frame_count() const;
+
+  // Select, align and stack the added frames as CV_32F in the frames'
+  // sample scale, then start over for the next run
+  cv::Mat stack();
+
+  // Decode, select, align and stack a whole video or SER capture
+  cv::Mat stack_capture(const std::string &path);
+
+  // Drop the added frames without stacking them
+  void reset();
+
+private:
+  cv::Mat stack_crops();
+
+  EngineOptions settings;
+  VideoProcessor::Settings capture_settings;
+  ImageAligner::Settings aligner_settings;
+  ImageStacker::Settings stacker_settings;
+  PlanetTracker tracker;
+  std::vector<CroppedImage> crops;
+  std::vector<cv::Mat> aligned;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef TILE_STORE_HPP
+#define TILE_STORE_HPP
+
+#include <cstddef>
+#include <opencv2/core/mat.hpp>
+#include <string>
+#include <vector>
+
+// Scratch file holding every aligned frame of a stack in tile-major order:
+// frames are cut into bands of whole rows and band t of every frame is
+// stored contiguously, so stacking can stream one band of all frames at a
+// time with sequential reads. The file is memory-mapped and removed when
+// the store is destroyed, resident memory is O(band x frames)
+class TileStore {
+public:
+  static std::string scratch_dir; // directory of the scratch file, empty to stack in memory (default: empty)
+  static size_t max_band_bytes;   // budget for one band of all frames (default: 64 MiB)
+
+  // Scratch space for count frames of the given geometry and type,
+  // created in directory
+  TileStore(const std::string &directory, size_t count, cv::Size frame_size,
+            int type);
+
+  ~TileStore();
+
+  TileStore(const TileStore &) = delete;
+  TileStore &operator=(const TileStore &) = delete;
+
+  // Copy frame index into its slots, thread-safe for distinct indices
+  void write_frame(size_t index, const cv::Mat &frame);
+
+  [[nodiscard]] size_t frame_count() const;
+
+  [[nodiscard]] cv::Size frame_size() const;
+
+  [[nodiscard]] int type() const;
+
+  [[nodiscard]] int band_count() const;
+
+  // Rows covered by band t
+  [[nodiscard]] cv::Range band_rows(int band) const;
+
+  // Band t of every frame as views into the mapping
+  [[nodiscard]] std::vector<cv::Mat> band(int band) const;
+
+  // Let the OS drop the pages of band t, they are not read again
+  void release_band(int band) const;
+
+private:
+  [[nodiscard]] size_t band_offset(int band) const;
+
+  size_t count;
+  cv::Size size;
+  int mat_type;
+  size_t row_bytes;
+  int rows_per_band;
+  int bands;
+
+  uchar *data = nullptr;
+  size_t total_bytes = 0;
+  bool mapped = false;
+  std::vector<uchar> fallback_buffer;
+};
+
+#endif
@@ -2,17 +2,95 @@
 #define VIDEO_PROCESSOR_HPP
 
 #include "cropped_image.hpp"
+#include "planet_detector.hpp"
+#include "ser_file.hpp"
+#include <cstddef>
+#include <functional>
 #include <opencv2/videoio.hpp>
+#include <string>
 #include <vector>
 
 class VideoProcessor {
 public:
+    static int queue_depth; // max decoded full-size frames in flight (default: 32)
+    static bool track_target; // locate the target by tracking it across frames (default: true)
+    static int decode_segments; // parallel decoders, 0 picks one per four threads up to 8 (default: 0)
+    static int min_segment_frames; // fewest kept frames worth a decoder of their own (default: 32)
+    static bool debayer_after_crop; // demosaic raw Bayer SER frames only inside the crop (default: true)
+
+    // How frames are located and scored, for callers that keep their own
+    // settings instead of the process-wide ones
+    struct Settings {
+        bool track_target;
+        CroppedImage::QualityWeights weights;
+    };
+
+    // Process-wide settings as they are now
+    static Settings currentSettings();
+
+    // Receives each crop as soon as it exists with the centroid it was cut
+    // around, called concurrently from the crop workers so it must be
+    // thread-safe
+    using FrameSink = std::function<void(int frame_index, Centroid centroid,
+                                         CroppedImage &&cropped)>;
+
+    // Frame of a capture and where its target was found
+    struct LocatedFrame {
+        int index;
+        Centroid centroid;
+    };
+
+    static std::vector<CroppedImage>
+    processVideo(const std::string &video_path, int crop_size, int frame_skip = 1,
+                 const Settings &settings = currentSettings());
+
+    // Crops of every frame, or only of the best ones when keep_count or
+    // keep_percent asks for a selection, in frame order either way
     static std::vector<CroppedImage>
-    processVideo(const std::string &video_path, int crop_size, int frame_skip = 1);
+    processBestFrames(const std::string &video_path, int crop_size,
+                      int frame_skip, double keep_percent, size_t keep_count,
+                      const Settings &settings = currentSettings());
+
+    // Decode, crop and score frames on a bounded ring without ever holding
+    // the whole video in memory
+    static void streamVideo(const std::string &video_path, int crop_size,
+                            int frame_skip, const FrameSink &sink,
+                            const Settings &settings = currentSettings());
+
+    // Number of frames streamVideo will deliver, or -1 if the container
+    // does not report a frame count
+    static int estimateFrameCount(const std::string &video_path, int frame_skip = 1);
+
+    // Crops of the given frames around known centroids, in the order given.
+    // Nothing is detected and no other frame is decoded: SER frames are
+    // read by index, videos skip to each frame in turn, so frames must be
+    // in ascending order
+    static std::vector<CroppedImage>
+    cropFrames(const std::string &video_path, int crop_size,
+               const std::vector<LocatedFrame> &frames);
+
+    // Same crops handed to sink one at a time, position being the place of
+    // the frame in frames, so only one crop is alive at any time
+    using CropSink = std::function<void(size_t position, CroppedImage &&cropped)>;
+    static void cropFrames(const std::string &video_path, int crop_size,
+                           const std::vector<LocatedFrame> &frames,
+                           const CropSink &sink);
+
+    // Seek cap so its next grab() returns frame, confirmed by the timestamp
+    // of the frame before it. False if the seek cannot be confirmed (no
+    // frame rate, variable frame rate, inexact backend), cap is then
+    // reopened on the first frame and must be read up to frame
+    static bool seekToFrame(cv::VideoCapture &cap, const std::string &video_path,
+                            int frame);
+
+    // SER frame as mono or BGR in its own 8- or 16-bit depth, smaller bit
+    // depths stretched to the full range. Mono captures are not expanded to
+    // BGR, they stay single-channel through cropping, alignment and stacking
+    static cv::Mat readSerFrame(const SerReader &reader, int index);
 
 private:
     // Private constructor to prevent instantiation
     VideoProcessor() = default;
 };
 
-#endif
\ No newline at end of file
+#endif
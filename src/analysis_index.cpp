@@ -0,0 +1,597 @@
+#include "analysis_index.hpp"
+#include "frame_selector.hpp"
+#include "image_aligner.hpp"
+#include "planet_detector.hpp"
+#include "ser_file.hpp"
+#include "video_processor.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+bool AnalysisIndex::enabled = true;
+
+namespace {
+// Indexes are caches of one machine, written in host byte order
+constexpr char index_magic[] = "PSINDX01";
+constexpr size_t index_magic_size = sizeof(index_magic) - 1;
+constexpr uint32_t index_version = 2;
+
+// Bytes of one frame record
+constexpr std::streamoff record_size = 3 * sizeof(int32_t) + 3 * sizeof(double) +
+                                       sizeof(uint8_t) + 3 * sizeof(double) +
+                                       sizeof(int32_t);
+
+// Bytes hashed at each end of the capture
+constexpr std::streamoff fingerprint_span = 1 << 20;
+
+template <typename T> void write_value(std::ofstream &out, const T value) {
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> T read_value(std::ifstream &in) {
+  T value{};
+  in.read(reinterpret_cast<char *>(&value), sizeof(T));
+  if (!in) {
+    throw std::runtime_error("Truncated analysis index.");
+  }
+  return value;
+}
+
+// FNV-1a
+uint64_t hash_bytes(uint64_t hash, const char *data, const size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+template <typename T> uint64_t hash_value(const uint64_t hash, const T value) {
+  return hash_bytes(hash, reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+// Size, modification time and the first and last MiB identify a capture
+// without reading gigabytes of it: a capture that is rewritten, appended
+// to or replaced under the same name changes at least one of them
+uint64_t fingerprint_of(const std::string &path) {
+  const auto size = static_cast<std::streamoff>(fs::file_size(path));
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  hash = hash_value<int64_t>(hash, size);
+  hash = hash_value<int64_t>(
+    hash, fs::last_write_time(path).time_since_epoch().count());
+
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    throw std::runtime_error("Could not read capture: " + path);
+  }
+  std::vector<char> buffer(static_cast<size_t>(std::min(size, fingerprint_span)));
+  in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+  hash = hash_bytes(hash, buffer.data(), static_cast<size_t>(in.gcount()));
+  if (size > fingerprint_span) {
+    in.clear();
+    in.seekg(std::max(fingerprint_span, size - fingerprint_span));
+    in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    hash = hash_bytes(hash, buffer.data(), static_cast<size_t>(in.gcount()));
+  }
+  return hash;
+}
+
+// Settings that change which pixels a crop holds or how it is scored.
+// Quality weights and selection are left out, they are applied to the
+// stored terms on every run
+std::vector<int64_t> analysis_settings(const int crop_size, const int frame_skip) {
+  return {
+    crop_size,
+    frame_skip,
+    VideoProcessor::track_target,
+    VideoProcessor::debayer_after_crop,
+    PlanetTracker::detection_size,
+    static_cast<int64_t>(CroppedImage::sharpness_metric),
+    std::max(1, CroppedImage::sample_step),
+  };
+}
+
+double score_of(const FrameAnalysis &frame) {
+  // Same expression as CroppedImage so ties and rankings match exactly
+  return CroppedImage::contrast_weight * frame.contrast +
+         CroppedImage::sharpness_weight * frame.sharpness +
+         CroppedImage::snr_weight * frame.snr;
+}
+
+bool finite(const double value) { return std::isfinite(value); }
+
+// Values a frame record can hold after an analysis, the shift reference
+// is checked against the other records
+bool plausible(const FrameAnalysis &frame) {
+  return frame.centroid.x >= 0 && frame.centroid.y >= 0 &&
+         finite(frame.contrast) && finite(frame.sharpness) &&
+         finite(frame.snr) && finite(frame.shift.x) && finite(frame.shift.y) &&
+         finite(frame.response) && (!frame.aligned || frame.reference >= 0);
+}
+} // namespace
+
+AnalysisIndex::AnalysisIndex(std::string capture_path, const int crop_size,
+                             const int frame_skip)
+  : capture_path(std::move(capture_path)),
+    path(sidecar_path(this->capture_path)), crop_size(crop_size),
+    frame_skip(frame_skip) {
+  if (crop_size < 1) {
+    throw std::invalid_argument("Crop size must be positive.");
+  }
+  if (frame_skip < 1) {
+    throw std::invalid_argument("Frame skip must be at least 1.");
+  }
+}
+
+std::string AnalysisIndex::sidecar_path(const std::string &capture_path) {
+  const fs::path capture(capture_path);
+  return (capture.parent_path() / "output" /
+          (capture.stem().string() + ".analysis"))
+    .string();
+}
+
+std::vector<CroppedImage> AnalysisIndex::crop_best(const double keep_percent,
+                                                   const size_t keep_count) {
+  std::vector<CroppedImage> crops;
+  if (select_indexed(keep_percent, keep_count)) {
+    crops.reserve(selected.size());
+    crop_selected([&crops](size_t, CroppedImage &&cropped) {
+      crops.push_back(std::move(cropped));
+    });
+    return crops;
+  }
+
+  // Without a capacity every crop is kept and the selection made afterwards
+  const size_t capacity = stream_capacity(keep_percent, keep_count);
+  std::optional<FrameSelector> selector;
+  if (capacity > 0) {
+    selector.emplace(capacity);
+  }
+
+  std::mutex mutex;
+  std::vector<std::pair<int, CroppedImage>> kept;
+  analyse([&](const int frame_index, CroppedImage &&cropped) {
+    if (selector) {
+      selector->offer(frame_index, std::move(cropped));
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    kept.emplace_back(frame_index, std::move(cropped));
+  });
+
+  if (selector) {
+    std::vector<int> indices;
+    crops = selector->take(&indices);
+    selected = positions_of(indices);
+    return crops;
+  }
+
+  std::sort(kept.begin(), kept.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+  selected = select(keep_percent, keep_count);
+  crops.reserve(selected.size());
+  for (const size_t position: selected) {
+    crops.push_back(std::move(kept[position].second));
+  }
+  return crops;
+}
+
+std::unique_ptr<CropSpool>
+AnalysisIndex::spool_best(const double keep_percent, const size_t keep_count,
+                          const std::string &directory,
+                          std::vector<CropSpool::Entry> &kept) {
+  if (select_indexed(keep_percent, keep_count)) {
+    auto spool = std::make_unique<CropSpool>(directory, 0);
+    CropSpool &target = *spool;
+    crop_selected([this, &target](const size_t position, CroppedImage &&cropped) {
+      target.offer(analysis[selected[position]].index, cropped);
+    });
+    kept = spool->kept();
+    return spool;
+  }
+
+  const size_t capacity = stream_capacity(keep_percent, keep_count);
+  auto spool = std::make_unique<CropSpool>(directory, capacity);
+  CropSpool &target = *spool;
+  analyse([&target](const int frame_index, CroppedImage &&cropped) {
+    target.offer(frame_index, cropped);
+  });
+
+  // Without a capacity every crop was spooled, the spool ranks them as
+  // select does
+  kept = spool->kept(
+    capacity == 0 ? select(keep_percent, keep_count).size() : 0);
+  std::vector<int> indices;
+  indices.reserve(kept.size());
+  for (const auto &entry: kept) {
+    indices.push_back(entry.frame_index);
+  }
+  selected = positions_of(indices);
+  return spool;
+}
+
+bool AnalysisIndex::select_indexed(const double keep_percent,
+                                   const size_t keep_count) {
+  served = false;
+  if (!current && enabled) {
+    current = load();
+  }
+  if (!current) {
+    return false;
+  }
+
+  selected = select(keep_percent, keep_count);
+  served = true;
+  return true;
+}
+
+void AnalysisIndex::crop_selected(const VideoProcessor::CropSink &sink) const {
+  std::vector<VideoProcessor::LocatedFrame> located;
+  located.reserve(selected.size());
+  for (const size_t position: selected) {
+    located.push_back({analysis[position].index, analysis[position].centroid});
+  }
+  VideoProcessor::cropFrames(capture_path, crop_size, located, sink);
+}
+
+std::vector<cv::Point2d>
+AnalysisIndex::shifts(const std::vector<CroppedImage> &crops) {
+  if (crops.size() != selected.size()) {
+    throw std::invalid_argument("Shifts need the crops of the last selection.");
+  }
+  served = false;
+  if (crops.empty()) {
+    return {};
+  }
+
+  std::vector<cv::Point2d> result = stored_shifts();
+  if (!result.empty()) {
+    return result;
+  }
+
+  std::vector<double> responses;
+  result = ImageAligner::compute_shifts(crops, &responses);
+  store_shifts(result, responses);
+  return result;
+}
+
+std::vector<cv::Point2d> AnalysisIndex::stored_shifts() {
+  served = false;
+  if (selected.empty() || pyramid_levels != ImageAligner::pyramid_levels ||
+      pyramid_window != ImageAligner::pyramid_window) {
+    return {};
+  }
+  // Shifts against different frames cannot be compared
+  const int reference = analysis[selected.front()].reference;
+  const bool known =
+    std::all_of(selected.begin(), selected.end(), [&](const size_t position) {
+      return analysis[position].aligned &&
+             analysis[position].reference == reference;
+    });
+  if (!known) {
+    return {};
+  }
+
+  // Stored shifts may be relative to another frame, a translation moves
+  // them all onto this selection's template
+  const cv::Point2d base = analysis[selected[template_position()]].shift;
+  std::vector<cv::Point2d> result(selected.size());
+  for (size_t i = 0; i < selected.size(); ++i) {
+    result[i] = analysis[selected[i]].shift - base;
+  }
+  served = true;
+  return result;
+}
+
+void AnalysisIndex::store_shifts(const std::vector<cv::Point2d> &shifts,
+                                 const std::vector<double> &responses) {
+  if (shifts.size() != selected.size() || responses.size() != selected.size()) {
+    throw std::invalid_argument("Shifts need the frames of the last selection.");
+  }
+  if (selected.empty()) {
+    return;
+  }
+  const int reference = analysis[selected[template_position()]].index;
+
+  if (pyramid_levels != ImageAligner::pyramid_levels ||
+      pyramid_window != ImageAligner::pyramid_window) {
+    // Estimated with other settings, they would not mix with these
+    for (auto &frame: analysis) {
+      frame.aligned = false;
+    }
+  } else {
+    // Frames outside the selection keep their shifts. A selected frame
+    // that was aligned before links its old reference to the new one, the
+    // frames sharing that reference are translated onto the new one
+    std::map<int, cv::Point2d> links;
+    for (size_t i = 0; i < selected.size(); ++i) {
+      const FrameAnalysis &frame = analysis[selected[i]];
+      if (frame.aligned) {
+        links.emplace(frame.reference, shifts[i] - frame.shift);
+      }
+    }
+    for (auto &frame: analysis) {
+      const auto link = links.find(frame.reference);
+      if (frame.aligned && link != links.end()) {
+        frame.shift += link->second;
+        frame.reference = reference;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < selected.size(); ++i) {
+    FrameAnalysis &frame = analysis[selected[i]];
+    frame.aligned = true;
+    frame.shift = shifts[i];
+    frame.response = responses[i];
+    frame.reference = reference;
+  }
+  pyramid_levels = ImageAligner::pyramid_levels;
+  pyramid_window = ImageAligner::pyramid_window;
+  if (enabled) {
+    save();
+  }
+}
+
+bool AnalysisIndex::reused() const { return served; }
+
+const std::vector<FrameAnalysis> &AnalysisIndex::frames() const {
+  return analysis;
+}
+
+std::vector<size_t> AnalysisIndex::select(const double keep_percent,
+                                          const size_t keep_count) const {
+  size_t capacity = analysis.size();
+  if (keep_count > 0) {
+    capacity = std::min(keep_count, capacity);
+  } else if (keep_percent > 0.0) {
+    capacity = std::min(
+      FrameSelector::capacity_for_percent(analysis.size(), keep_percent),
+      capacity);
+  }
+
+  std::vector<size_t> order(analysis.size());
+  std::iota(order.begin(), order.end(), size_t{0});
+  if (capacity < order.size()) {
+    // FrameSelector's ranking: higher score first, earlier frame on ties
+    std::partial_sort(order.begin(), order.begin() + capacity, order.end(),
+                      [this](const size_t a, const size_t b) {
+                        const double score_a = score_of(analysis[a]);
+                        const double score_b = score_of(analysis[b]);
+                        if (score_a != score_b) {
+                          return score_a > score_b;
+                        }
+                        return a < b;
+                      });
+    order.resize(capacity);
+    std::sort(order.begin(), order.end());
+  }
+  return order;
+}
+
+size_t AnalysisIndex::stream_capacity(const double keep_percent,
+                                      const size_t keep_count) const {
+  if (keep_count > 0 || keep_percent <= 0.0) {
+    return keep_count;
+  }
+  const int total_frames =
+    VideoProcessor::estimateFrameCount(capture_path, frame_skip);
+  return total_frames > 0
+           ? FrameSelector::capacity_for_percent(
+               static_cast<size_t>(total_frames), keep_percent)
+           : 0;
+}
+
+size_t AnalysisIndex::template_position() const {
+  // ImageAligner picks the best crop as template, the first one on ties
+  size_t position = 0;
+  for (size_t i = 1; i < selected.size(); ++i) {
+    if (score_of(analysis[selected[i]]) > score_of(analysis[selected[position]])) {
+      position = i;
+    }
+  }
+  return position;
+}
+
+std::vector<size_t>
+AnalysisIndex::positions_of(const std::vector<int> &indices) const {
+  std::vector<size_t> positions;
+  positions.reserve(indices.size());
+  for (const int index: indices) {
+    FrameAnalysis key;
+    key.index = index;
+    positions.push_back(static_cast<size_t>(
+      std::lower_bound(analysis.begin(), analysis.end(), key,
+                       [](const FrameAnalysis &a, const FrameAnalysis &b) {
+                         return a.index < b.index;
+                       }) -
+      analysis.begin()));
+  }
+  return positions;
+}
+
+void AnalysisIndex::analyse(const CropKeeper &keep) {
+  // Fingerprint before decoding, a capture still growing during the run
+  // must not be mistaken for the frames analysed
+  fingerprint = fingerprint_of(capture_path);
+
+  std::mutex mutex;
+  std::vector<FrameAnalysis> found;
+  VideoProcessor::streamVideo(
+    capture_path, crop_size, frame_skip,
+    [&](const int frame_index, const Centroid centroid, CroppedImage &&cropped) {
+      FrameAnalysis frame;
+      frame.index = frame_index;
+      frame.centroid = centroid;
+      frame.contrast = cropped.get_contrast();
+      frame.sharpness = cropped.get_sharpness();
+      frame.snr = cropped.get_snr();
+      keep(frame_index, std::move(cropped));
+
+      std::lock_guard<std::mutex> lock(mutex);
+      found.push_back(frame);
+    });
+
+  std::sort(found.begin(), found.end(),
+            [](const FrameAnalysis &a, const FrameAnalysis &b) {
+              return a.index < b.index;
+            });
+  analysis = std::move(found);
+  pyramid_levels = -1;
+  pyramid_window = -1;
+  current = true;
+
+  if (enabled) {
+    save();
+  }
+}
+
+bool AnalysisIndex::load() {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+
+  try {
+    char magic[index_magic_size];
+    in.read(magic, index_magic_size);
+    if (!in || std::memcmp(magic, index_magic, index_magic_size) != 0 ||
+        read_value<uint32_t>(in) != index_version) {
+      return false;
+    }
+
+    fingerprint = fingerprint_of(capture_path);
+    if (read_value<uint64_t>(in) != fingerprint) {
+      return false;
+    }
+    const std::vector<int64_t> settings = analysis_settings(crop_size, frame_skip);
+    if (read_value<uint64_t>(in) != settings.size()) {
+      return false;
+    }
+    for (const int64_t setting: settings) {
+      if (read_value<int64_t>(in) != setting) {
+        return false;
+      }
+    }
+
+    const auto levels = read_value<int32_t>(in);
+    const auto window = read_value<int32_t>(in);
+    const auto count = read_value<uint64_t>(in);
+
+    // A count the file cannot hold is damage, not a reason to allocate it
+    const std::streamoff header_end = in.tellg();
+    in.seekg(0, std::ios::end);
+    const std::streamoff records = in.tellg() - header_end;
+    in.seekg(header_end);
+    if (count != static_cast<uint64_t>(records / record_size) ||
+        records % record_size != 0) {
+      return false;
+    }
+
+    // SER captures know their length, video containers only estimate it
+    const int64_t frame_limit = SerReader::is_ser_file(capture_path)
+                                  ? SerReader(capture_path).frame_count()
+                                  : std::numeric_limits<int32_t>::max();
+    std::vector<FrameAnalysis> frames(count);
+    for (size_t i = 0; i < frames.size(); ++i) {
+      FrameAnalysis &frame = frames[i];
+      frame.index = read_value<int32_t>(in);
+      frame.centroid.x = read_value<int32_t>(in);
+      frame.centroid.y = read_value<int32_t>(in);
+      frame.contrast = read_value<double>(in);
+      frame.sharpness = read_value<double>(in);
+      frame.snr = read_value<double>(in);
+      frame.aligned = read_value<uint8_t>(in) != 0;
+      frame.shift.x = read_value<double>(in);
+      frame.shift.y = read_value<double>(in);
+      frame.response = read_value<double>(in);
+      frame.reference = read_value<int32_t>(in);
+
+      // Frames are stored once each in capture order, every frame_skip-th
+      const bool ordered = i == 0 || frame.index > frames[i - 1].index;
+      if (!ordered || frame.index < 0 || frame.index >= frame_limit ||
+          frame.index % frame_skip != 0 || !plausible(frame)) {
+        return false;
+      }
+    }
+    for (const auto &frame: frames) {
+      const auto reference = std::lower_bound(
+        frames.begin(), frames.end(), frame.reference,
+        [](const FrameAnalysis &a, const int index) { return a.index < index; });
+      if (frame.aligned &&
+          (reference == frames.end() || reference->index != frame.reference)) {
+        return false;
+      }
+    }
+
+    analysis = std::move(frames);
+    pyramid_levels = levels;
+    pyramid_window = window;
+    return true;
+  } catch (const std::exception &) {
+    // A damaged index is only a cache miss
+    return false;
+  }
+}
+
+bool AnalysisIndex::save() const {
+  // An index that cannot be written only costs the next run its head start
+  std::error_code error;
+  fs::create_directories(fs::path(path).parent_path(), error);
+
+  const std::string temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      return false;
+    }
+
+    out.write(index_magic, index_magic_size);
+    write_value<uint32_t>(out, index_version);
+    write_value<uint64_t>(out, fingerprint);
+    const std::vector<int64_t> settings = analysis_settings(crop_size, frame_skip);
+    write_value<uint64_t>(out, settings.size());
+    for (const int64_t setting: settings) {
+      write_value<int64_t>(out, setting);
+    }
+
+    write_value<int32_t>(out, pyramid_levels);
+    write_value<int32_t>(out, pyramid_window);
+    write_value<uint64_t>(out, analysis.size());
+    for (const auto &frame: analysis) {
+      write_value<int32_t>(out, frame.index);
+      write_value<int32_t>(out, frame.centroid.x);
+      write_value<int32_t>(out, frame.centroid.y);
+      write_value<double>(out, frame.contrast);
+      write_value<double>(out, frame.sharpness);
+      write_value<double>(out, frame.snr);
+      write_value<uint8_t>(out, frame.aligned ? 1 : 0);
+      write_value<double>(out, frame.shift.x);
+      write_value<double>(out, frame.shift.y);
+      write_value<double>(out, frame.response);
+      write_value<int32_t>(out, frame.reference);
+    }
+
+    if (!out.flush()) {
+      return false;
+    }
+  }
+  fs::rename(temporary, path, error);
+  return !error;
+}
@@ -0,0 +1,248 @@
+#include "batch_scheduler.hpp"
+#include "analysis_index.hpp"
+#include "bounded_queue.hpp"
+#include "cropped_image.hpp"
+#include "image_aligner.hpp"
+#include "image_stacker.hpp"
+#include "image_writer.hpp"
+#include "out_of_core_stacker.hpp"
+#include "profiler.hpp"
+#include "tile_store.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <omp.h>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+int BatchScheduler::max_pending = 1;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+double elapsed_ms(const Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+std::string trim(const std::string &line) {
+  const size_t first = line.find_first_not_of(" \t\r");
+  if (first == std::string::npos) {
+    return {};
+  }
+  const size_t last = line.find_last_not_of(" \t\r");
+  return line.substr(first, last - first + 1);
+}
+
+// Crops waiting between the two lanes, in memory or spooled with
+// --scratch, with the analysis index that chose them. failed is set when
+// cropping threw
+struct CroppedJob {
+  size_t index = 0;
+  std::vector<CroppedImage> crops;
+  ScratchCrops scratch;
+  std::optional<AnalysisIndex> analysis;
+  bool failed = false;
+};
+} // namespace
+
+BatchScheduler::BatchScheduler(BatchOptions options)
+  : options(std::move(options)) {
+  if (this->options.crop_size < 1 || this->options.frame_skip < 1) {
+    throw std::invalid_argument("Crop size and frame skip must be positive.");
+  }
+  if (this->options.keep_percent < 0.0 || this->options.keep_percent > 100.0) {
+    throw std::invalid_argument("Keep percent must be in [0, 100].");
+  }
+}
+
+bool BatchScheduler::is_capture(const std::string &path) {
+  std::string extension = fs::path(path).extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  static const std::vector<std::string> extensions = {
+    ".ser", ".avi", ".mp4", ".mov", ".mkv", ".m4v", ".wmv"
+  };
+  return std::find(extensions.begin(), extensions.end(), extension) !=
+         extensions.end();
+}
+
+std::vector<std::string> BatchScheduler::collect_inputs(const std::string &source) {
+  std::vector<std::string> inputs;
+
+  if (fs::is_directory(source)) {
+    for (const auto &entry: fs::directory_iterator(source)) {
+      if (entry.is_regular_file() && is_capture(entry.path().string())) {
+        inputs.push_back(entry.path().string());
+      }
+    }
+    std::sort(inputs.begin(), inputs.end());
+    return inputs;
+  }
+
+  std::ifstream list(source);
+  if (!list) {
+    throw std::runtime_error("Could not open batch list: " + source);
+  }
+
+  // Relative entries are resolved against the list's directory
+  const fs::path base = fs::path(source).parent_path();
+  std::string line;
+  while (std::getline(list, line)) {
+    line = trim(line);
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    const fs::path path(line);
+    inputs.push_back(path.is_absolute() ? line : (base / path).string());
+  }
+  return inputs;
+}
+
+std::string BatchScheduler::output_path_for(const std::string &input,
+                                            const std::string &format) {
+  const fs::path input_path(input);
+  return (input_path.parent_path() / "output" /
+          (input_path.stem().string() + "_stacked." + format))
+      .string();
+}
+
+std::vector<JobStatus>
+BatchScheduler::run(const std::vector<std::string> &inputs,
+                    const StatusCallback &on_status) const {
+  std::vector<JobStatus> statuses(inputs.size());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    statuses[i].input = inputs[i];
+    statuses[i].output = output_path_for(inputs[i], options.output_format);
+  }
+  if (inputs.empty()) {
+    return statuses;
+  }
+
+  // With a single job there is nothing to overlap, it gets every thread
+  const int total_threads = std::max(1, omp_get_max_threads());
+  const bool overlap = inputs.size() > 1;
+  const int crop_threads = overlap ? std::max(1, total_threads / 2) : total_threads;
+  const int stack_threads =
+      overlap ? std::max(1, total_threads - crop_threads) : total_threads;
+
+  BoundedQueue<CroppedJob> pending(static_cast<size_t>(std::max(1, max_pending)));
+
+  // Crop lane: each status is only touched here until its job is pushed,
+  // the queue hands it over to the stack lane
+  std::thread crop_lane([this, &inputs, &statuses, &pending, crop_threads] {
+    omp_set_num_threads(crop_threads);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      CroppedJob job{i};
+      const auto start = Clock::now();
+      try {
+        ScopedStage stage("pipeline.crop");
+        job.analysis.emplace(inputs[i], options.crop_size, options.frame_skip);
+        if (TileStore::scratch_dir.empty()) {
+          job.crops =
+            job.analysis->crop_best(options.keep_percent, options.keep_count);
+          if (job.crops.empty()) {
+            throw std::runtime_error("No images were cropped.");
+          }
+        } else {
+          job.scratch = OutOfCoreStacker::crop(
+            *job.analysis, options.keep_percent, options.keep_count,
+            TileStore::scratch_dir);
+        }
+      } catch (const std::exception &e) {
+        statuses[i].error = e.what();
+        job.failed = true;
+        job.crops.clear();
+        job.scratch = ScratchCrops();
+        job.analysis.reset();
+      }
+      statuses[i].crop_ms = elapsed_ms(start);
+      if (!pending.push(std::move(job))) {
+        break;
+      }
+    }
+    pending.close();
+  });
+
+  // Stack lane runs on the calling thread
+  omp_set_num_threads(stack_threads);
+  try {
+    CroppedJob job;
+    while (pending.pop(job)) {
+      JobStatus &status = statuses[job.index];
+      if (!job.failed) {
+        const auto start = Clock::now();
+        try {
+          int source_depth = CV_8U;
+          cv::Mat stacked;
+          if (TileStore::scratch_dir.empty()) {
+            source_depth = job.crops.front().get_color().depth();
+            status.frames = job.crops.size();
+            if (ImageAligner::ap_grid == 0) {
+              std::vector<cv::Point2d> shifts;
+              {
+                ScopedStage stage("pipeline.align");
+                shifts = job.analysis->shifts(job.crops);
+              }
+
+              ScopedStage stage("pipeline.stack");
+              stacked = ImageStacker::stack_shifted(job.crops, shifts);
+              job.crops.clear();
+            } else {
+              std::vector<cv::Mat> aligned;
+              {
+                ScopedStage stage("pipeline.align");
+                aligned = ImageAligner::align_images(job.crops);
+              }
+              job.crops.clear();
+
+              ScopedStage stage("pipeline.stack");
+              stacked = ImageStacker::stack_images_float(aligned);
+            }
+          } else {
+            source_depth = job.scratch.source_depth;
+            status.frames = job.scratch.count;
+            const std::unique_ptr<TileStore> store = OutOfCoreStacker::align(
+              job.scratch, *job.analysis, TileStore::scratch_dir);
+            job.scratch = ScratchCrops();
+
+            stacked = OutOfCoreStacker::stack(*store);
+          }
+          fs::create_directories(fs::path(status.output).parent_path());
+          if (!ImageWriter::write(status.output, stacked, source_depth)) {
+            throw std::runtime_error("Error saving image to: " + status.output);
+          }
+          status.ok = true;
+        } catch (const std::exception &e) {
+          status.error = e.what();
+        }
+        status.stack_ms = elapsed_ms(start);
+      }
+      job.crops.clear();
+      job.scratch = ScratchCrops();
+
+      if (on_status) {
+        on_status(status);
+      }
+    }
+  } catch (...) {
+    // Unblock the crop lane before leaving
+    pending.cancel();
+    crop_lane.join();
+    omp_set_num_threads(total_threads);
+    throw;
+  }
+
+  crop_lane.join();
+  omp_set_num_threads(total_threads);
+  return statuses;
+}
@@ -0,0 +1,439 @@
+#include "cropped_image.hpp"
+#include "image.hpp"
+#include "image_aligner.hpp"
+#include "image_stacker.hpp"
+#include "planet_detector.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <omp.h>
+#include <opencv2/opencv.hpp>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Full frames are generated and consumed in batches of this size so large
+// sweeps never hold more than one batch of full-size frames
+constexpr int frames_per_batch = 64;
+
+struct BenchConfig {
+  int frames;
+  int crop_size;
+  int channels;
+  int threads;
+};
+
+struct BenchResult {
+  BenchConfig config;
+  double image_ms = 0.0;
+  double crop_ms = 0.0;
+  double score_ms = 0.0;
+  double align_ms = 0.0;
+  double median_ms = 0.0;
+  double median_16u_ms = 0.0;
+  double median_float_ms = 0.0;
+  double median_nth_ms = 0.0;
+  double stack_ms = 0.0;
+  double shift_ms = 0.0;
+  double fused_ms = 0.0;
+  double align_rms_px = 0.0;
+  double align_max_px = 0.0;
+
+  [[nodiscard]] double total_ms() const {
+    return image_ms + crop_ms + score_ms + align_ms + stack_ms;
+  }
+
+  // Warping every frame and stacking the copies
+  [[nodiscard]] double warped_ms() const { return align_ms + stack_ms; }
+
+  // Estimating the shifts and stacking through them, the same result
+  [[nodiscard]] double shifted_ms() const { return shift_ms + fused_ms; }
+
+  [[nodiscard]] double fused_speedup() const {
+    return shifted_ms() > 0.0 ? warped_ms() / shifted_ms() : 0.0;
+  }
+};
+
+struct BenchOptions {
+  std::vector<int> frames = {50, 200};
+  std::vector<int> crop_sizes = {256, 480};
+  std::vector<int> channels = {1, 3};
+  std::vector<int> threads = {1, omp_get_max_threads()};
+  std::string format = "csv";
+  std::string output_path;
+  unsigned seed = 1234;
+};
+
+double elapsed_ms(const Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+std::vector<int> parse_list(const std::string &text) {
+  std::vector<int> values;
+  std::stringstream stream(text);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    values.push_back(std::stoi(item));
+  }
+  return values;
+}
+
+void print_usage(const char *program) {
+  std::cerr << "Usage: " << program
+      << " [--frames 50,200] [--crop 256,480] [--channels 1,3]"
+         " [--threads 1,N] [--format csv|json] [--output <path>]"
+         " [--seed <n>]\n";
+}
+
+// The per-pixel nth_element median the tiled kernels replaced, kept as
+// the baseline: one value vector per pixel gathered across the frames
+cv::Mat nth_element_median(const std::vector<cv::Mat> &float_frames) {
+  const cv::Size size = float_frames.front().size();
+  const int channels = float_frames.front().channels();
+  const size_t count = float_frames.size();
+  cv::Mat median(size, CV_MAKETYPE(CV_32F, channels));
+
+#pragma omp parallel for default(none) collapse(2) schedule(static) \
+  shared(size, channels, count, float_frames, median)
+  for (int y = 0; y < size.height; ++y) {
+    for (int x = 0; x < size.width; ++x) {
+      std::vector<float> values(count);
+      for (int ch = 0; ch < channels; ++ch) {
+        for (size_t i = 0; i < count; ++i) {
+          values[i] = float_frames[i].ptr<float>(y)[x * channels + ch];
+        }
+        const size_t mid = count / 2;
+        std::nth_element(values.begin(), values.begin() + mid, values.end());
+        float value = values[mid];
+        if (count % 2 == 0) {
+          value = (value + *std::max_element(values.begin(),
+                                             values.begin() + mid)) * 0.5f;
+        }
+        median.ptr<float>(y)[x * channels + ch] = value;
+      }
+    }
+  }
+  return median;
+}
+
+// Banded disk with limb darkening, twice the crop size so the detector has
+// sky to reject and the target can drift without touching the edges
+cv::Mat render_planet(const int crop_size, const int channels) {
+  const int size = crop_size * 2;
+  const double radius = 0.35 * crop_size;
+  const double center = size / 2.0;
+
+  cv::Mat planet(size, size, CV_MAKETYPE(CV_8U, channels), cv::Scalar::all(0));
+  for (int y = 0; y < size; ++y) {
+    auto *row = planet.ptr<uchar>(y);
+    for (int x = 0; x < size; ++x) {
+      const double dx = (x - center) / radius;
+      const double dy = (y - center) / radius;
+      const double r2 = dx * dx + dy * dy;
+      if (r2 >= 1.0) {
+        continue;
+      }
+      const double limb = std::sqrt(1.0 - r2);
+      const double bands = 0.75 + 0.25 * std::sin(dy * 18.0);
+      for (int ch = 0; ch < channels; ++ch) {
+        const double tint = 1.0 - 0.12 * ch;
+        row[x * channels + ch] =
+            cv::saturate_cast<uchar>(210.0 * limb * bands * tint + 20.0);
+      }
+    }
+  }
+  return planet;
+}
+
+// One capture frame: the planet moved by shift, blurred by seeing and with
+// sensor noise on top
+cv::Mat synthesize_frame(const cv::Mat &planet, const cv::Point2d shift,
+                         cv::RNG &rng) {
+  cv::Mat frame;
+  const cv::Mat translation =
+      (cv::Mat_<double>(2, 3) << 1, 0, shift.x, 0, 1, shift.y);
+  cv::warpAffine(planet, frame, translation, planet.size());
+
+  const double seeing = rng.uniform(0.6, 2.0);
+  cv::GaussianBlur(frame, frame, cv::Size(0, 0), seeing);
+
+  cv::Mat noise(frame.size(), CV_MAKETYPE(CV_16S, frame.channels()));
+  rng.fill(noise, cv::RNG::NORMAL, cv::Scalar::all(0.0), cv::Scalar::all(4.0));
+  cv::Mat noisy;
+  frame.convertTo(noisy, CV_16S);
+  noisy += noise;
+  noisy.convertTo(frame, planet.type());
+  return frame;
+}
+
+BenchResult run_config(const BenchConfig &config, const unsigned seed) {
+  BenchResult result;
+  result.config = config;
+  omp_set_num_threads(config.threads);
+
+  cv::RNG rng(seed);
+  const cv::Mat planet = render_planet(config.crop_size, config.channels);
+
+  // Known shifts, up to an eighth of the crop so the target stays inside
+  const double max_shift = config.crop_size / 8.0;
+  std::vector<cv::Point2d> true_shifts(config.frames);
+  for (auto &shift: true_shifts) {
+    shift = cv::Point2d(rng.uniform(-max_shift, max_shift),
+                        rng.uniform(-max_shift, max_shift));
+  }
+
+  // Fixed-origin crops keep the true shifts meaningful for the alignment
+  // error, the detector crops are only timed
+  const int origin = config.crop_size / 2;
+  const cv::Rect fixed_crop(origin, origin, config.crop_size, config.crop_size);
+  std::vector<CroppedImage> crops;
+  crops.reserve(config.frames);
+
+  for (int first = 0; first < config.frames; first += frames_per_batch) {
+    const int count = std::min(frames_per_batch, config.frames - first);
+
+    std::vector<cv::Mat> raw(count);
+    for (int i = 0; i < count; ++i) {
+      raw[i] = synthesize_frame(planet, true_shifts[first + i], rng);
+    }
+
+    // Stage: Image construction, forcing the lazy grayscale and binary
+    std::vector<Image> images;
+    images.reserve(count);
+    auto start = Clock::now();
+    for (int i = 0; i < count; ++i) {
+      images.emplace_back(raw[i]);
+      images.back().get_binary();
+    }
+    result.image_ms += elapsed_ms(start);
+
+    // Stage: PlanetDetector::crop, which also scores the crop
+    std::vector<int> detected(count, 0);
+    start = Clock::now();
+#pragma omp parallel for default(none) shared(images, detected, count, config)
+    for (int i = 0; i < count; ++i) {
+      try {
+        PlanetDetector::crop(images[i], config.crop_size);
+        detected[i] = 1;
+      } catch (const std::exception &) {
+        detected[i] = 0;
+      }
+    }
+    result.crop_ms += elapsed_ms(start);
+
+    if (std::count(detected.begin(), detected.end(), 0) > 0) {
+      std::cerr << "  Detection failed on some synthetic frames" << std::endl;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      cv::Mat color = raw[i](fixed_crop).clone();
+      cv::Mat gray = images[i].get_grayscale()(fixed_crop).clone();
+      crops.emplace_back(color, gray);
+    }
+  }
+
+  // Stage: quality scoring on its own, on crops already in memory
+  std::vector<double> scores(crops.size());
+  const int num_crops = static_cast<int>(crops.size());
+  auto start = Clock::now();
+#pragma omp parallel for default(none) shared(crops, scores, num_crops)
+  for (int i = 0; i < num_crops; ++i) {
+    scores[i] = CroppedImage(crops[i].get_color(), crops[i].get_grayscale())
+        .get_quality_score();
+  }
+  result.score_ms = elapsed_ms(start);
+
+  // Stage: alignment, the error compares shifts up to the template offset
+  start = Clock::now();
+  const std::vector<cv::Mat> aligned = ImageAligner::align_images(crops);
+  result.align_ms = elapsed_ms(start);
+
+  start = Clock::now();
+  const std::vector<cv::Point2d> shifts = ImageAligner::compute_shifts(crops);
+  result.shift_ms = elapsed_ms(start);
+  cv::Point2d mean_residual(0.0, 0.0);
+  for (int i = 0; i < num_crops; ++i) {
+    mean_residual += shifts[i] + true_shifts[i];
+  }
+  mean_residual *= 1.0 / num_crops;
+  double sum_sq = 0.0;
+  for (int i = 0; i < num_crops; ++i) {
+    const cv::Point2d error = shifts[i] + true_shifts[i] - mean_residual;
+    const double distance = std::hypot(error.x, error.y);
+    sum_sq += distance * distance;
+    result.align_max_px = std::max(result.align_max_px, distance);
+  }
+  result.align_rms_px = std::sqrt(sum_sq / num_crops);
+
+  // Stage: the same stack read from the crops through their shifts, the
+  // fused alternative to warping (align_ms) and then stacking (stack_ms).
+  // With the shift estimate (shift_ms) it replaces both
+  start = Clock::now();
+  ImageStacker::stack_shifted(crops, shifts);
+  result.fused_ms = elapsed_ms(start);
+  crops.clear();
+
+  // Stage: median kernel on its own, then the full stack
+  start = Clock::now();
+  ImageStacker::compute_median(aligned);
+  result.median_ms = elapsed_ms(start);
+
+  // The same median on 16-bit and float frames, tiled and against the
+  // nth_element baseline. Integer frames are ranked by histogram past a
+  // depth-dependent frame count, these columns show where that pays off.
+  // The copies are not timed
+  {
+    std::vector<cv::Mat> wide_frames(aligned.size());
+    for (size_t i = 0; i < aligned.size(); ++i) {
+      aligned[i].convertTo(wide_frames[i], CV_16U, 257.0);
+    }
+    start = Clock::now();
+    ImageStacker::compute_median(wide_frames);
+    result.median_16u_ms = elapsed_ms(start);
+  }
+  {
+    std::vector<cv::Mat> float_frames(aligned.size());
+    for (size_t i = 0; i < aligned.size(); ++i) {
+      aligned[i].convertTo(float_frames[i], CV_32F);
+    }
+    start = Clock::now();
+    ImageStacker::compute_median(float_frames);
+    result.median_float_ms = elapsed_ms(start);
+
+    start = Clock::now();
+    nth_element_median(float_frames);
+    result.median_nth_ms = elapsed_ms(start);
+  }
+
+  start = Clock::now();
+  ImageStacker::stack_images(aligned);
+  result.stack_ms = elapsed_ms(start);
+
+  return result;
+}
+
+void write_csv(std::ostream &out, const std::vector<BenchResult> &results) {
+  out << "frames,crop_size,channels,threads,image_ms,crop_ms,score_ms,"
+         "align_ms,median_ms,median_16u_ms,median_float_ms,median_nth_ms,"
+         "stack_ms,shift_ms,fused_ms,warped_ms,shifted_ms,fused_speedup,"
+         "total_ms,frames_per_sec,"
+         "align_rms_px,align_max_px\n";
+  for (const auto &r: results) {
+    out << r.config.frames << ',' << r.config.crop_size << ','
+        << r.config.channels << ',' << r.config.threads << ',' << r.image_ms
+        << ',' << r.crop_ms << ',' << r.score_ms << ',' << r.align_ms << ','
+        << r.median_ms << ',' << r.median_16u_ms << ',' << r.median_float_ms
+        << ',' << r.median_nth_ms
+        << ',' << r.stack_ms << ',' << r.shift_ms << ',' << r.fused_ms << ','
+        << r.warped_ms() << ',' << r.shifted_ms() << ',' << r.fused_speedup()
+        << ',' << r.total_ms() << ','
+        << r.config.frames * 1000.0 / r.total_ms() << ',' << r.align_rms_px
+        << ',' << r.align_max_px << '\n';
+  }
+}
+
+void write_json(std::ostream &out, const std::vector<BenchResult> &results) {
+  out << "[\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const auto &r = results[i];
+    out << "  {\"frames\": " << r.config.frames
+        << ", \"crop_size\": " << r.config.crop_size
+        << ", \"channels\": " << r.config.channels
+        << ", \"threads\": " << r.config.threads
+        << ", \"image_ms\": " << r.image_ms << ", \"crop_ms\": " << r.crop_ms
+        << ", \"score_ms\": " << r.score_ms << ", \"align_ms\": " << r.align_ms
+        << ", \"median_ms\": " << r.median_ms
+        << ", \"median_16u_ms\": " << r.median_16u_ms
+        << ", \"median_float_ms\": " << r.median_float_ms
+        << ", \"median_nth_ms\": " << r.median_nth_ms
+        << ", \"stack_ms\": " << r.stack_ms
+        << ", \"shift_ms\": " << r.shift_ms
+        << ", \"fused_ms\": " << r.fused_ms
+        << ", \"warped_ms\": " << r.warped_ms()
+        << ", \"shifted_ms\": " << r.shifted_ms()
+        << ", \"fused_speedup\": " << r.fused_speedup()
+        << ", \"total_ms\": " << r.total_ms()
+        << ", \"frames_per_sec\": " << r.config.frames * 1000.0 / r.total_ms()
+        << ", \"align_rms_px\": " << r.align_rms_px
+        << ", \"align_max_px\": " << r.align_max_px << "}"
+        << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "]\n";
+}
+} // namespace
+
+int main(const int argc, char *argv[]) {
+  BenchOptions options;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--frames" && i + 1 < argc) {
+      options.frames = parse_list(argv[++i]);
+    } else if (arg == "--crop" && i + 1 < argc) {
+      options.crop_sizes = parse_list(argv[++i]);
+    } else if (arg == "--channels" && i + 1 < argc) {
+      options.channels = parse_list(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      options.threads = parse_list(argv[++i]);
+    } else if (arg == "--format" && i + 1 < argc) {
+      options.format = argv[++i];
+    } else if (arg == "--output" && i + 1 < argc) {
+      options.output_path = argv[++i];
+    } else if (arg == "--seed" && i + 1 < argc) {
+      options.seed = static_cast<unsigned>(std::stoul(argv[++i]));
+    } else {
+      std::cerr << "Unknown or incomplete option: " << arg << "\n";
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (options.format != "csv" && options.format != "json") {
+    std::cerr << "Format must be csv or json.\n";
+    return 1;
+  }
+
+  std::vector<BenchResult> results;
+  for (const int frames: options.frames) {
+    for (const int crop_size: options.crop_sizes) {
+      for (const int channels: options.channels) {
+        for (const int threads: options.threads) {
+          const BenchConfig config{frames, crop_size, channels, threads};
+          std::cerr << "Running " << frames << " frames, crop " << crop_size
+              << ", " << channels << " channel(s), " << threads
+              << " thread(s)" << std::endl;
+          try {
+            results.push_back(run_config(config, options.seed));
+          } catch (const std::exception &e) {
+            std::cerr << "  Failed: " << e.what() << std::endl;
+            return 1;
+          }
+        }
+      }
+    }
+  }
+
+  std::ofstream file;
+  if (!options.output_path.empty()) {
+    file.open(options.output_path);
+    if (!file) {
+      std::cerr << "Could not open output file: " << options.output_path
+          << std::endl;
+      return 1;
+    }
+  }
+  std::ostream &out = options.output_path.empty() ? std::cout : file;
+
+  if (options.format == "json") {
+    write_json(out, results);
+  } else {
+    write_csv(out, results);
+  }
+
+  return 0;
+}
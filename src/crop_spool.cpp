@@ -0,0 +1,195 @@
+#include "crop_spool.hpp"
+#include "cropped_image.hpp"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <opencv2/core/mat.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+namespace {
+#if defined(__unix__) || defined(__APPLE__)
+// pread and pwrite may move fewer bytes than asked for
+void write_fully(const int fd, const uchar *data, size_t bytes, size_t offset) {
+  while (bytes > 0) {
+    const ssize_t written = pwrite(fd, data, bytes, static_cast<off_t>(offset));
+    if (written <= 0) {
+      throw std::runtime_error("Could not write crop to scratch file.");
+    }
+    data += written;
+    bytes -= static_cast<size_t>(written);
+    offset += static_cast<size_t>(written);
+  }
+}
+
+void read_fully(const int fd, uchar *data, size_t bytes, size_t offset) {
+  while (bytes > 0) {
+    const ssize_t read = pread(fd, data, bytes, static_cast<off_t>(offset));
+    if (read <= 0) {
+      throw std::runtime_error("Could not read crop from scratch file.");
+    }
+    data += read;
+    bytes -= static_cast<size_t>(read);
+    offset += static_cast<size_t>(read);
+  }
+}
+#endif
+} // namespace
+
+CropSpool::CropSpool(const std::string &directory, const size_t capacity)
+  : capacity(capacity) {
+#if defined(__unix__) || defined(__APPLE__)
+  std::string name =
+      (std::filesystem::path(directory.empty() ? "." : directory) /
+       "planetary_crops_XXXXXX")
+          .string();
+  fd = mkstemp(name.data());
+  if (fd < 0) {
+    throw std::runtime_error("Could not create scratch file in: " + directory);
+  }
+  // Unlinked right away, the space is returned even if the process dies
+  unlink(name.c_str());
+#else
+  // No POSIX files: the crops stay on the heap, only the selection is kept
+  (void)directory;
+#endif
+}
+
+CropSpool::~CropSpool() {
+#if defined(__unix__) || defined(__APPLE__)
+  if (fd >= 0) {
+    close(fd);
+  }
+#endif
+}
+
+bool CropSpool::offer(const int frame_index, const CroppedImage &image) {
+  const cv::Mat color = image.get_color();
+  Entry candidate{frame_index, 0, image.get_quality_score()};
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ++offered_count;
+    if (mat_type < 0) {
+      size = color.size();
+      mat_type = color.type();
+      frame_bytes = color.total() * color.elemSize();
+    } else if (color.size() != size || color.type() != mat_type) {
+      throw std::invalid_argument("Crop does not match the spool geometry.");
+    }
+
+    // Rejected before its pixels are written
+    if (capacity > 0 && entries.size() >= capacity &&
+        !ranks_higher(candidate, entries.front())) {
+      return false;
+    }
+    if (free_slots.empty()) {
+      candidate.slot = slot_count++;
+    } else {
+      candidate.slot = free_slots.back();
+      free_slots.pop_back();
+    }
+  }
+
+  // The slot is ours alone, so the write does not hold up other offers
+  write_slot(candidate.slot, color);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (capacity == 0 || entries.size() < capacity) {
+    entries.push_back(candidate);
+    if (capacity > 0) {
+      std::push_heap(entries.begin(), entries.end(), ranks_higher);
+    }
+    return true;
+  }
+
+  // Better crops may have filled the spool while this one was written
+  if (!ranks_higher(candidate, entries.front())) {
+    free_slots.push_back(candidate.slot);
+    return false;
+  }
+  std::pop_heap(entries.begin(), entries.end(), ranks_higher);
+  free_slots.push_back(entries.back().slot);
+  entries.back() = candidate;
+  std::push_heap(entries.begin(), entries.end(), ranks_higher);
+  return true;
+}
+
+std::vector<CropSpool::Entry> CropSpool::kept(const size_t keep) const {
+  std::vector<Entry> selected;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    selected = entries;
+  }
+
+  if (keep > 0 && keep < selected.size()) {
+    std::nth_element(selected.begin(), selected.begin() + keep, selected.end(),
+                     ranks_higher);
+    selected.resize(keep);
+  }
+  std::sort(selected.begin(), selected.end(), [](const Entry &a, const Entry &b) {
+    return a.frame_index < b.frame_index;
+  });
+  return selected;
+}
+
+size_t CropSpool::offered() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return offered_count;
+}
+
+cv::Size CropSpool::frame_size() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return size;
+}
+
+int CropSpool::type() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return mat_type;
+}
+
+void CropSpool::read(const size_t slot, cv::Mat &crop) const {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (slot >= slot_count) {
+      throw std::out_of_range("Crop spool slot out of range.");
+    }
+  }
+  crop.create(size, mat_type);
+
+#if defined(__unix__) || defined(__APPLE__)
+  read_fully(fd, crop.data, frame_bytes, slot * frame_bytes);
+#else
+  std::lock_guard<std::mutex> lock(mutex);
+  std::memcpy(crop.data, fallback_slots[slot].data(), frame_bytes);
+#endif
+}
+
+void CropSpool::write_slot(const size_t slot, const cv::Mat &crop) {
+  const cv::Mat continuous = crop.isContinuous() ? crop : crop.clone();
+
+#if defined(__unix__) || defined(__APPLE__)
+  write_fully(fd, continuous.data, frame_bytes, slot * frame_bytes);
+#else
+  std::lock_guard<std::mutex> lock(mutex);
+  if (fallback_slots.size() <= slot) {
+    fallback_slots.resize(slot + 1);
+  }
+  fallback_slots[slot].assign(continuous.data, continuous.data + frame_bytes);
+#endif
+}
+
+// Higher quality first, earlier frame wins ties so selection is deterministic
+bool CropSpool::ranks_higher(const Entry &a, const Entry &b) {
+  if (a.score != b.score) {
+    return a.score > b.score;
+  }
+  return a.frame_index < b.frame_index;
+}
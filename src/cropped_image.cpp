@@ -1,47 +1,174 @@
 #include "cropped_image.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <opencv2/core/mat.hpp>
-#include <opencv2/imgproc.hpp>
+#include <stdexcept>
+#include <type_traits>
 
 // Static member initialization
 float CroppedImage::contrast_weight = 0.2f;
 float CroppedImage::sharpness_weight = 0.5f;
 float CroppedImage::snr_weight = 0.3f;
+CroppedImage::SharpnessMetric CroppedImage::sharpness_metric =
+    CroppedImage::SharpnessMetric::Laplacian;
+int CroppedImage::sample_step = 1;
+
+namespace {
+struct QualityStats {
+  double mean;
+  double stddev;
+  double sharpness;
+};
+
+// Integer inputs accumulate exactly in 64-bit, float inputs in double
+template <typename T>
+using Accumulator =
+    std::conditional_t<std::is_integral_v<T>, int64_t, double>;
+
+// Mean, intensity variance and sharpness in a single sweep. Borders use
+// reflect-101 like cv::Laplacian, so the Laplacian metric matches
+// meanStdDev(Laplacian(gray, CV_64F)) exactly
+template <typename T, CroppedImage::SharpnessMetric Metric>
+QualityStats measure(const cv::Mat &gray, const int step) {
+  using Acc = Accumulator<T>;
+  const int rows = gray.rows;
+  const int cols = gray.cols;
+
+  Acc sum = 0, sum_sq = 0, sharp_sum = 0, sharp_sum_sq = 0;
+  int64_t count = 0;
+
+  const auto sharp_at = [](const T *up, const T *cur, const T *down,
+                               const int x, const int left, const int right) {
+    if constexpr (Metric == CroppedImage::SharpnessMetric::Laplacian) {
+      return static_cast<Acc>(up[x]) + down[x] + cur[left] + cur[right] -
+             4 * static_cast<Acc>(cur[x]);
+    } else {
+      const Acc dx = static_cast<Acc>(cur[right]) - cur[x];
+      const Acc dy = static_cast<Acc>(down[x]) - cur[x];
+      return dx * dx + dy * dy;
+    }
+  };
+
+  for (int y = 0; y < rows; y += step) {
+    const T *cur = gray.ptr<T>(y);
+    const T *up = gray.ptr<T>(y > 0 ? y - 1 : std::min(1, rows - 1));
+    const T *down = gray.ptr<T>(y + 1 < rows ? y + 1 : std::max(rows - 2, 0));
+
+    Acc row_sum = 0, row_sq = 0, row_sharp = 0, row_sharp_sq = 0;
+    const auto add = [&](const int x, const int left, const int right) {
+      const Acc value = cur[x];
+      const Acc s = sharp_at(up, cur, down, x, left, right);
+      row_sum += value;
+      row_sq += value * value;
+      row_sharp += s;
+      // Gradient energy is already squared, squaring it again would
+      // overflow 64 bits on 16-bit crops and only the Laplacian needs it
+      if constexpr (Metric == CroppedImage::SharpnessMetric::Laplacian) {
+        row_sharp_sq += s * s;
+      }
+    };
+
+    // Border columns reflect, the interior loop is branch-free and
+    // vectorizes
+    add(0, std::min(1, cols - 1), std::min(1, cols - 1));
+    for (int x = 1; x < cols - 1; ++x) {
+      add(x, x - 1, x + 1);
+    }
+    if (cols > 1) {
+      add(cols - 1, cols - 2, std::max(cols - 2, 0));
+    }
+
+    sum += row_sum;
+    sum_sq += row_sq;
+    sharp_sum += row_sharp;
+    sharp_sum_sq += row_sharp_sq;
+    count += cols;
+  }
+
+  const auto n = static_cast<double>(count);
+  const double mean = static_cast<double>(sum) / n;
+  const double variance = static_cast<double>(sum_sq) / n - mean * mean;
+
+  double sharpness;
+  if constexpr (Metric == CroppedImage::SharpnessMetric::Laplacian) {
+    const double sharp_mean = static_cast<double>(sharp_sum) / n;
+    sharpness = std::sqrt(std::max(
+      static_cast<double>(sharp_sum_sq) / n - sharp_mean * sharp_mean, 0.0));
+  } else {
+    // Energy terms are already squared, the RMS is on the same scale
+    sharpness = std::sqrt(static_cast<double>(sharp_sum) / n);
+  }
+
+  return {mean, std::sqrt(std::max(variance, 0.0)), sharpness};
+}
+
+template <typename T>
+QualityStats measure(const cv::Mat &gray,
+                     const CroppedImage::SharpnessMetric metric,
+                     const int step) {
+  if (metric == CroppedImage::SharpnessMetric::GradientEnergy) {
+    return measure<T, CroppedImage::SharpnessMetric::GradientEnergy>(gray, step);
+  }
+  return measure<T, CroppedImage::SharpnessMetric::Laplacian>(gray, step);
+}
+} // namespace
 
 CroppedImage::CroppedImage(const cv::Mat &color_img,
                            const cv::Mat &grayscale_img)
   : Image() {
+  ScopedStage stage("score");
   color = color_img;
   grayscale = grayscale_img;
-  quality_score = contrast_weight * get_contrast() +
-                  sharpness_weight * get_sharpness() + snr_weight * get_snr();
+  measure_quality();
+  reweigh(current_weights());
+}
+
+CroppedImage::QualityWeights CroppedImage::current_weights() {
+  return QualityWeights{contrast_weight, sharpness_weight, snr_weight};
 }
 
 double CroppedImage::get_quality_score() const { return quality_score; }
 
+void CroppedImage::reweigh(const QualityWeights &weights) {
+  quality_score = weights.contrast * contrast + weights.sharpness * sharpness +
+                  weights.snr * snr;
+}
+
 bool CroppedImage::operator<(const CroppedImage &other) const {
   return quality_score < other.quality_score;
 }
 
-// get contrast using standard deviation of pixel intensities
-double CroppedImage::get_contrast() const {
-  cv::Scalar mean, stddev;
-  cv::meanStdDev(grayscale, mean, stddev);
-  return stddev[0];
-}
+double CroppedImage::get_contrast() const { return contrast; }
 
-// get sharpness using the Laplacian variance
-double CroppedImage::get_sharpness() const {
-  cv::Mat laplacian;
-  cv::Laplacian(grayscale, laplacian, CV_64F);
-  cv::Scalar mean, stddev;
-  cv::meanStdDev(laplacian, mean, stddev);
-  return stddev[0];
-}
+double CroppedImage::get_sharpness() const { return sharpness; }
+
+double CroppedImage::get_snr() const { return snr; }
+
+void CroppedImage::measure_quality() {
+  if (grayscale.empty() || grayscale.channels() != 1) {
+    throw std::invalid_argument("Quality scoring needs a grayscale crop.");
+  }
+
+  const int step = std::max(1, sample_step);
+  QualityStats stats{};
+  switch (grayscale.depth()) {
+    case CV_8U:
+      stats = measure<uchar>(grayscale, sharpness_metric, step);
+      break;
+    case CV_16U:
+      stats = measure<ushort>(grayscale, sharpness_metric, step);
+      break;
+    case CV_32F:
+      stats = measure<float>(grayscale, sharpness_metric, step);
+      break;
+    default:
+      throw std::invalid_argument("Unsupported grayscale depth for scoring.");
+  }
 
-// get signal-to-noise ratio (SNR)
-double CroppedImage::get_snr() const {
-  cv::Scalar mean, stddev;
-  cv::meanStdDev(grayscale, mean, stddev);
-  return mean[0] /
-         (stddev[0] + 1e-8f); // small epsilon to avoid division by zero
+  contrast = stats.stddev;
+  sharpness = stats.sharpness;
+  snr = stats.mean /
+        (stats.stddev + 1e-8f); // small epsilon to avoid division by zero
 }
@@ -0,0 +1,193 @@
+#include "frame_pool.hpp"
+#include <opencv2/core.hpp>
+#include <opencv2/core/mat.hpp>
+#include <unordered_map>
+#include <vector>
+
+size_t FramePool::max_cached_bytes = size_t{512} << 20;
+size_t FramePool::thread_cached_bytes = size_t{64} << 20;
+
+namespace {
+enum class CacheState { Unused, Alive, Destroyed };
+
+// Trivially destructible, so it can still be read after the cache is gone,
+// when Mats are released during static destruction
+thread_local CacheState cache_state = CacheState::Unused;
+} // namespace
+
+struct FramePool::ThreadCache {
+  ThreadCache() { cache_state = CacheState::Alive; }
+
+  ~ThreadCache() {
+    cache_state = CacheState::Destroyed;
+    instance().thread_idle_bytes -= bytes;
+    for (auto &[size, buffers]: idle) {
+      for (void *buffer: buffers) {
+        instance().give_back_shared(buffer, size);
+      }
+    }
+  }
+
+  ThreadCache(const ThreadCache &) = delete;
+  ThreadCache &operator=(const ThreadCache &) = delete;
+
+  std::unordered_map<size_t, std::vector<void *> > idle;
+  size_t bytes = 0;
+};
+
+FramePool &FramePool::instance() {
+  // Intentionally leaked, Mats released during static destruction still
+  // need their allocator
+  static auto *pool = new FramePool();
+  return *pool;
+}
+
+cv::Mat FramePool::acquire(const cv::Size size, const int type) {
+  cv::Mat mat;
+  attach(mat);
+  mat.create(size, type);
+  return mat;
+}
+
+void FramePool::attach(cv::Mat &mat) {
+  // Buffers are always released through the allocator that created them,
+  // so switching a Mat that already holds data is safe
+  mat.allocator = &instance();
+}
+
+FramePool::ThreadCache *FramePool::thread_cache() {
+  if (cache_state == CacheState::Destroyed) {
+    return nullptr;
+  }
+  thread_local ThreadCache cache;
+  return &cache;
+}
+
+void FramePool::trim() {
+  if (ThreadCache *cache = thread_cache()) {
+    for (auto &[bytes, buffers]: cache->idle) {
+      for (void *buffer: buffers) {
+        cv::fastFree(buffer);
+      }
+    }
+    cache->idle.clear();
+    thread_idle_bytes -= cache->bytes;
+    cache->bytes = 0;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &[bytes, buffers]: idle) {
+    for (void *buffer: buffers) {
+      cv::fastFree(buffer);
+    }
+  }
+  idle.clear();
+  idle_bytes = 0;
+}
+
+size_t FramePool::cached_bytes() const {
+  const ThreadCache *cache = thread_cache();
+  std::lock_guard<std::mutex> lock(mutex);
+  return idle_bytes + (cache ? cache->bytes : 0);
+}
+
+// Same layout rules as OpenCV's default allocator, only the buffer source
+// differs
+cv::UMatData *FramePool::allocate(const int dims, const int *sizes,
+                                  const int type, void *data, size_t *step,
+                                  cv::AccessFlag /*flags*/,
+                                  cv::UMatUsageFlags /*usage_flags*/) const {
+  size_t total = CV_ELEM_SIZE(type);
+  for (int i = dims - 1; i >= 0; --i) {
+    if (step) {
+      if (data && step[i] != CV_AUTOSTEP) {
+        total = step[i];
+      } else {
+        step[i] = total;
+      }
+    }
+    total *= sizes[i];
+  }
+
+  auto *u = new cv::UMatData(this);
+  u->data = u->origdata = data ? static_cast<uchar *>(data)
+                               : static_cast<uchar *>(take(total));
+  u->size = total;
+  // Only compared on release, never dereferenced
+  u->userdata = thread_cache();
+  if (data) {
+    u->flags |= cv::UMatData::USER_ALLOCATED;
+  }
+  return u;
+}
+
+bool FramePool::allocate(cv::UMatData *data, cv::AccessFlag /*access_flags*/,
+                         cv::UMatUsageFlags /*usage_flags*/) const {
+  return data != nullptr;
+}
+
+void FramePool::deallocate(cv::UMatData *data) const {
+  if (!data) {
+    return;
+  }
+  CV_Assert(data->urefcount == 0);
+  CV_Assert(data->refcount == 0);
+  if (!(data->flags & cv::UMatData::USER_ALLOCATED)) {
+    give_back(data->origdata, data->size, data->userdata);
+    data->origdata = nullptr;
+  }
+  delete data;
+}
+
+void *FramePool::take(const size_t bytes) const {
+  if (ThreadCache *cache = thread_cache()) {
+    const auto it = cache->idle.find(bytes);
+    if (it != cache->idle.end() && !it->second.empty()) {
+      void *buffer = it->second.back();
+      it->second.pop_back();
+      cache->bytes -= bytes;
+      thread_idle_bytes -= bytes;
+      return buffer;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto it = idle.find(bytes);
+    if (it != idle.end() && !it->second.empty()) {
+      void *buffer = it->second.back();
+      it->second.pop_back();
+      idle_bytes -= bytes;
+      return buffer;
+    }
+  }
+  return cv::fastMalloc(bytes);
+}
+
+void FramePool::give_back(void *buffer, const size_t bytes,
+                          const void *owner) const {
+  // Kept locally only by the thread that will ask for it again
+  ThreadCache *cache = thread_cache();
+  if (cache && cache == owner &&
+      cache->bytes + bytes <= thread_cached_bytes) {
+    if (thread_idle_bytes.fetch_add(bytes) + bytes <= max_cached_bytes) {
+      cache->idle[bytes].push_back(buffer);
+      cache->bytes += bytes;
+      return;
+    }
+    thread_idle_bytes -= bytes;
+  }
+  give_back_shared(buffer, bytes);
+}
+
+void FramePool::give_back_shared(void *buffer, const size_t bytes) const {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (idle_bytes + thread_idle_bytes + bytes <= max_cached_bytes) {
+      idle[bytes].push_back(buffer);
+      idle_bytes += bytes;
+      return;
+    }
+  }
+  cv::fastFree(buffer);
+}
@@ -0,0 +1,99 @@
+#include "frame_selector.hpp"
+#include "cropped_image.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+FrameSelector::FrameSelector(const size_t capacity) : capacity(capacity) {
+  if (capacity == 0) {
+    throw std::invalid_argument("Frame selector must keep at least one frame.");
+  }
+  heap.reserve(capacity);
+}
+
+size_t FrameSelector::capacity_for_percent(const size_t total_frames,
+                                           const double keep_percent) {
+  if (keep_percent <= 0.0 || keep_percent > 100.0) {
+    throw std::invalid_argument("Keep percent must be in (0, 100].");
+  }
+  const auto count = static_cast<size_t>(
+    std::ceil(static_cast<double>(total_frames) * keep_percent / 100.0));
+  return std::max<size_t>(count, 1);
+}
+
+std::vector<CroppedImage>
+FrameSelector::select(std::vector<CroppedImage> &&images,
+                      const size_t keep_count) {
+  FrameSelector selector(std::min(std::max<size_t>(keep_count, 1),
+                                  std::max<size_t>(images.size(), 1)));
+  for (size_t i = 0; i < images.size(); ++i) {
+    selector.offer(static_cast<int>(i), std::move(images[i]));
+  }
+  images.clear();
+  return selector.take();
+}
+
+bool FrameSelector::offer(const int frame_index, CroppedImage &&image) {
+  // Take ownership so a rejected frame is freed when this call returns
+  Entry candidate{frame_index, std::move(image)};
+
+  std::lock_guard<std::mutex> lock(mutex);
+  ++offered_count;
+
+  if (heap.size() < capacity) {
+    heap.push_back(std::move(candidate));
+    std::push_heap(heap.begin(), heap.end(), ranks_higher);
+    return true;
+  }
+
+  // heap.front() is the worst frame kept so far
+  if (!ranks_higher(candidate, heap.front())) {
+    return false;
+  }
+
+  std::pop_heap(heap.begin(), heap.end(), ranks_higher);
+  heap.back() = std::move(candidate);
+  std::push_heap(heap.begin(), heap.end(), ranks_higher);
+  return true;
+}
+
+std::vector<CroppedImage> FrameSelector::take(std::vector<int> *frame_indices) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  std::sort(heap.begin(), heap.end(), [](const Entry &a, const Entry &b) {
+    return a.frame_index < b.frame_index;
+  });
+
+  std::vector<CroppedImage> selected;
+  selected.reserve(heap.size());
+  if (frame_indices) {
+    frame_indices->clear();
+    frame_indices->reserve(heap.size());
+  }
+  for (auto &entry: heap) {
+    selected.push_back(std::move(entry.image));
+    if (frame_indices) {
+      frame_indices->push_back(entry.frame_index);
+    }
+  }
+  heap.clear();
+
+  return selected;
+}
+
+size_t FrameSelector::offered() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return offered_count;
+}
+
+// Higher quality first, earlier frame wins ties so selection is deterministic
+bool FrameSelector::ranks_higher(const Entry &a, const Entry &b) {
+  const double score_a = a.image.get_quality_score();
+  const double score_b = b.image.get_quality_score();
+  if (score_a != score_b) {
+    return score_a > score_b;
+  }
+  return a.frame_index < b.frame_index;
+}
@@ -1,51 +1,78 @@
 #include "image.hpp"
+#include "profiler.hpp"
 #include <opencv2/core/mat.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include <stdexcept>
 #include <string>
 
+// adaptiveThreshold only takes 8-bit input, deeper data is scaled down
+// for the mask alone
+cv::Mat Image::to_8bit(const cv::Mat &gray) {
+  if (gray.depth() == CV_8U) {
+    return gray;
+  }
+  cv::Mat scaled;
+  gray.convertTo(scaled, CV_8U, gray.depth() == CV_16U ? 1.0 / 256.0 : 255.0);
+  return scaled;
+}
+
 Image::Image(const std::string &filename) {
-  // Load the color image
-  color = cv::imread(filename, cv::IMREAD_COLOR);
+  ScopedStage stage("image");
+
+  // Load the color image, 16-bit and float files keep their depth
+  color = cv::imread(filename, cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
 
   if (color.empty()) {
     throw std::runtime_error("Could not open or find the image: " + filename);
   }
 
-  // Generate grayscale and binary images
-  generate_grayscale();
-  generate_binary();
+  stage.add_bytes(color.total() * color.elemSize());
 }
 
-Image::Image(const cv::Mat &img) {
-  color = img;
+Image::Image(const cv::Mat &img) { color = img; }
+
+cv::Mat Image::get_color() const { return color; }
+
+cv::Mat Image::get_grayscale() const {
   generate_grayscale();
-  generate_binary();
+  return grayscale;
 }
 
-cv::Mat Image::get_color() const { return color; }
-cv::Mat Image::get_grayscale() const { return grayscale; }
-cv::Mat Image::get_binary() const { return binary; }
+cv::Mat Image::get_binary() const {
+  generate_binary();
+  return binary;
+}
 
-void Image::generate_grayscale() {
+void Image::generate_grayscale() const {
   if (grayscale.empty()) {
-    cv::cvtColor(color, grayscale, cv::COLOR_BGR2GRAY);
+    ScopedStage stage("image.grayscale");
+    // Mono captures are already grayscale
+    if (color.channels() == 1) {
+      grayscale = color;
+    } else if (color.channels() == 4) {
+      cv::cvtColor(color, grayscale, cv::COLOR_BGRA2GRAY);
+    } else {
+      cv::cvtColor(color, grayscale, cv::COLOR_BGR2GRAY);
+    }
+    stage.add_bytes(grayscale.total() * grayscale.elemSize());
   }
 }
 
-void Image::generate_binary() {
-  // Generate grayscale if not already done
-  generate_grayscale();
-
+void Image::generate_binary() const {
   // Apply adaptive thresholding to convert grayscale to binary
   if (binary.empty()) {
+    // Generate grayscale if not already done
+    generate_grayscale();
+
+    ScopedStage stage("image.binary");
     cv::Mat thresh;
-    cv::adaptiveThreshold(grayscale, thresh, 255,
+    cv::adaptiveThreshold(to_8bit(grayscale), thresh, 255,
                           cv::ADAPTIVE_THRESH_GAUSSIAN_C, cv::THRESH_BINARY_INV,
                           11, 2);
 
     cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(3, 3));
     cv::dilate(thresh, binary, kernel, cv::Point(-1, -1), 1);
+    stage.add_bytes(binary.total());
   }
 }
@@ -1,71 +1,519 @@
 #include "image_aligner.hpp"
 #include "cropped_image.hpp"
+#include "frame_pool.hpp"
+#include "image.hpp"
+#include "profiler.hpp"
 #include <algorithm>
+#include <cfloat>
+#include <cmath>
 #include <omp.h>
+#include <opencv2/core.hpp>
 #include <opencv2/core/mat.hpp>
 #include <opencv2/imgproc.hpp>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
+int ImageAligner::ap_grid = 0;
+int ImageAligner::ap_box_size = 64;
+int ImageAligner::pyramid_levels = 0;
+int ImageAligner::pyramid_window = 256;
+
+ImageAligner::Settings ImageAligner::current() {
+  return Settings{ap_grid, ap_box_size, pyramid_levels, pyramid_window};
+}
+
 std::vector<cv::Mat>
 ImageAligner::align_images(std::vector<CroppedImage> &images) {
+  std::vector<cv::Mat> aligned_images(images.size());
+  align_images(images, [&aligned_images](const int index, cv::Mat &&aligned) {
+    aligned_images[index] = std::move(aligned);
+  });
+  return aligned_images;
+}
+
+void ImageAligner::align_images(std::vector<CroppedImage> &images,
+                                const AlignedSink &sink,
+                                const Settings &settings) {
   if (images.empty())
-    return {};
+    return;
 
   CroppedImage template_image = select_template(images);
-  cv::Mat template_gray = template_image.get_grayscale();
+  const cv::Mat template_gray = template_image.get_grayscale();
+  const int num_images = static_cast<int>(images.size());
 
-  std::vector<cv::Mat> aligned_images;
-  aligned_images.resize(images.size());
+  // Use phase correlation for sub-pixel accuracy
+  const std::vector<cv::Point2d> shifts =
+      estimate_global_shifts(images, template_gray, settings);
 
-#pragma omp parallel for default(none) shared(images, aligned_images, template_gray)
-  for (int i = 0; i < images.size(); ++i) {
-    cv::Mat img = images[i].get_color();
-    cv::Mat img_gray = images[i].get_grayscale();
+  if (settings.ap_grid > 0) {
+    align_multi_point(images, template_gray, shifts, settings, sink);
+    return;
+  }
 
-    // Use phase correlation for sub-pixel accuracy
-    cv::Point2d shift = compute_phase_correlation(img_gray, template_gray);
+#pragma omp parallel for default(none) shared(images, sink, shifts, num_images)
+  for (int i = 0; i < num_images; ++i) {
+    cv::Mat aligned;
+    translate(images[i].get_color(), shifts[i], aligned);
+    sink(i, std::move(aligned));
+  }
+}
+
+void ImageAligner::align_images(const int count, const int template_index,
+                                const CropSource &source,
+                                const AlignedSink &sink,
+                                std::vector<cv::Point2d> *shifts,
+                                std::vector<double> *responses) {
+  if (count <= 0) {
+    return;
+  }
+  if (template_index < 0 || template_index >= count) {
+    throw std::out_of_range("Template crop index out of range.");
+  }
+  if (shifts) {
+    shifts->assign(static_cast<size_t>(count), cv::Point2d());
+  }
+  if (responses) {
+    responses->assign(static_cast<size_t>(count), 0.0);
+  }
 
-    // Apply translation
-    cv::Mat aligned_img;
-    cv::Mat translation_matrix =
-        (cv::Mat_<double>(2, 3) << 1, 0, shift.x, 0, 1, shift.y);
-    cv::warpAffine(img, aligned_img, translation_matrix, img.size());
+  const Settings settings = current();
+  const cv::Mat template_gray = Image(source(template_index)).get_grayscale();
+  const ShiftEstimator estimator(template_gray, settings);
+  const std::vector<AlignmentPoint> points =
+      settings.ap_grid > 0 ? place_alignment_points(template_gray, settings)
+                           : std::vector<AlignmentPoint>();
+  const int num_points = static_cast<int>(points.size());
+  const int grid = settings.ap_grid;
 
-#pragma omp critical
-    {
-      aligned_images[i] = aligned_img;
+  // Frames instead of (frame, box) pairs are the unit of work here, so
+  // only one crop per thread is ever read
+#pragma omp parallel default(none) \
+  shared(count, source, sink, estimator, points, num_points, grid, shifts, \
+         responses)
+  {
+    ShiftEstimator::Buffers buffers;
+    Scratch point_scratch;
+    RemapBuffers remap;
+    std::vector<cv::Point2f> local(static_cast<size_t>(num_points));
+
+#pragma omp for schedule(dynamic)
+    for (int i = 0; i < count; ++i) {
+      const Image frame(source(i));
+      const cv::Mat gray = frame.get_grayscale();
+      cv::Point2d global;
+      {
+        ScopedStage stage("align.shift");
+        global = estimator.estimate(gray, buffers,
+                                    responses ? &(*responses)[i] : nullptr);
+      }
+      if (shifts) {
+        (*shifts)[i] = global;
+      }
+
+      cv::Mat aligned;
+      if (num_points > 0) {
+        for (int p = 0; p < num_points; ++p) {
+          local[p] = point_shift(gray, points[p], global, point_scratch);
+        }
+        remap_with_shifts(frame.get_color(), local.data(), grid, remap, aligned);
+      } else {
+        translate(frame.get_color(), global, aligned);
+      }
+      sink(i, std::move(aligned));
     }
   }
+}
 
-  return aligned_images;
+void ImageAligner::translate(const cv::Mat &color, const cv::Point2d &shift,
+                             cv::Mat &aligned) {
+  ScopedStage stage("align.warp");
+  const cv::Mat translation_matrix =
+      (cv::Mat_<double>(2, 3) << 1, 0, shift.x, 0, 1, shift.y);
+  FramePool::attach(aligned);
+  cv::warpAffine(color, aligned, translation_matrix, color.size());
+  stage.add_bytes(aligned.total() * aligned.elemSize());
+}
+
+std::vector<cv::Point2d>
+ImageAligner::compute_shifts(const std::vector<CroppedImage> &images,
+                             std::vector<double> *responses,
+                             const Settings &settings) {
+  if (images.empty())
+    return {};
+
+  const CroppedImage template_image = select_template(images);
+  return estimate_global_shifts(images, template_image.get_grayscale(),
+                                settings, responses);
 }
 
-cv::Point2d ImageAligner::compute_phase_correlation(const cv::Mat &img1,
-                                                    const cv::Mat &img2) {
-  // Ensure images are the same size
-  const auto common_size =
-      cv::Size(std::min(img1.cols, img2.cols), std::min(img1.rows, img2.rows));
+std::vector<cv::Point2d>
+ImageAligner::estimate_global_shifts(const std::vector<CroppedImage> &images,
+                                     const cv::Mat &template_gray,
+                                     const Settings &settings,
+                                     std::vector<double> *responses) {
+  if (responses) {
+    responses->assign(images.size(), 0.0);
+  }
+
+  const ShiftEstimator estimator(template_gray, settings);
+  const int num_images = static_cast<int>(images.size());
+  std::vector<cv::Point2d> shifts(images.size());
 
-  cv::Mat src1, src2;
-  cv::resize(img1, src1, common_size);
-  cv::resize(img2, src2, common_size);
+#pragma omp parallel default(none) \
+  shared(images, estimator, shifts, num_images, responses)
+  {
+    ShiftEstimator::Buffers buffers;
+
+#pragma omp for
+    for (int i = 0; i < num_images; ++i) {
+      ScopedStage stage("align.shift");
+      shifts[i] = estimator.estimate(images[i].get_grayscale(), buffers,
+                                     responses ? &(*responses)[i] : nullptr);
+    }
+  }
 
-  // Convert to floating point
-  src1.convertTo(src1, CV_32F);
-  src2.convertTo(src2, CV_32F);
+  return shifts;
+}
+
+ImageAligner::ShiftEstimator::ShiftEstimator(const cv::Mat &template_gray,
+                                             const Settings &settings)
+  : pyramid(settings.pyramid_levels > 0) {
+  const cv::Size size = template_gray.size();
+  if (!pyramid) {
+    reference = prepare_reference(template_gray);
+    return;
+  }
+
+  const int scale = 1 << std::min(settings.pyramid_levels, 8);
+  coarse_size = cv::Size(std::max(1, size.width / scale),
+                         std::max(1, size.height / scale));
+  coarse_to_full = cv::Point2d(
+    static_cast<double>(size.width) / coarse_size.width,
+    static_cast<double>(size.height) / coarse_size.height);
+
+  // Coarse level sees the whole frame, so the search range is unchanged
+  cv::Mat coarse_template;
+  cv::resize(template_gray, coarse_template, coarse_size, 0, 0, cv::INTER_AREA);
+  coarse_reference = prepare_reference(coarse_template);
+
+  // Fine level only looks at a window around the frame center, where
+  // PlanetDetector put the target
+  const int window = std::max(
+    8, std::min({settings.pyramid_window, size.width, size.height}));
+  fine_box = cv::Rect((size.width - window) / 2, (size.height - window) / 2,
+                      window, window);
+  reference = prepare_reference(template_gray(fine_box));
+}
+
+cv::Point2d ImageAligner::ShiftEstimator::estimate(const cv::Mat &gray,
+                                                   Buffers &buffers,
+                                                   double *response) const {
+  if (!pyramid) {
+    return compute_phase_correlation(gray, reference, buffers.fine, response);
+  }
+
+  cv::resize(gray, buffers.coarse_gray, coarse_size, 0, 0, cv::INTER_AREA);
+  const cv::Point2d coarse = compute_phase_correlation(
+    buffers.coarse_gray, coarse_reference, buffers.coarse, response);
+  const cv::Point2d estimate(coarse.x * coarse_to_full.x,
+                             coarse.y * coarse_to_full.y);
+
+  // Keep the coarse estimate if the refinement lost the target
+  cv::Point2d refined;
+  return refine_in_box(gray, fine_box, reference, estimate, buffers.fine,
+                       refined)
+           ? refined
+           : estimate;
+}
+
+bool ImageAligner::refine_in_box(const cv::Mat &gray, const cv::Rect &box,
+                                 const Reference &reference,
+                                 const cv::Point2d &estimate, Scratch &scratch,
+                                 cv::Point2d &refined) {
+  if (gray.cols < box.width || gray.rows < box.height) {
+    return false;
+  }
+
+  // The template box at R matches the frame around R - estimate
+  const int fx = std::clamp(box.x - cvRound(estimate.x), 0,
+                            gray.cols - box.width);
+  const int fy = std::clamp(box.y - cvRound(estimate.y), 0,
+                            gray.rows - box.height);
+  const cv::Mat frame_box = gray(cv::Rect(fx, fy, box.width, box.height));
+
+  const cv::Point2d residual =
+      compute_phase_correlation(frame_box, reference, scratch);
+  refined = cv::Point2d(box.x - fx + residual.x, box.y - fy + residual.y);
+
+  // Jumps further than a quarter box are mismatches
+  return std::abs(refined.x - estimate.x) <= box.width / 4.0 &&
+         std::abs(refined.y - estimate.y) <= box.height / 4.0;
+}
+
+std::vector<ImageAligner::AlignmentPoint>
+ImageAligner::place_alignment_points(const cv::Mat &template_gray,
+                                     const Settings &settings) {
+  const cv::Size size = template_gray.size();
+  const int grid = settings.ap_grid;
+  const int box_size =
+      std::max(8, std::min({settings.ap_box_size, size.width, size.height}));
+  const double frame_mean = cv::mean(template_gray)[0];
+
+  std::vector<AlignmentPoint> points;
+  points.reserve(static_cast<size_t>(grid) * grid);
+
+  for (int gy = 0; gy < grid; ++gy) {
+    for (int gx = 0; gx < grid; ++gx) {
+      // Boxes are centered on the grid cells and kept inside the frame
+      const int cx = static_cast<int>((gx + 0.5) * size.width / grid);
+      const int cy = static_cast<int>((gy + 0.5) * size.height / grid);
+      const int x0 = std::clamp(cx - box_size / 2, 0, size.width - box_size);
+      const int y0 = std::clamp(cy - box_size / 2, 0, size.height - box_size);
+
+      AlignmentPoint point{};
+      point.box = cv::Rect(x0, y0, box_size, box_size);
+
+      // Dark or flat boxes (sky background) have nothing to lock onto
+      cv::Scalar mean, stddev;
+      cv::meanStdDev(template_gray(point.box), mean, stddev);
+      point.valid = mean[0] >= 0.5 * frame_mean && stddev[0] > 1.0;
+      if (point.valid) {
+        point.reference = prepare_reference(template_gray(point.box));
+      }
+
+      points.push_back(std::move(point));
+    }
+  }
+
+  return points;
+}
+
+void ImageAligner::align_multi_point(std::vector<CroppedImage> &images,
+                                     const cv::Mat &template_gray,
+                                     const std::vector<cv::Point2d> &global_shifts,
+                                     const Settings &settings,
+                                     const AlignedSink &sink) {
+  const cv::Size size = template_gray.size();
+  for (const auto &image: images) {
+    if (image.get_grayscale().size() != size) {
+      throw std::invalid_argument(
+        "Multi-point alignment needs frames of the template size.");
+    }
+  }
+
+  const std::vector<AlignmentPoint> points =
+      place_alignment_points(template_gray, settings);
+  const int num_images = static_cast<int>(images.size());
+  const int num_points = static_cast<int>(points.size());
+  const int grid = settings.ap_grid;
+
+  // Step 1: correlate every box of every frame, tiles and frames share the
+  // same work queue so small batches still use every core
+  std::vector<cv::Point2f> local_shifts(static_cast<size_t>(num_images) * num_points);
+
+#pragma omp parallel default(none) \
+  shared(images, points, global_shifts, local_shifts, num_images, num_points, size)
+  {
+    Scratch scratch;
+
+#pragma omp for collapse(2) schedule(dynamic)
+    for (int i = 0; i < num_images; ++i) {
+      for (int p = 0; p < num_points; ++p) {
+        local_shifts[static_cast<size_t>(i) * num_points + p] = point_shift(
+          images[i].get_grayscale(), points[p], global_shifts[i], scratch);
+      }
+    }
+  }
+
+  // Step 2: interpolate the box shifts into a dense field, one remap per frame
+#pragma omp parallel default(none) \
+  shared(images, local_shifts, sink, num_images, num_points, grid)
+  {
+    RemapBuffers buffers;
+
+#pragma omp for
+    for (int i = 0; i < num_images; ++i) {
+      cv::Mat aligned;
+      remap_with_shifts(images[i].get_color(),
+                        &local_shifts[static_cast<size_t>(i) * num_points],
+                        grid, buffers, aligned);
+      sink(i, std::move(aligned));
+    }
+  }
+}
+
+cv::Point2f ImageAligner::point_shift(const cv::Mat &gray,
+                                      const AlignmentPoint &point,
+                                      const cv::Point2d &global,
+                                      Scratch &scratch) {
+  if (!point.valid) {
+    return cv::Point2f(global);
+  }
+
+  ScopedStage stage("align.point");
+  cv::Point2d refined;
+  return refine_in_box(gray, point.box, point.reference, global, scratch,
+                       refined)
+           ? cv::Point2f(refined)
+           : cv::Point2f(global);
+}
+
+void ImageAligner::remap_with_shifts(const cv::Mat &color,
+                                     const cv::Point2f *shifts, const int grid,
+                                     RemapBuffers &buffers, cv::Mat &aligned) {
+  ScopedStage stage("align.remap");
+  const cv::Size size = color.size();
+  buffers.grid_shifts.create(grid, grid, CV_32FC2);
+  buffers.map.create(size, CV_32FC2);
+  for (int p = 0; p < grid * grid; ++p) {
+    buffers.grid_shifts.at<cv::Vec2f>(p / grid, p % grid) =
+        cv::Vec2f(shifts[p].x, shifts[p].y);
+  }
+
+  // Linear resize puts the grid samples on the box centers and holds
+  // the outermost shifts up to the frame edges
+  cv::resize(buffers.grid_shifts, buffers.field, size, 0, 0, cv::INTER_LINEAR);
+
+  // Same convention as warpAffine: dst(x) = src(x - shift(x))
+  for (int y = 0; y < size.height; ++y) {
+    const auto *field_row = buffers.field.ptr<cv::Vec2f>(y);
+    auto *map_row = buffers.map.ptr<cv::Vec2f>(y);
+    for (int x = 0; x < size.width; ++x) {
+      map_row[x] = cv::Vec2f(static_cast<float>(x) - field_row[x][0],
+                             static_cast<float>(y) - field_row[x][1]);
+    }
+  }
+
+  FramePool::attach(aligned);
+  cv::remap(color, aligned, buffers.map, cv::noArray(), cv::INTER_LINEAR,
+            cv::BORDER_CONSTANT);
+  stage.add_bytes(aligned.total() * aligned.elemSize());
+}
+
+ImageAligner::Scratch::Scratch() {
+  FramePool::attach(resized);
+  FramePool::attach(padded);
+  FramePool::attach(spectrum);
+  FramePool::attach(cross_power);
+  FramePool::attach(correlation);
+}
+
+ImageAligner::Reference
+ImageAligner::prepare_reference(const cv::Mat &template_gray) {
+  Reference reference;
+  reference.image_size = template_gray.size();
+  reference.dft_size = cv::Size(cv::getOptimalDFTSize(template_gray.cols),
+                                cv::getOptimalDFTSize(template_gray.rows));
 
   // Apply window function to reduce edge effects
-  cv::Mat window;
-  cv::createHanningWindow(window, common_size, CV_32F);
-  src1 = src1.mul(window);
-  src2 = src2.mul(window);
+  cv::createHanningWindow(reference.window, reference.image_size, CV_32F);
+
+  // Zero padding to a fast DFT size, like cv::phaseCorrelate does
+  cv::Mat padded = cv::Mat::zeros(reference.dft_size, CV_32F);
+  cv::Mat roi = padded(cv::Rect(cv::Point(0, 0), reference.image_size));
+  template_gray.convertTo(roi, CV_32F);
+  cv::multiply(roi, reference.window, roi);
+
+  cv::dft(padded, reference.spectrum, cv::DFT_COMPLEX_OUTPUT);
+  return reference;
+}
+
+cv::Point2d ImageAligner::compute_phase_correlation(const cv::Mat &img,
+                                                    const Reference &reference,
+                                                    Scratch &scratch,
+                                                    double *response) {
+  // Frames of a different size are resampled onto the template grid
+  cv::Mat src = img;
+  if (img.size() != reference.image_size) {
+    cv::resize(img, scratch.resized, reference.image_size);
+    src = scratch.resized;
+  }
+
+  // The padding border is never written, so it only needs zeroing once
+  if (scratch.padded.size() != reference.dft_size) {
+    scratch.padded.create(reference.dft_size, CV_32F);
+    scratch.padded.setTo(cv::Scalar::all(0));
+  }
+  cv::Mat roi = scratch.padded(cv::Rect(cv::Point(0, 0), reference.image_size));
+  src.convertTo(roi, CV_32F);
+  cv::multiply(roi, reference.window, roi);
+
+  cv::dft(scratch.padded, scratch.spectrum, cv::DFT_COMPLEX_OUTPUT);
+
+  // Normalized cross-power spectrum F * conj(T) / |F * conj(T)|
+  cv::mulSpectrums(scratch.spectrum, reference.spectrum, scratch.cross_power,
+                   0, true);
+  for (int y = 0; y < scratch.cross_power.rows; ++y) {
+    auto *row = scratch.cross_power.ptr<cv::Vec2f>(y);
+    for (int x = 0; x < scratch.cross_power.cols; ++x) {
+      const float magnitude =
+          std::sqrt(row[x][0] * row[x][0] + row[x][1] * row[x][1]);
+      row[x] *= 1.0f / (magnitude + FLT_EPSILON);
+    }
+  }
+
+  cv::dft(scratch.cross_power, scratch.correlation,
+          cv::DFT_INVERSE | cv::DFT_REAL_OUTPUT | cv::DFT_SCALE);
+
+  cv::Point peak;
+  cv::minMaxLoc(scratch.correlation, nullptr, response, nullptr, &peak);
 
-  // Compute phase correlation
-  cv::Point2d shift = cv::phaseCorrelate(src1, src2);
+  // Weighted centroid over a 5x5 window for sub-pixel accuracy, indices
+  // wrap because the correlation is circular
+  const int rows = scratch.correlation.rows;
+  const int cols = scratch.correlation.cols;
+  double sum = 0.0, sum_x = 0.0, sum_y = 0.0;
+  for (int dy = -2; dy <= 2; ++dy) {
+    const float *row = scratch.correlation.ptr<float>((peak.y + dy + rows) % rows);
+    for (int dx = -2; dx <= 2; ++dx) {
+      const double value = row[(peak.x + dx + cols) % cols];
+      sum += value;
+      sum_x += value * dx;
+      sum_y += value * dy;
+    }
+  }
+
+  cv::Point2d location(peak.x, peak.y);
+  if (sum > 0.0) {
+    location.x += sum_x / sum;
+    location.y += sum_y / sum;
+  }
+
+  // Peaks past the midpoint are negative offsets
+  if (location.x > cols / 2.0) {
+    location.x -= cols;
+  }
+  if (location.y > rows / 2.0) {
+    location.y -= rows;
+  }
 
-  return shift;
+  // The peak sits at the frame's offset from the template, undo it
+  return -location;
 }
 
+ImageAligner::FixedReference::FixedReference(const cv::Mat &template_gray)
+  : gray(template_gray.clone()), reference(prepare_reference(gray)) {}
+
+cv::Point2d ImageAligner::FixedReference::shift(const cv::Mat &frame_gray) {
+  ScopedStage stage("align.shift");
+  return compute_phase_correlation(frame_gray, reference, scratch);
+}
+
+void ImageAligner::FixedReference::align(const CroppedImage &image,
+                                         cv::Mat &aligned) {
+  const cv::Point2d offset = shift(image.get_grayscale());
+
+  ScopedStage stage("align.warp");
+  const cv::Mat img = image.get_color();
+  const cv::Mat translation_matrix =
+      (cv::Mat_<double>(2, 3) << 1, 0, offset.x, 0, 1, offset.y);
+  cv::warpAffine(img, aligned, translation_matrix, img.size());
+  stage.add_bytes(aligned.total() * aligned.elemSize());
+}
+
+cv::Mat ImageAligner::FixedReference::template_gray() const { return gray; }
+
 CroppedImage
 ImageAligner::select_template(const std::vector<CroppedImage> &images) {
   const auto max_it = std::max_element(images.begin(), images.end());
@@ -1,13 +1,859 @@
 #include "image_stacker.hpp"
+#include "profiler.hpp"
 #include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <limits>
 #include <omp.h>
+#include <opencv2/core/hal/intrin.hpp>
 #include <opencv2/core/mat.hpp>
+#include <optional>
 #include <stdexcept>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 float ImageStacker::sigma_threshold = 3.0f;
+int ImageStacker::sigma_iterations = 1;
+ImageStacker::RejectionMode ImageStacker::rejection_mode =
+    ImageStacker::RejectionMode::ReplaceWithMedian;
+float ImageStacker::percentile_low = 0.1f;
+float ImageStacker::percentile_high = 0.9f;
 
-cv::Mat ImageStacker::stack_images(const std::vector<cv::Mat> &images) {
+ImageStacker::Settings ImageStacker::current() {
+  return Settings{sigma_threshold, sigma_iterations, rejection_mode,
+                  percentile_low, percentile_high};
+}
+
+namespace {
+// One tile of all frames is sized to stay resident in L2
+constexpr size_t stack_tile_bytes = 256 * 1024;
+
+// Largest frame count handled by a sorting network instead of introselect
+constexpr size_t max_network_frames = 32;
+
+// Largest frame counts whose median is cheaper to select from widened
+// samples than to count in histograms, from the bench's median_ms and
+// median_16u_ms against median_float_ms. One byte histogram already wins
+// at 17 frames, the three passes of the 16-bit radix only past about 96
+constexpr size_t max_select_frames_8u = 16;
+constexpr size_t max_select_frames_16u = 96;
+
+using MedianKernel = float (*)(float *values, size_t count);
+
+inline void compare_swap(float &a, float &b) {
+  const float lo = std::min(a, b);
+  const float hi = std::max(a, b);
+  a = lo;
+  b = hi;
+}
+
+// Bitonic sorting network, the loop bounds are compile-time constants so it
+// unrolls into branch-free min/max sequences
+template <int P> void bitonic_sort(float *v) {
+  for (int k = 2; k <= P; k <<= 1) {
+    for (int j = k >> 1; j > 0; j >>= 1) {
+      for (int i = 0; i < P; ++i) {
+        const int partner = i ^ j;
+        if (partner > i) {
+          if ((i & k) == 0) {
+            compare_swap(v[i], v[partner]);
+          } else {
+            compare_swap(v[partner], v[i]);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Median of up to P values, padding sorts to the end and is never selected
+template <int P> float network_median(float *values, const size_t count) {
+  float v[P];
+  for (size_t i = 0; i < count; ++i) {
+    v[i] = values[i];
+  }
+  for (size_t i = count; i < P; ++i) {
+    v[i] = std::numeric_limits<float>::max();
+  }
+  bitonic_sort<P>(v);
+
+  const size_t mid = count / 2;
+  return count % 2 == 0 ? (v[mid - 1] + v[mid]) * 0.5f : v[mid];
+}
+
+float introselect_median(float *values, const size_t count) {
+  const size_t mid = count / 2;
+  std::nth_element(values, values + mid, values + count);
+  const float median_val = values[mid];
+
+  // For even number of elements, average the two middle values
+  if (count % 2 == 0) {
+    return (median_val + *std::max_element(values, values + mid)) * 0.5f;
+  }
+  return median_val;
+}
+
+// Elements per row tile so that one tile of every frame fits in L2
+int tile_length(const int row_len, const size_t num_images) {
+  const auto fit = static_cast<int>(
+    std::min<size_t>(stack_tile_bytes / (sizeof(float) * num_images), INT_MAX));
+  return std::max(1, std::min(row_len, fit));
+}
+
+MedianKernel select_median_kernel(const size_t count) {
+  static_assert(max_network_frames == 32, "update the network dispatch");
+  if (count <= 4) {
+    return network_median<4>;
+  }
+  if (count <= 8) {
+    return network_median<8>;
+  }
+  if (count <= 16) {
+    return network_median<16>;
+  }
+  if (count <= max_network_frames) {
+    return network_median<32>;
+  }
+  return introselect_median;
+}
+
+// Kernels are instantiated per element type and read frames in their own
+// type, widening in registers, so no float copy of a tile is ever written.
+// Channels stay interleaved and every kernel works per sample, a row is one
+// flat run of width x channels samples, so mono rows are simply shorter and
+// need no code of their own. This is the one runtime branch in front of them
+template <typename Fn> void dispatch_depth(const int depth, Fn &&fn) {
+  switch (depth) {
+    case CV_8U:
+      fn(uchar{});
+      break;
+    case CV_16U:
+      fn(ushort{});
+      break;
+    default:
+      fn(float{});
+      break;
+  }
+}
+
+#if CV_SIMD
+inline cv::v_float32 load_widened(const float *src) { return cv::vx_load(src); }
+
+inline cv::v_float32 load_widened(const ushort *src) {
+  return cv::v_cvt_f32(cv::v_reinterpret_as_s32(cv::vx_load_expand(src)));
+}
+
+inline cv::v_float32 load_widened(const uchar *src) {
+  return cv::v_cvt_f32(cv::v_reinterpret_as_s32(cv::vx_load_expand_q(src)));
+}
+#endif
+
+// Frames as the kernels read them, one row segment at a time. Plain frames
+// hand out pointers into themselves. Shifted frames are translated while
+// they are read, placed where warpAffine with INTER_LINEAR and a black
+// border would put them: fractions are quantized to 1/32 pixel, whole-pixel
+// shifts are an offset into the source row and only fractional ones are
+// interpolated, into the caller's row buffer. No shifted frame is stored
+class FrameRows {
+public:
+  explicit FrameRows(const std::vector<cv::Mat> &frames) : frames(frames) {}
+
+  FrameRows(const std::vector<cv::Mat> &frames,
+            const std::vector<cv::Point2d> &shifts)
+    : frames(frames) {
+    // cv::INTER_TAB_SIZE, the sub-pixel resolution of warpAffine
+    constexpr double steps = 32.0;
+    const auto source_offset = [](const double shift, int &whole,
+                                  float &fraction) {
+      const double quantized = std::round(-shift * steps);
+      const double pixels = std::floor(quantized / steps);
+      whole = static_cast<int>(pixels);
+      fraction = static_cast<float>((quantized - pixels * steps) / steps);
+    };
+
+    offsets.resize(shifts.size());
+    for (size_t i = 0; i < shifts.size(); ++i) {
+      source_offset(shifts[i].x, offsets[i].dx, offsets[i].fx);
+      source_offset(shifts[i].y, offsets[i].dy, offsets[i].fy);
+    }
+  }
+
+  [[nodiscard]] size_t size() const { return frames.size(); }
+
+  [[nodiscard]] const cv::Mat &front() const { return frames.front(); }
+
+  [[nodiscard]] bool shifted() const { return !offsets.empty(); }
+
+  // Samples x0..x0+len of row y of frame i, buffer holds len samples for
+  // rows that cannot be read in place
+  template <typename T>
+  const T *row(const size_t i, const int y, const int x0, const int len,
+               T *buffer) const {
+    if (offsets.empty()) {
+      return frames[i].ptr<T>(y) + x0;
+    }
+    const Offset &offset = offsets[i];
+    if (offset.fx == 0.0f && offset.fy == 0.0f) {
+      return offset_row(frames[i], offset, y, x0, len, buffer);
+    }
+    interpolate_row(frames[i], offset, y, x0, len, buffer);
+    return buffer;
+  }
+
+private:
+  // Pixel (x, y) of the shifted frame blends source pixels (x + dx, y + dy)
+  // to (x + dx + 1, y + dy + 1), weighting the second column by fx and the
+  // second row by fy
+  struct Offset {
+    int dx = 0;
+    int dy = 0;
+    float fx = 0.0f;
+    float fy = 0.0f;
+  };
+
+  template <typename T>
+  static const T *offset_row(const cv::Mat &frame, const Offset &offset,
+                             const int y, const int x0, const int len,
+                             T *buffer) {
+    const int sy = y + offset.dy;
+    if (sy < 0 || sy >= frame.rows) {
+      std::fill_n(buffer, len, T{});
+      return buffer;
+    }
+
+    const int row_len = frame.cols * frame.channels();
+    const int s0 = x0 + offset.dx * frame.channels();
+    const T *src = frame.ptr<T>(sy);
+    if (s0 >= 0 && s0 + len <= row_len) {
+      return src + s0;
+    }
+
+    // Near the edge: the part inside the frame, black around it
+    const int begin = std::clamp(-s0, 0, len);
+    const int end = std::clamp(row_len - s0, begin, len);
+    std::fill_n(buffer, begin, T{});
+    if (end > begin) {
+      std::copy(src + s0 + begin, src + s0 + end, buffer + begin);
+    }
+    std::fill(buffer + end, buffer + len, T{});
+    return buffer;
+  }
+
+  template <typename T>
+  static void interpolate_row(const cv::Mat &frame, const Offset &offset,
+                              const int y, const int x0, const int len,
+                              T *buffer) {
+    const int sy = y + offset.dy;
+    const T *top = sy >= 0 && sy < frame.rows ? frame.ptr<T>(sy) : nullptr;
+    const T *bottom =
+        sy + 1 >= 0 && sy + 1 < frame.rows ? frame.ptr<T>(sy + 1) : nullptr;
+    float top_weight = 1.0f - offset.fy;
+    float bottom_weight = offset.fy;
+    if (!top && !bottom) {
+      std::fill_n(buffer, len, T{});
+      return;
+    }
+    // A row outside the frame is black, the other row stands in with no weight
+    if (!top) {
+      top = bottom;
+      top_weight = 0.0f;
+    }
+    if (!bottom) {
+      bottom = top;
+      bottom_weight = 0.0f;
+    }
+
+    const float w00 = top_weight * (1.0f - offset.fx);
+    const float w01 = top_weight * offset.fx;
+    const float w10 = bottom_weight * (1.0f - offset.fx);
+    const float w11 = bottom_weight * offset.fx;
+    const int cn = frame.channels();
+    const int row_len = frame.cols * cn;
+    const int s0 = x0 + offset.dx * cn;
+
+    const auto sample = [row_len](const T *src, const int s) {
+      return s >= 0 && s < row_len ? static_cast<float>(src[s]) : 0.0f;
+    };
+    const auto blend_checked = [&](const int j) {
+      const int s = s0 + j;
+      buffer[j] = cv::saturate_cast<T>(
+        w00 * sample(top, s) + w01 * sample(top, s + cn) +
+        w10 * sample(bottom, s) + w11 * sample(bottom, s + cn));
+    };
+
+    // Both neighbours lie inside the frame from begin to end
+    const int begin = std::clamp(-s0, 0, len);
+    const int end = std::clamp(row_len - cn - s0, begin, len);
+    for (int j = 0; j < begin; ++j) {
+      blend_checked(j);
+    }
+    for (int j = begin; j < end; ++j) {
+      const int s = s0 + j;
+      buffer[j] = cv::saturate_cast<T>(
+        w00 * static_cast<float>(top[s]) + w01 * static_cast<float>(top[s + cn]) +
+        w10 * static_cast<float>(bottom[s]) + w11 * static_cast<float>(bottom[s + cn]));
+    }
+    for (int j = end; j < len; ++j) {
+      blend_checked(j);
+    }
+  }
+
+  const std::vector<cv::Mat> &frames;
+  std::vector<Offset> offsets; // empty for plain frames
+};
+
+// One row tile of every frame read once through FrameRows and kept for
+// all passes, so shifted frames are interpolated once per tile instead of
+// once per pass. Rows read in place stay pointers into the frames, the
+// others are stored here, which is at most one L2-sized tile of samples
+template <typename T>
+class TileRows {
+public:
+  TileRows(const size_t num_frames, const int tile_len)
+    : rows(num_frames),
+      storage(num_frames * static_cast<size_t>(tile_len)), tile_len(tile_len) {}
+
+  void load(const FrameRows &frames, const int y, const int x0, const int len) {
+    tile_x0 = x0;
+    for (size_t i = 0; i < rows.size(); ++i) {
+      rows[i] = frames.row(i, y, x0, len,
+                           storage.data() + i * static_cast<size_t>(tile_len));
+    }
+  }
+
+  [[nodiscard]] size_t size() const { return rows.size(); }
+
+  // Same as FrameRows::row for any segment of the loaded tile, nothing is
+  // written to buffer
+  const T *row(const size_t i, int, const int x0, int, T *) const {
+    return rows[i] + (x0 - tile_x0);
+  }
+
+private:
+  std::vector<const T *> rows;
+  std::vector<T> storage;
+  int tile_len;
+  int tile_x0 = 0;
+};
+
+using RejectionMode = ImageStacker::RejectionMode;
+
+// Fold one frame's tile into the clipping sums, offsets are taken relative to
+// the current center so the variance needs no cancellation-prone sum of
+// squares. Rejection is a lane mask, so there is no branch per sample.
+template <RejectionMode Mode, typename T>
+void clip_accumulate(const T *src, const float *median,
+                     const float *center, const float *threshold, float *sum,
+                     float *sum_sq, float *count, const int len) {
+  int j = 0;
+#if CV_SIMD
+  const int lanes = cv::v_float32::nlanes;
+  const cv::v_float32 zero = cv::vx_setzero_f32();
+  const cv::v_float32 one = cv::vx_setall_f32(1.0f);
+  for (; j <= len - lanes; j += lanes) {
+    const cv::v_float32 c = cv::vx_load(center + j);
+    const cv::v_float32 t = cv::vx_load(threshold + j);
+    cv::v_float32 d = load_widened(src + j) - c;
+
+    if constexpr (Mode == RejectionMode::ReplaceWithMedian) {
+      d = cv::v_select(cv::v_abs(d) <= t, d, cv::vx_load(median + j) - c);
+    } else if constexpr (Mode == RejectionMode::KappaSigma) {
+      const cv::v_float32 inside = cv::v_abs(d) <= t;
+      d = cv::v_select(inside, d, zero);
+      cv::v_store(count + j, cv::vx_load(count + j) + cv::v_select(inside, one, zero));
+    } else {
+      d = cv::v_max(cv::v_min(d, t), zero - t);
+    }
+
+    cv::v_store(sum + j, cv::vx_load(sum + j) + d);
+    cv::v_store(sum_sq + j, cv::v_fma(d, d, cv::vx_load(sum_sq + j)));
+  }
+  cv::vx_cleanup();
+#endif
+
+  for (; j < len; ++j) {
+    float d = static_cast<float>(src[j]) - center[j];
+    if constexpr (Mode == RejectionMode::ReplaceWithMedian) {
+      d = std::abs(d) <= threshold[j] ? d : median[j] - center[j];
+    } else if constexpr (Mode == RejectionMode::KappaSigma) {
+      const float inside = std::abs(d) <= threshold[j] ? 1.0f : 0.0f;
+      d *= inside;
+      count[j] += inside;
+    } else {
+      d = std::max(std::min(d, threshold[j]), -threshold[j]);
+    }
+    sum[j] += d;
+    sum_sq[j] += d * d;
+  }
+}
+
+// Per-thread state for clipping one tile, reused across tiles
+struct ClipScratch {
+  explicit ClipScratch(const int tile_len)
+    : center(tile_len), threshold(tile_len), sum(tile_len), sum_sq(tile_len),
+      count(tile_len) {}
+
+  std::vector<float> center;
+  std::vector<float> threshold;
+  std::vector<float> sum;
+  std::vector<float> sum_sq;
+  std::vector<float> count;
+};
+
+// Run every rejection iteration on one row tile while it is still in cache,
+// the tile's final center is the clipped mean
+template <RejectionMode Mode, typename T, typename Rows>
+void clip_tile(const Rows &frames, const float *median, const int y,
+               const int x0, const int len, const float kappa,
+               const int iterations, ClipScratch &scratch, T *row_buffer) {
+  const size_t num_frames = frames.size();
+
+  for (int iter = 0; iter < iterations; ++iter) {
+    std::fill_n(scratch.sum.begin(), len, 0.0f);
+    std::fill_n(scratch.sum_sq.begin(), len, 0.0f);
+    std::fill_n(scratch.count.begin(), len,
+                Mode == RejectionMode::KappaSigma
+                  ? 0.0f
+                  : static_cast<float>(num_frames));
+
+    for (size_t i = 0; i < num_frames; ++i) {
+      clip_accumulate<Mode, T>(frames.row(i, y, x0, len, row_buffer), median,
+                               scratch.center.data(), scratch.threshold.data(),
+                               scratch.sum.data(), scratch.sum_sq.data(),
+                               scratch.count.data(), len);
+    }
+
+    // Re-estimate center and spread from the surviving samples, pixels with
+    // every sample rejected keep their previous estimate
+    for (int j = 0; j < len; ++j) {
+      const float n = scratch.count[j];
+      if (n > 0.0f) {
+        const float offset = scratch.sum[j] / n;
+        const float variance = scratch.sum_sq[j] / n - offset * offset;
+        scratch.center[j] += offset;
+        scratch.threshold[j] = kappa * std::sqrt(std::max(variance, 0.0f));
+      }
+    }
+  }
+}
+
+// Transpose one row tile of every frame so the samples of one pixel/channel
+// are contiguous in scratch, widened to float on the way
+template <typename T, typename Rows>
+void transpose_tile(const Rows &frames, const int y, const int x0,
+                    const int len, float *scratch, T *row_buffer) {
+  const size_t num_images = frames.size();
+  for (size_t i = 0; i < num_images; ++i) {
+    const T *src = frames.row(i, y, x0, len, row_buffer);
+    float *dst = scratch + i;
+    for (int j = 0; j < len; ++j) {
+      dst[static_cast<size_t>(j) * num_images] = static_cast<float>(src[j]);
+    }
+  }
+}
+
+// Mean of the samples ranked lo..hi, two selections leave exactly those
+// ranks in values[lo..hi]
+float select_rank_mean(float *values, const size_t count, const size_t lo,
+                       const size_t hi) {
+  std::nth_element(values, values + lo, values + count);
+  if (hi > lo) {
+    std::nth_element(values + lo + 1, values + hi, values + count);
+  }
+  double sum = 0.0;
+  for (size_t i = lo; i <= hi; ++i) {
+    sum += values[i];
+  }
+  return static_cast<float>(sum / static_cast<double>(hi - lo + 1));
+}
+
+// Integer frames are ranked by counting: one histogram of a byte per
+// pixel/channel, which costs O(frames + bins) per pixel and never widens a
+// sample. 16-bit samples take a radix pass on the high byte first
+constexpr int histogram_bins = 256;
+
+// Pixels per histogram tile so that its histograms stay resident in L2
+int histogram_tile_length(const int row_len, const int histograms_per_pixel) {
+  const auto fit = static_cast<int>(
+    stack_tile_bytes /
+    (sizeof(uint32_t) * histogram_bins * histograms_per_pixel));
+  return std::max(1, std::min(row_len, fit));
+}
+
+// Bin holding the sample of the given rank, rank is made relative to the bin
+int histogram_select(const uint32_t *bins, size_t &rank) {
+  int bin = 0;
+  while (rank >= bins[bin]) {
+    rank -= bins[bin];
+    ++bin;
+  }
+  return bin;
+}
+
+// Sum of the samples ranked lo..hi, bins hold the values 0..255
+double histogram_rank_sum(const uint32_t *bins, const size_t lo,
+                          const size_t hi) {
+  double sum = 0.0;
+  size_t below = 0;
+  for (int v = 0; v < histogram_bins && below <= hi; ++v) {
+    const size_t first = std::max(below, lo);
+    const size_t last = std::min<size_t>(below + bins[v], hi + 1);
+    if (last > first) {
+      sum += static_cast<double>(v) * static_cast<double>(last - first);
+    }
+    below += bins[v];
+  }
+  return sum;
+}
+
+// Per-thread histograms of one tile, reused across tiles
+struct RankScratch {
+  RankScratch(const int tile_len, const int histograms_per_pixel)
+    : bins(static_cast<size_t>(tile_len) * histogram_bins * histograms_per_pixel),
+      bucket_lo(tile_len), bucket_hi(tile_len), rank_lo(tile_len),
+      rank_hi(tile_len), value_lo(tile_len), value_hi(tile_len),
+      between(tile_len), row(tile_len) {}
+
+  std::vector<uint32_t> bins;
+  std::vector<int> bucket_lo;
+  std::vector<int> bucket_hi;
+  std::vector<size_t> rank_lo;
+  std::vector<size_t> rank_hi;
+  std::vector<int> value_lo;
+  std::vector<int> value_hi;
+  std::vector<uint64_t> between;
+  // One shifted row segment, 8-bit rows use its bytes
+  std::vector<ushort> row;
+};
+
+template <typename Rows>
+void rank_mean_tile_8u(const Rows &frames, const int y, const int x0,
+                       const int len, const size_t lo, const size_t hi,
+                       RankScratch &scratch, float *out) {
+  uint32_t *bins = scratch.bins.data();
+  std::fill_n(bins, static_cast<size_t>(len) * histogram_bins, 0u);
+  auto *row_buffer = reinterpret_cast<uchar *>(scratch.row.data());
+
+  for (size_t i = 0; i < frames.size(); ++i) {
+    const uchar *src = frames.row(i, y, x0, len, row_buffer);
+    for (int j = 0; j < len; ++j) {
+      ++bins[j * histogram_bins + src[j]];
+    }
+  }
+
+  const double scale = 1.0 / static_cast<double>(hi - lo + 1);
+  for (int j = 0; j < len; ++j) {
+    out[j] = static_cast<float>(
+      histogram_rank_sum(bins + j * histogram_bins, lo, hi) * scale);
+  }
+}
+
+// Radix selection: the high byte histogram finds the bucket of ranks lo and
+// hi, a histogram of the low bytes inside each bucket gives their values,
+// and one more pass sums the samples strictly between them
+template <typename Rows>
+void rank_mean_tile_16u(const Rows &frames, const int y, const int x0,
+                        const int len, const size_t lo, const size_t hi,
+                        RankScratch &scratch, float *out) {
+  const size_t plane = static_cast<size_t>(len) * histogram_bins;
+  uint32_t *high = scratch.bins.data();
+  uint32_t *low_lo = high + plane;
+  uint32_t *low_hi = low_lo + plane;
+  std::fill_n(high, 3 * plane, 0u);
+
+  for (size_t i = 0; i < frames.size(); ++i) {
+    const ushort *src = frames.row(i, y, x0, len, scratch.row.data());
+    for (int j = 0; j < len; ++j) {
+      ++high[j * histogram_bins + (src[j] >> 8)];
+    }
+  }
+
+  for (int j = 0; j < len; ++j) {
+    scratch.rank_lo[j] = lo;
+    scratch.rank_hi[j] = hi;
+    scratch.bucket_lo[j] = histogram_select(high + j * histogram_bins, scratch.rank_lo[j]);
+    scratch.bucket_hi[j] = histogram_select(high + j * histogram_bins, scratch.rank_hi[j]);
+  }
+
+  for (size_t i = 0; i < frames.size(); ++i) {
+    const ushort *src = frames.row(i, y, x0, len, scratch.row.data());
+    for (int j = 0; j < len; ++j) {
+      const int bucket = src[j] >> 8;
+      const int bin = j * histogram_bins + (src[j] & 0xFF);
+      low_lo[bin] += bucket == scratch.bucket_lo[j];
+      low_hi[bin] += bucket == scratch.bucket_hi[j];
+    }
+  }
+
+  // Ranks left after the selection count the samples equal to the value
+  // that come before the selected one
+  for (int j = 0; j < len; ++j) {
+    size_t rank_lo = scratch.rank_lo[j];
+    size_t rank_hi = scratch.rank_hi[j];
+    const int bin_lo = histogram_select(low_lo + j * histogram_bins, rank_lo);
+    const int bin_hi = histogram_select(low_hi + j * histogram_bins, rank_hi);
+    scratch.value_lo[j] = (scratch.bucket_lo[j] << 8) | bin_lo;
+    scratch.value_hi[j] = (scratch.bucket_hi[j] << 8) | bin_hi;
+    // Ranks of value_lo start at lo - rank_lo, those of value_hi at hi - rank_hi
+    scratch.rank_lo[j] = lo - rank_lo + low_lo[j * histogram_bins + bin_lo];
+    scratch.rank_hi[j] = hi - rank_hi;
+    scratch.between[j] = 0;
+  }
+
+  for (size_t i = 0; i < frames.size(); ++i) {
+    const ushort *src = frames.row(i, y, x0, len, scratch.row.data());
+    for (int j = 0; j < len; ++j) {
+      const int v = src[j];
+      scratch.between[j] +=
+          (v > scratch.value_lo[j] && v < scratch.value_hi[j]) ? v : 0;
+    }
+  }
+
+  // Samples equal to value_lo from rank lo, everything strictly between,
+  // samples equal to value_hi up to rank hi
+  const double scale = 1.0 / static_cast<double>(hi - lo + 1);
+  for (int j = 0; j < len; ++j) {
+    const double v_lo = scratch.value_lo[j];
+    const double v_hi = scratch.value_hi[j];
+    double sum;
+    if (scratch.value_lo[j] == scratch.value_hi[j]) {
+      sum = v_lo * static_cast<double>(hi - lo + 1);
+    } else {
+      // rank_lo is one past the last rank of value_lo, rank_hi the first of value_hi
+      sum = v_lo * static_cast<double>(scratch.rank_lo[j] - lo) +
+            static_cast<double>(scratch.between[j]) +
+            v_hi * static_cast<double>(hi - scratch.rank_hi[j] + 1);
+    }
+    out[j] = static_cast<float>(sum * scale);
+  }
+}
+
+// Per-pixel mean of ranks lo..hi into out (CV_32F), by counting for integer
+// frames and by selection on transposed tiles for float frames
+void rank_mean(const FrameRows &frames, const size_t lo, const size_t hi,
+               cv::Mat &out) {
+  const cv::Size img_size = frames.front().size();
+  const int depth = frames.front().depth();
+  const size_t num_images = frames.size();
+  const int rows = img_size.height;
+  const int row_len = img_size.width * frames.front().channels();
+
+  if (depth == CV_32F) {
+    const int tile_len = tile_length(row_len, num_images);
+    const int tiles_per_row = (row_len + tile_len - 1) / tile_len;
+
+#pragma omp parallel default(none) \
+  shared(frames, out, num_images, rows, row_len, tile_len, tiles_per_row, lo, hi)
+    {
+      std::vector<float> scratch(static_cast<size_t>(tile_len) * num_images);
+      std::vector<float> row(tile_len);
+
+#pragma omp for collapse(2) schedule(static)
+      for (int y = 0; y < rows; ++y) {
+        for (int t = 0; t < tiles_per_row; ++t) {
+          const int x0 = t * tile_len;
+          const int len = std::min(tile_len, row_len - x0);
+
+          transpose_tile(frames, y, x0, len, scratch.data(), row.data());
+
+          float *dst = out.ptr<float>(y) + x0;
+          for (int j = 0; j < len; ++j) {
+            dst[j] = select_rank_mean(scratch.data() +
+                                      static_cast<size_t>(j) * num_images,
+                                      num_images, lo, hi);
+          }
+        }
+      }
+    }
+    return;
+  }
+
+  const int histograms_per_pixel = depth == CV_8U ? 1 : 3;
+  const int tile_len = histogram_tile_length(row_len, histograms_per_pixel);
+  const int tiles_per_row = (row_len + tile_len - 1) / tile_len;
+
+#pragma omp parallel default(none) \
+  shared(frames, out, depth, rows, row_len, tile_len, tiles_per_row, lo, hi, \
+         histograms_per_pixel)
+  {
+    RankScratch scratch(tile_len, histograms_per_pixel);
+
+#pragma omp for collapse(2) schedule(static)
+    for (int y = 0; y < rows; ++y) {
+      for (int t = 0; t < tiles_per_row; ++t) {
+        const int x0 = t * tile_len;
+        const int len = std::min(tile_len, row_len - x0);
+        float *dst = out.ptr<float>(y) + x0;
+        if (depth == CV_8U) {
+          rank_mean_tile_8u(frames, y, x0, len, lo, hi, scratch, dst);
+        } else {
+          rank_mean_tile_16u(frames, y, x0, len, lo, hi, scratch, dst);
+        }
+      }
+    }
+  }
+}
+
+// Ranks kept by the rank-based rejection modes
+std::pair<size_t, size_t> rejection_ranks(const RejectionMode mode,
+                                          const size_t count, const float low,
+                                          const float high) {
+  if (mode == RejectionMode::MinMax) {
+    return count >= 3 ? std::pair<size_t, size_t>{1, count - 2}
+                      : std::pair<size_t, size_t>{0, count - 1};
+  }
+
+  if (!(low >= 0.0f && low <= high && high <= 1.0f)) {
+    throw std::invalid_argument("Percentiles must satisfy 0 <= low <= high <= 1.");
+  }
+  // The slack keeps float fractions such as 0.2 x 5 from rounding past a rank
+  constexpr double slack = 1e-6;
+  const auto last = static_cast<double>(count - 1);
+  auto lo = static_cast<size_t>(std::ceil(low * last - slack));
+  auto hi = static_cast<size_t>(std::floor(high * last + slack));
+  // A range narrower than one rank keeps the rank nearest to its middle
+  if (lo > hi) {
+    lo = hi = static_cast<size_t>(std::lround((low + high) * 0.5 * last));
+  }
+  return {lo, hi};
+}
+
+template <typename T>
+void median_tiles(const FrameRows &frames, const MedianKernel median_kernel,
+                  cv::Mat &median_img) {
+  const size_t num_images = frames.size();
+  const int rows = median_img.rows;
+  const int row_len = median_img.cols * median_img.channels();
+  const int tile_len = tile_length(row_len, num_images);
+  const int tiles_per_row = (row_len + tile_len - 1) / tile_len;
+
+  // Parallelize over tiles, each thread owns one pixel-major scratch tile
+#pragma omp parallel default(none) \
+  shared(frames, median_img, num_images, rows, row_len, tile_len, \
+         tiles_per_row, median_kernel)
+  {
+    std::vector<float> scratch(static_cast<size_t>(tile_len) * num_images);
+    std::vector<T> row(tile_len);
+
+#pragma omp for collapse(2) schedule(static)
+    for (int y = 0; y < rows; ++y) {
+      for (int t = 0; t < tiles_per_row; ++t) {
+        const int x0 = t * tile_len;
+        const int len = std::min(tile_len, row_len - x0);
+
+        transpose_tile(frames, y, x0, len, scratch.data(), row.data());
+
+        float *out = median_img.ptr<float>(y) + x0;
+        for (int j = 0; j < len; ++j) {
+          out[j] = median_kernel(scratch.data() +
+                                 static_cast<size_t>(j) * num_images,
+                                 num_images);
+        }
+      }
+    }
+  }
+}
+
+template <RejectionMode Mode, typename T>
+void clip_tiles(const FrameRows &frames, const cv::Mat &mean_img,
+                const cv::Mat &std_img, const cv::Mat &median_img,
+                const float kappa, const int iterations, cv::Mat &result) {
+  const int rows = result.rows;
+  const int row_len = result.cols * result.channels();
+  const int tile_len = tile_length(row_len, frames.size());
+  const int tiles_per_row = (row_len + tile_len - 1) / tile_len;
+
+  // Parallelize over tiles, all iterations of a tile run back to back
+#pragma omp parallel default(none) \
+  shared(frames, mean_img, std_img, median_img, result, rows, row_len, \
+         tile_len, tiles_per_row, kappa, iterations)
+  {
+    ClipScratch scratch(tile_len);
+    std::vector<T> row(tile_len);
+
+#pragma omp for collapse(2) schedule(static)
+    for (int y = 0; y < rows; ++y) {
+      for (int t = 0; t < tiles_per_row; ++t) {
+        const int x0 = t * tile_len;
+        const int len = std::min(tile_len, row_len - x0);
+
+        // First pass clips against the precomputed mean and std
+        const float *mean_row = mean_img.ptr<float>(y) + x0;
+        const float *std_row = std_img.ptr<float>(y) + x0;
+        for (int j = 0; j < len; ++j) {
+          scratch.center[j] = mean_row[j];
+          scratch.threshold[j] = kappa * std_row[j];
+        }
+
+        const float *median_row =
+            median_img.empty() ? nullptr : median_img.ptr<float>(y) + x0;
+        clip_tile<Mode, T>(frames, median_row, y, x0, len, kappa, iterations,
+                           scratch, row.data());
+
+        std::copy_n(scratch.center.begin(), len, result.ptr<float>(y) + x0);
+      }
+    }
+  }
+}
+
+// Welford mean and standard deviation of one row tile, in the same order
+// and arithmetic as OnlineStacker so the two agree
+template <typename T, typename Rows>
+void moments_tile(const Rows &frames, const int y, const int x0, const int len,
+                  float *mean, float *std_dev, float *m2, T *row_buffer) {
+  const size_t num_images = frames.size();
+  std::fill_n(mean, len, 0.0f);
+  std::fill_n(m2, len, 0.0f);
+
+  for (size_t i = 0; i < num_images; ++i) {
+    const T *src = frames.row(i, y, x0, len, row_buffer);
+    const float inv_n = 1.0f / static_cast<float>(i + 1);
+    for (int j = 0; j < len; ++j) {
+      const auto value = static_cast<float>(src[j]);
+      const float delta = value - mean[j];
+      mean[j] += delta * inv_n;
+      m2[j] += delta * (value - mean[j]);
+    }
+  }
+
+  for (int j = 0; j < len; ++j) {
+    std_dev[j] = std::sqrt(static_cast<float>(
+      m2[j] / static_cast<double>(num_images)));
+  }
+}
+
+// Moments tile by tile like the other passes
+template <typename T>
+void moments_tiles(const FrameRows &frames, cv::Mat &mean_img,
+                   cv::Mat &std_img) {
+  const size_t num_images = frames.size();
+  const int rows = mean_img.rows;
+  const int row_len = mean_img.cols * mean_img.channels();
+  const int tile_len = tile_length(row_len, num_images);
+  const int tiles_per_row = (row_len + tile_len - 1) / tile_len;
+
+#pragma omp parallel default(none) \
+  shared(frames, mean_img, std_img, num_images, rows, row_len, tile_len, \
+         tiles_per_row)
+  {
+    std::vector<float> m2(tile_len);
+    std::vector<T> row(tile_len);
+
+#pragma omp for collapse(2) schedule(static)
+    for (int y = 0; y < rows; ++y) {
+      for (int t = 0; t < tiles_per_row; ++t) {
+        const int x0 = t * tile_len;
+        const int len = std::min(tile_len, row_len - x0);
+        moments_tile(frames, y, x0, len, mean_img.ptr<float>(y) + x0,
+                     std_img.ptr<float>(y) + x0, m2.data(), row.data());
+      }
+    }
+  }
+}
+
+void check_frames(const std::vector<cv::Mat> &images) {
   if (images.empty()) {
     throw std::invalid_argument("No images provided for stacking.");
   }
@@ -15,170 +861,332 @@ cv::Mat ImageStacker::stack_images(const std::vector<cv::Mat> &images) {
   // Validate all images have same dimensions and type
   const cv::Size img_size = images[0].size();
   const int img_type = images[0].type();
-  const size_t num_images = images.size();
+  const int depth = CV_MAT_DEPTH(img_type);
+  if (depth != CV_8U && depth != CV_16U && depth != CV_32F) {
+    throw std::invalid_argument("Stacking needs 8-bit, 16-bit or float frames.");
+  }
 
-  for (size_t i = 1; i < num_images; ++i) {
+  for (size_t i = 1; i < images.size(); ++i) {
     if (images[i].size() != img_size || images[i].type() != img_type) {
       throw std::invalid_argument(
         "All images must have same dimensions and type.");
     }
   }
+}
 
-  // Convert all images to float for processing
-  std::vector<cv::Mat> float_images = convert_to_float(images);
-
-  // Pre-compute mean and standard deviation images
-  cv::Mat mean_img, std_img;
-  compute_mean_and_std(float_images, mean_img, std_img);
+cv::Mat float_image(const FrameRows &frames) {
+  return cv::Mat(frames.front().size(),
+                 CV_MAKETYPE(CV_32F, frames.front().channels()));
+}
 
-  // Compute median image
-  const cv::Mat median_img = compute_median(float_images);
+void mean_and_std(const FrameRows &frames, cv::Mat &mean_img,
+                  cv::Mat &std_img) {
+  ScopedStage stage("stack.mean_std");
 
-  // Apply sigma clipping and compute final mean
-  const cv::Mat result = apply_sigma_clipping_and_mean(float_images, mean_img,
-                                                       std_img, median_img);
+  mean_img = float_image(frames);
+  std_img = float_image(frames);
+  dispatch_depth(frames.front().depth(), [&](auto sample) {
+    moments_tiles<decltype(sample)>(frames, mean_img, std_img);
+  });
+}
 
-  // Convert result back to original type
-  cv::Mat final_result;
-  result.convertTo(final_result, img_type);
-  return final_result;
+// Past a few dozen frames integer frames are cheaper to count than to
+// widen and select. The median is the mean of the middle one or two ranks
+bool counts_median(const int depth, const size_t num_images) {
+  return (depth == CV_8U && num_images > max_select_frames_8u) ||
+         (depth == CV_16U && num_images > max_select_frames_16u);
 }
 
-std::vector<cv::Mat>
-ImageStacker::convert_to_float(const std::vector<cv::Mat> &images) {
-  std::vector<cv::Mat> float_images;
-  float_images.reserve(images.size());
+cv::Mat median_image(const FrameRows &frames) {
+  ScopedStage stage("stack.median");
 
-  for (const auto &img: images) {
-    cv::Mat float_img;
-    img.convertTo(float_img, CV_32F);
-    float_images.push_back(std::move(float_img));
+  const size_t num_images = frames.size();
+  cv::Mat median_img = float_image(frames);
+
+  const int depth = frames.front().depth();
+  if (counts_median(depth, num_images)) {
+    rank_mean(frames, (num_images - 1) / 2, num_images / 2, median_img);
+    return median_img;
   }
 
-  return float_images;
+  const MedianKernel median_kernel = select_median_kernel(num_images);
+  dispatch_depth(depth, [&](auto sample) {
+    median_tiles<decltype(sample)>(frames, median_kernel, median_img);
+  });
+
+  return median_img;
 }
 
-void ImageStacker::compute_mean_and_std(
-  const std::vector<cv::Mat> &float_images, cv::Mat &mean_img,
-  cv::Mat &std_img) {
-  if (float_images.empty())
-    return;
+cv::Mat rank_mean_image(const FrameRows &frames, const size_t lo,
+                        const size_t hi) {
+  ScopedStage stage("stack.rank");
 
-  const cv::Size img_size = float_images[0].size();
-  const int channels = float_images[0].channels();
-  const size_t num_images = float_images.size();
+  cv::Mat result = float_image(frames);
+  rank_mean(frames, lo, hi, result);
+  return result;
+}
+
+cv::Mat clip_and_mean(const FrameRows &frames, const cv::Mat &mean_img,
+                      const cv::Mat &std_img, const cv::Mat &median_img,
+                      const ImageStacker::Settings &settings) {
+  ScopedStage stage("stack.clip");
 
-  // Initialize accumulator matrices
-  mean_img = cv::Mat::zeros(img_size, CV_MAKETYPE(CV_32F, channels));
-  cv::Mat sum_sq = cv::Mat::zeros(img_size, CV_MAKETYPE(CV_32F, channels));
+  const float kappa = settings.sigma_threshold;
+  const int iterations = std::max(1, settings.sigma_iterations);
+  const RejectionMode mode = settings.rejection_mode;
 
-  // Accumulate sum and sum of squares
-  for (const auto &img: float_images) {
-    mean_img += img;
-    cv::Mat img_sq;
-    cv::multiply(img, img, img_sq);
-    sum_sq += img_sq;
+  if (mode == RejectionMode::ReplaceWithMedian && median_img.empty()) {
+    throw std::invalid_argument("Median replacement needs a median image.");
+  }
+  if (mode == RejectionMode::Percentile || mode == RejectionMode::MinMax) {
+    throw std::invalid_argument("Rank-based rejection does not clip.");
   }
 
-  // Compute mean
-  mean_img /= static_cast<float>(num_images);
+  cv::Mat result = float_image(frames);
 
-  // Compute variance
-  cv::Mat mean_sq;
-  cv::multiply(mean_img, mean_img, mean_sq);
-  const cv::Mat variance = sum_sq / static_cast<float>(num_images) - mean_sq;
+  // One instantiation per rejection mode and element type
+  dispatch_depth(frames.front().depth(), [&](auto sample) {
+    using T = decltype(sample);
+    switch (mode) {
+      case RejectionMode::ReplaceWithMedian:
+        clip_tiles<RejectionMode::ReplaceWithMedian, T>(
+          frames, mean_img, std_img, median_img, kappa, iterations, result);
+        break;
+      case RejectionMode::KappaSigma:
+        clip_tiles<RejectionMode::KappaSigma, T>(
+          frames, mean_img, std_img, median_img, kappa, iterations, result);
+        break;
+      case RejectionMode::Winsorized:
+        clip_tiles<RejectionMode::Winsorized, T>(
+          frames, mean_img, std_img, median_img, kappa, iterations, result);
+        break;
+      case RejectionMode::Percentile:
+      case RejectionMode::MinMax:
+        break;
+    }
+  });
 
-  // Compute standard deviation
-  cv::sqrt(variance, std_img);
+  return result;
 }
 
-cv::Mat ImageStacker::compute_median(const std::vector<cv::Mat> &float_images) {
-  if (float_images.empty())
-    return {};
+// Moments, median and clipping of shifted frames in one sweep over the
+// tiles. Each tile of every frame is interpolated once into TileRows and
+// all passes read it there, the separate passes would interpolate every
+// sample again for each of them
+template <RejectionMode Mode, typename T>
+void shifted_tiles(const FrameRows &frames, const float kappa,
+                   const int iterations, cv::Mat &result) {
+  const size_t num_images = frames.size();
+  const int rows = result.rows;
+  const int row_len = result.cols * result.channels();
+  const int tile_len = tile_length(row_len, num_images);
+  const int tiles_per_row = (row_len + tile_len - 1) / tile_len;
 
-  const cv::Size img_size = float_images[0].size();
-  const int channels = float_images[0].channels();
-  const size_t num_images = float_images.size();
+  const bool count = Mode == RejectionMode::ReplaceWithMedian &&
+                     counts_median(frames.front().depth(), num_images);
+  const int histograms_per_pixel = std::is_same_v<T, uchar> ? 1 : 3;
+  const int histogram_len =
+      count ? histogram_tile_length(tile_len, histograms_per_pixel) : 0;
+  const MedianKernel median_kernel = select_median_kernel(num_images);
+  const size_t lo = (num_images - 1) / 2;
+  const size_t hi = num_images / 2;
 
-  cv::Mat median_img(img_size, CV_MAKETYPE(CV_32F, channels));
+#pragma omp parallel default(none) \
+  shared(frames, result, num_images, rows, row_len, tile_len, tiles_per_row, \
+         kappa, iterations, count, histograms_per_pixel, histogram_len, \
+         median_kernel, lo, hi)
+  {
+    constexpr bool needs_median = Mode == RejectionMode::ReplaceWithMedian;
+    TileRows<T> tile(num_images, tile_len);
+    std::vector<float> mean(tile_len);
+    std::vector<float> std_dev(tile_len);
+    std::vector<float> m2(tile_len);
+    ClipScratch scratch(tile_len);
 
-  // Parallelize over pixels
-#pragma omp parallel for default(none) collapse(2) schedule(static) \
-  shared(img_size, channels, median_img, num_images, float_images)
-  for (int y = 0; y < img_size.height; ++y) {
-    for (int x = 0; x < img_size.width; ++x) {
-      for (int ch = 0; ch < channels; ++ch) {
-        // Collect values for this pixel/channel
-        std::vector<float> values;
-        values.reserve(num_images);
+    // Median scratch: histograms when counting, a transposed tile otherwise
+    std::vector<float> median(needs_median ? tile_len : 0);
+    std::vector<float> transposed(needs_median && !count
+                                    ? static_cast<size_t>(tile_len) * num_images
+                                    : 0);
+    std::optional<RankScratch> ranks;
+    if (count) {
+      ranks.emplace(histogram_len, histograms_per_pixel);
+    }
 
-        for (size_t i = 0; i < num_images; ++i) {
-          values.push_back(float_images[i].ptr<float>(y)[x * channels + ch]);
-        }
+#pragma omp for collapse(2) schedule(static)
+    for (int y = 0; y < rows; ++y) {
+      for (int t = 0; t < tiles_per_row; ++t) {
+        const int x0 = t * tile_len;
+        const int len = std::min(tile_len, row_len - x0);
+        T *no_buffer = nullptr;
 
-        // Find median using nth_element
-        const size_t mid = values.size() / 2;
-        std::nth_element(values.begin(), values.begin() + static_cast<long>(mid), values.end());
-        float median_val = values[mid];
+        tile.load(frames, y, x0, len);
+        moments_tile(tile, y, x0, len, mean.data(), std_dev.data(), m2.data(),
+                     no_buffer);
 
-        // For even number of elements, average the two middle values
-        if (values.size() % 2 == 0 && values.size() > 1) {
-          auto max_it = std::max_element(values.begin(), values.begin() + static_cast<long>(mid));
-          median_val = (median_val + *max_it) * 0.5f;
+        if constexpr (needs_median) {
+          if (count) {
+            for (int h = 0; h < len; h += histogram_len) {
+              const int part = std::min(histogram_len, len - h);
+              if constexpr (std::is_same_v<T, uchar>) {
+                rank_mean_tile_8u(tile, y, x0 + h, part, lo, hi, *ranks,
+                                  median.data() + h);
+              } else if constexpr (std::is_same_v<T, ushort>) {
+                rank_mean_tile_16u(tile, y, x0 + h, part, lo, hi, *ranks,
+                                   median.data() + h);
+              }
+            }
+          } else {
+            transpose_tile(tile, y, x0, len, transposed.data(), no_buffer);
+            for (int j = 0; j < len; ++j) {
+              median[j] = median_kernel(transposed.data() +
+                                        static_cast<size_t>(j) * num_images,
+                                        num_images);
+            }
+          }
         }
 
-        median_img.ptr<float>(y)[x * channels + ch] = median_val;
+        // First pass clips against the tile's mean and std
+        for (int j = 0; j < len; ++j) {
+          scratch.center[j] = mean[j];
+          scratch.threshold[j] = kappa * std_dev[j];
+        }
+        clip_tile<Mode, T>(tile, needs_median ? median.data() : nullptr, y, x0,
+                           len, kappa, iterations, scratch, no_buffer);
+
+        std::copy_n(scratch.center.begin(), len, result.ptr<float>(y) + x0);
       }
     }
   }
+}
 
-  return median_img;
+cv::Mat shifted_stack(const FrameRows &frames,
+                      const ImageStacker::Settings &settings) {
+  ScopedStage stage("stack.shifted");
+
+  const float kappa = settings.sigma_threshold;
+  const int iterations = std::max(1, settings.sigma_iterations);
+  cv::Mat result = float_image(frames);
+
+  dispatch_depth(frames.front().depth(), [&](auto sample) {
+    using T = decltype(sample);
+    switch (settings.rejection_mode) {
+      case RejectionMode::ReplaceWithMedian:
+        shifted_tiles<RejectionMode::ReplaceWithMedian, T>(frames, kappa,
+                                                           iterations, result);
+        break;
+      case RejectionMode::KappaSigma:
+        shifted_tiles<RejectionMode::KappaSigma, T>(frames, kappa, iterations,
+                                                    result);
+        break;
+      case RejectionMode::Winsorized:
+        shifted_tiles<RejectionMode::Winsorized, T>(frames, kappa, iterations,
+                                                    result);
+        break;
+      case RejectionMode::Percentile:
+      case RejectionMode::MinMax:
+        break;
+    }
+  });
+
+  return result;
 }
 
-cv::Mat ImageStacker::apply_sigma_clipping_and_mean(
-  const std::vector<cv::Mat> &float_images, const cv::Mat &mean_img,
-  const cv::Mat &std_img, const cv::Mat &median_img) {
-  if (float_images.empty())
-    return {};
+// Every pass reads the frames through the same rows, shifted or not, and
+// widens tiles to float as it reads them instead of keeping a float copy
+cv::Mat stack_frames(const FrameRows &frames,
+                     const ImageStacker::Settings &settings) {
+  const RejectionMode mode = settings.rejection_mode;
 
-  const cv::Size img_size = float_images[0].size();
-  const int channels = float_images[0].channels();
-  const size_t num_images = float_images.size();
-
-  cv::Mat result = cv::Mat::zeros(img_size, CV_MAKETYPE(CV_32F, channels));
-
-  // Parallelize over pixels
-#pragma omp parallel for default(none) collapse(2) schedule(static) \
-  shared(result, img_size, channels, mean_img, std_img, median_img, float_images, num_images)
-  for (int y = 0; y < img_size.height; ++y) {
-    for (int x = 0; x < img_size.width; ++x) {
-      for (int ch = 0; ch < channels; ++ch) {
-        const int pixel_idx = x * channels + ch;
-        const float mean_val = mean_img.ptr<float>(y)[pixel_idx];
-        const float std_val = std_img.ptr<float>(y)[pixel_idx];
-        const float median_val = median_img.ptr<float>(y)[pixel_idx];
-        const float threshold = sigma_threshold * std_val;
-
-        double sum = 0.0;
-        int count = 0;
-
-        // Apply sigma clipping: replace outliers with median, then compute mean
-        for (size_t i = 0; i < num_images; ++i) {
-          float pixel_val = float_images[i].ptr<float>(y)[pixel_idx];
-
-          // Check if pixel is within sigma threshold
-          if (std::abs(pixel_val - mean_val) > threshold) {
-            pixel_val = median_val;
-          }
+  // Rank-based modes need neither the moments nor a clipping pass
+  if (mode == RejectionMode::Percentile || mode == RejectionMode::MinMax) {
+    const auto [lo, hi] =
+        rejection_ranks(mode, frames.size(), settings.percentile_low,
+                        settings.percentile_high);
+    return rank_mean_image(frames, lo, hi);
+  }
 
-          sum += pixel_val;
-          ++count;
-        }
+  // Shifted frames are interpolated once per tile for all passes
+  if (frames.shifted()) {
+    return shifted_stack(frames, settings);
+  }
 
-        result.ptr<float>(y)[pixel_idx] = static_cast<float>(sum / count);
-      }
-    }
+  // Pre-compute mean and standard deviation images
+  cv::Mat mean_img, std_img;
+  mean_and_std(frames, mean_img, std_img);
+
+  // Median is only needed when outliers are replaced by it
+  cv::Mat median_img;
+  if (mode == RejectionMode::ReplaceWithMedian) {
+    median_img = median_image(frames);
+  }
+
+  // Apply sigma clipping and compute final mean
+  return clip_and_mean(frames, mean_img, std_img, median_img, settings);
+}
+} // namespace
+
+cv::Mat ImageStacker::stack_images(const std::vector<cv::Mat> &images,
+                                   const Settings &settings) {
+  const cv::Mat result = stack_images_float(images, settings);
+
+  // Convert result back to original type
+  cv::Mat final_result;
+  result.convertTo(final_result, images[0].type());
+  return final_result;
+}
+
+cv::Mat ImageStacker::stack_images_float(const std::vector<cv::Mat> &images,
+                                         const Settings &settings) {
+  check_frames(images);
+  return stack_frames(FrameRows(images), settings);
+}
+
+cv::Mat ImageStacker::stack_shifted(const std::vector<CroppedImage> &crops,
+                                    const std::vector<cv::Point2d> &shifts,
+                                    const Settings &settings) {
+  if (shifts.size() != crops.size()) {
+    throw std::invalid_argument("Every crop needs exactly one shift.");
   }
 
+  // Headers only, the crops' pixels are read in place
+  std::vector<cv::Mat> frames;
+  frames.reserve(crops.size());
+  for (const auto &crop: crops) {
+    frames.push_back(crop.get_color());
+  }
+  check_frames(frames);
+  return stack_frames(FrameRows(frames, shifts), settings);
+}
+
+cv::Mat ImageStacker::stack_tiles(const TileStore &store,
+                                  const Settings &settings) {
+  cv::Mat result(store.frame_size(), CV_MAKETYPE(CV_32F, CV_MAT_CN(store.type())));
+
+  // Pixels are stacked independently, so every band is a complete stack of
+  // its rows. Only the band being stacked is resident
+  for (int b = 0; b < store.band_count(); ++b) {
+    const cv::Mat band_result = stack_images_float(store.band(b), settings);
+    band_result.copyTo(result.rowRange(store.band_rows(b)));
+    store.release_band(b);
+  }
   return result;
 }
+
+cv::Mat ImageStacker::compute_median(const std::vector<cv::Mat> &images) {
+  if (images.empty())
+    return {};
+
+  return median_image(FrameRows(images));
+}
+
+cv::Mat ImageStacker::compute_rank_mean(const std::vector<cv::Mat> &images,
+                                        const size_t lo, const size_t hi) {
+  if (images.empty())
+    return {};
+  if (lo > hi || hi >= images.size()) {
+    throw std::invalid_argument("Ranks must satisfy lo <= hi < frame count.");
+  }
+
+  return rank_mean_image(FrameRows(images), lo, hi);
+}
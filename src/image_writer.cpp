@@ -0,0 +1,138 @@
+#include "image_writer.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <string>
+#include <vector>
+
+namespace {
+constexpr size_t fits_block = 2880;
+constexpr size_t fits_card = 80;
+
+std::string lower_extension(const std::string &path) {
+  std::string extension = std::filesystem::path(path).extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return extension;
+}
+
+// Scale taking samples of the given depth to the 16-bit range
+double to_16bit_scale(const int source_depth) {
+  switch (source_depth) {
+    case CV_8U:
+      return 257.0;
+    case CV_16U:
+      return 1.0;
+    default:
+      return 65535.0; // float input is expected in [0, 1]
+  }
+}
+
+// Keyword cards are 80 columns: name padded to 8, "= ", value right-aligned
+// to column 30
+std::string fits_card_text(const std::string &keyword, const std::string &value) {
+  std::string card = keyword;
+  card.resize(8, ' ');
+  card += "= ";
+  card += std::string(value.size() < 20 ? 20 - value.size() : 0, ' ') + value;
+  card.resize(fits_card, ' ');
+  return card;
+}
+
+// One row as big-endian IEEE floats
+void write_be_row(std::ofstream &out, const float *row, const int len,
+                  std::vector<char> &buffer) {
+  buffer.resize(static_cast<size_t>(len) * 4);
+  for (int x = 0; x < len; ++x) {
+    uint32_t bits;
+    std::memcpy(&bits, row + x, sizeof(bits));
+    buffer[4 * x] = static_cast<char>(bits >> 24 & 0xff);
+    buffer[4 * x + 1] = static_cast<char>(bits >> 16 & 0xff);
+    buffer[4 * x + 2] = static_cast<char>(bits >> 8 & 0xff);
+    buffer[4 * x + 3] = static_cast<char>(bits & 0xff);
+  }
+  out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+}
+
+void pad_block(std::ofstream &out, const size_t written, const char fill) {
+  const size_t remainder = written % fits_block;
+  if (remainder != 0) {
+    const std::string padding(fits_block - remainder, fill);
+    out.write(padding.data(), static_cast<std::streamsize>(padding.size()));
+  }
+}
+} // namespace
+
+bool ImageWriter::write(const std::string &path, const cv::Mat &stack,
+                        const int source_depth) {
+  ScopedStage stage("write");
+
+  const std::string extension = lower_extension(path);
+  if (extension == ".fits" || extension == ".fit" || extension == ".fts") {
+    return write_fits(path, stack);
+  }
+
+  cv::Mat output;
+  if (extension == ".tif" || extension == ".tiff" || source_depth == CV_32F) {
+    stack.convertTo(output, CV_16U, to_16bit_scale(source_depth));
+  } else {
+    stack.convertTo(output, source_depth);
+  }
+  stage.add_bytes(output.total() * output.elemSize());
+  return cv::imwrite(path, output);
+}
+
+bool ImageWriter::write_fits(const std::string &path, const cv::Mat &image) {
+  if (image.empty() || (image.channels() != 1 && image.channels() != 3)) {
+    return false;
+  }
+
+  cv::Mat data;
+  image.convertTo(data, CV_32F);
+
+  std::ofstream out(path, std::ios::binary);
+  if (!out) {
+    return false;
+  }
+
+  const bool color = data.channels() == 3;
+  std::vector<std::string> cards = {
+    fits_card_text("SIMPLE", "T"),
+    fits_card_text("BITPIX", "-32"),
+    fits_card_text("NAXIS", color ? "3" : "2"),
+    fits_card_text("NAXIS1", std::to_string(data.cols)),
+    fits_card_text("NAXIS2", std::to_string(data.rows)),
+  };
+  if (color) {
+    cards.push_back(fits_card_text("NAXIS3", "3"));
+  }
+  cards.emplace_back("END");
+  cards.back().resize(fits_card, ' ');
+
+  for (const auto &card: cards) {
+    out.write(card.data(), static_cast<std::streamsize>(card.size()));
+  }
+  pad_block(out, cards.size() * fits_card, ' ');
+
+  // FITS stores planes R, G, B and rows bottom-up, big-endian
+  std::vector<cv::Mat> planes;
+  cv::split(data, planes);
+  if (color) {
+    std::swap(planes[0], planes[2]);
+  }
+  std::vector<char> buffer;
+  for (const auto &plane: planes) {
+    for (int y = plane.rows - 1; y >= 0; --y) {
+      write_be_row(out, plane.ptr<float>(y), plane.cols, buffer);
+    }
+  }
+  pad_block(out, data.total() * data.channels() * sizeof(float), '\0');
+
+  return static_cast<bool>(out);
+}
@@ -0,0 +1,410 @@
+#include "live_stacker.hpp"
+#include "batch_scheduler.hpp"
+#include "image_writer.hpp"
+#include "profiler.hpp"
+#include "ser_file.hpp"
+#include "video_processor.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/videoio.hpp>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+int LiveStacker::reference_frames = 10;
+int LiveStacker::preview_interval = 10;
+int LiveStacker::checkpoint_interval = 100;
+int LiveStacker::poll_ms = 500;
+int LiveStacker::idle_timeout_s = 60;
+
+namespace {
+// Checkpoints are scratch state of one machine, written in host byte order
+constexpr char checkpoint_magic[] = "PSLIVE01";
+constexpr size_t checkpoint_magic_size = sizeof(checkpoint_magic) - 1;
+constexpr uint32_t checkpoint_version = 1;
+
+template <typename T> void write_value(std::ofstream &out, const T value) {
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> T read_value(std::ifstream &in) {
+  T value{};
+  in.read(reinterpret_cast<char *>(&value), sizeof(T));
+  if (!in) {
+    throw std::runtime_error("Truncated live stack checkpoint.");
+  }
+  return value;
+}
+
+void write_mat(std::ofstream &out, const cv::Mat &mat) {
+  write_value<int32_t>(out, mat.type());
+  write_value<int32_t>(out, mat.rows);
+  write_value<int32_t>(out, mat.cols);
+  const size_t row_bytes = mat.cols * mat.elemSize();
+  for (int y = 0; y < mat.rows; ++y) {
+    out.write(reinterpret_cast<const char *>(mat.ptr(y)),
+              static_cast<std::streamsize>(row_bytes));
+  }
+}
+
+cv::Mat read_mat(std::ifstream &in) {
+  const auto type = read_value<int32_t>(in);
+  const auto rows = read_value<int32_t>(in);
+  const auto cols = read_value<int32_t>(in);
+  if (rows < 0 || cols < 0) {
+    throw std::runtime_error("Corrupt live stack checkpoint.");
+  }
+  cv::Mat mat(rows, cols, type);
+  in.read(reinterpret_cast<char *>(mat.data),
+          static_cast<std::streamsize>(mat.total() * mat.elemSize()));
+  if (!in) {
+    throw std::runtime_error("Truncated live stack checkpoint.");
+  }
+  return mat;
+}
+
+void write_string(std::ofstream &out, const std::string &text) {
+  write_value<uint64_t>(out, text.size());
+  out.write(text.data(), static_cast<std::streamsize>(text.size()));
+}
+
+std::string read_string(std::ifstream &in) {
+  std::string text(read_value<uint64_t>(in), '\0');
+  in.read(text.data(), static_cast<std::streamsize>(text.size()));
+  if (!in) {
+    throw std::runtime_error("Truncated live stack checkpoint.");
+  }
+  return text;
+}
+
+bool is_still_image(const fs::path &path) {
+  std::string extension = path.extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  static const std::vector<std::string> extensions = {
+    ".png", ".tif", ".tiff", ".jpg", ".jpeg", ".bmp"
+  };
+  return std::find(extensions.begin(), extensions.end(), extension) !=
+         extensions.end();
+}
+
+// The same file is recognized however the source was spelled
+std::string source_key(const std::string &path) {
+  return fs::weakly_canonical(path).string();
+}
+} // namespace
+
+LiveStacker::LiveStacker(const int crop_size, std::string preview_path,
+                         std::string checkpoint_path,
+                         PreviewCallback on_preview, SkipCallback on_skip)
+  : crop_size(crop_size), preview_path(std::move(preview_path)),
+    checkpoint_path(std::move(checkpoint_path)),
+    on_preview(std::move(on_preview)), on_skip(std::move(on_skip)),
+    tracker(crop_size) {
+  if (crop_size < 1) {
+    throw std::invalid_argument("Crop size must be positive.");
+  }
+}
+
+bool LiveStacker::resume() {
+  std::ifstream in(checkpoint_path, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+
+  char magic[checkpoint_magic_size];
+  in.read(magic, checkpoint_magic_size);
+  if (!in || std::memcmp(magic, checkpoint_magic, checkpoint_magic_size) != 0 ||
+      read_value<uint32_t>(in) != checkpoint_version) {
+    throw std::runtime_error("Not a live stack checkpoint: " + checkpoint_path);
+  }
+  if (read_value<int32_t>(in) != crop_size) {
+    throw std::runtime_error(
+      "Checkpoint was made with another crop size: " + checkpoint_path);
+  }
+
+  const auto count = read_value<uint64_t>(in);
+  const auto type = read_value<int32_t>(in);
+  const cv::Mat mean = read_mat(in);
+  const cv::Mat m2 = read_mat(in);
+  const cv::Mat template_gray = read_mat(in);
+
+  std::map<std::string, size_t> saved_progress;
+  const auto sources = read_value<uint64_t>(in);
+  for (uint64_t i = 0; i < sources; ++i) {
+    std::string key = read_string(in);
+    saved_progress[std::move(key)] = read_value<uint64_t>(in);
+  }
+
+  accumulator.restore(mean, m2, count, type);
+  reference.reset();
+  if (!template_gray.empty()) {
+    reference = std::make_unique<ImageAligner::FixedReference>(template_gray);
+  }
+  progress = std::move(saved_progress);
+  held_back.clear();
+  return true;
+}
+
+size_t LiveStacker::poll(const std::string &source) {
+  if (!fs::is_directory(source)) {
+    return poll_capture(source);
+  }
+
+  // Only the top level is scanned, so the output directory inside it and
+  // the previews written there are never picked up as frames
+  std::vector<std::string> files;
+  for (const auto &entry: fs::directory_iterator(source)) {
+    if (entry.is_regular_file()) {
+      files.push_back(entry.path().string());
+    }
+  }
+  std::sort(files.begin(), files.end());
+
+  size_t added = 0;
+  for (const auto &file: files) {
+    if (BatchScheduler::is_capture(file)) {
+      added += poll_capture(file);
+    } else if (is_still_image(file)) {
+      added += poll_image(file);
+    }
+  }
+  return added;
+}
+
+void LiveStacker::watch(const std::string &source) {
+  using Clock = std::chrono::steady_clock;
+  auto last_frame = Clock::now();
+
+  while (true) {
+    if (poll(source) > 0) {
+      last_frame = Clock::now();
+      continue;
+    }
+
+    // The capture paused before enough frames came in to pick the
+    // reference from, stack what there is instead of showing nothing
+    choose_reference();
+
+    if (idle_timeout_s > 0 &&
+        Clock::now() - last_frame >= std::chrono::seconds(idle_timeout_s)) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
+  }
+
+  finish();
+}
+
+bool LiveStacker::add_frame(const cv::Mat &frame) {
+  // A cloud or a blank frame must not end the session, only that frame is
+  // lost
+  Centroid centroid{};
+  try {
+    centroid = tracker.locate(frame);
+  } catch (const std::runtime_error &) {
+    tracker.reset();
+    return false;
+  }
+  CroppedImage crop =
+      PlanetDetector::crop_around(frame, cv::Mat(), centroid, crop_size);
+
+  if (!reference) {
+    held_back.push_back(std::move(crop));
+    if (held_back.size() >= static_cast<size_t>(std::max(1, reference_frames))) {
+      choose_reference();
+    }
+    return true;
+  }
+  stack_crop(crop);
+  return true;
+}
+
+void LiveStacker::consume(const cv::Mat &frame, const std::string &source,
+                          const size_t index) {
+  if (!add_frame(frame) && on_skip) {
+    on_skip(source, index);
+  }
+}
+
+void LiveStacker::finish() {
+  choose_reference();
+  if (accumulator.count() > 0) {
+    write_preview();
+    write_checkpoint();
+  }
+}
+
+void LiveStacker::write_preview() const {
+  if (accumulator.count() == 0) {
+    return;
+  }
+  if (!ImageWriter::write(preview_path, accumulator.mean(),
+                          CV_MAT_DEPTH(accumulator.type()))) {
+    throw std::runtime_error("Error saving preview to: " + preview_path);
+  }
+  if (on_preview) {
+    on_preview(accumulator.count());
+  }
+}
+
+void LiveStacker::write_checkpoint() {
+  ScopedStage stage("live.checkpoint");
+
+  const std::string temporary = checkpoint_path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      throw std::runtime_error("Could not write checkpoint: " + temporary);
+    }
+
+    out.write(checkpoint_magic, checkpoint_magic_size);
+    write_value<uint32_t>(out, checkpoint_version);
+    write_value<int32_t>(out, crop_size);
+    write_value<uint64_t>(out, accumulator.count());
+    write_value<int32_t>(out, accumulator.type());
+    write_mat(out, accumulator.mean());
+    write_mat(out, accumulator.m2());
+    write_mat(out, reference ? reference->template_gray() : cv::Mat());
+
+    write_value<uint64_t>(out, progress.size());
+    for (const auto &[key, frames]: progress) {
+      write_string(out, key);
+      write_value<uint64_t>(out, frames);
+    }
+
+    if (!out.flush()) {
+      throw std::runtime_error("Could not write checkpoint: " + temporary);
+    }
+  }
+  fs::rename(temporary, checkpoint_path);
+}
+
+size_t LiveStacker::frame_count() const { return accumulator.count(); }
+
+cv::Mat LiveStacker::stack() const { return accumulator.mean(); }
+
+size_t LiveStacker::poll_capture(const std::string &path) {
+  size_t &done = progress[source_key(path)];
+  size_t added = 0;
+
+  if (SerReader::is_ser_file(path)) {
+    // Capture software may not have written the header yet, the file is
+    // retried on the next scan
+    std::unique_ptr<SerReader> reader;
+    try {
+      reader = std::make_unique<SerReader>(path);
+    } catch (const std::runtime_error &) {
+      return 0;
+    }
+
+    const auto available = static_cast<size_t>(reader->frame_count());
+    if (done < available) {
+      switch_source(path);
+    }
+    // Frames are marked as read before they are added, a checkpoint written
+    // while adding one already counts it
+    while (done < available) {
+      const auto index = static_cast<int>(done++);
+      consume(VideoProcessor::readSerFrame(*reader, index), path,
+              static_cast<size_t>(index));
+      ++added;
+    }
+    return added;
+  }
+
+  cv::VideoCapture cap(path);
+  if (!cap.isOpened()) {
+    return 0;
+  }
+  // Containers that cannot seek exactly are read up to the first new frame
+  if (done > 0 && !VideoProcessor::seekToFrame(cap, path, static_cast<int>(done))) {
+    size_t skipped = 0;
+    while (skipped < done && cap.grab()) {
+      ++skipped;
+    }
+  }
+
+  cv::Mat frame;
+  while (cap.read(frame)) {
+    if (added == 0) {
+      switch_source(path);
+    }
+    consume(frame, path, done++);
+    ++added;
+  }
+  return added;
+}
+
+size_t LiveStacker::poll_image(const std::string &path) {
+  const std::string key = source_key(path);
+  if (progress.count(key) != 0) {
+    return 0;
+  }
+
+  // A file that does not decode yet is still being written
+  const cv::Mat frame = cv::imread(path, cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
+  if (frame.empty()) {
+    return 0;
+  }
+  // Consecutive stills are frames of one capture, tracking carries over
+  progress[key] = 1;
+  consume(frame, path, 0);
+  return 1;
+}
+
+void LiveStacker::switch_source(const std::string &path) {
+  if (path != current_source) {
+    current_source = path;
+    tracker.reset();
+  }
+}
+
+void LiveStacker::choose_reference() {
+  if (held_back.empty()) {
+    return;
+  }
+
+  const auto best = std::max_element(held_back.begin(), held_back.end());
+  reference = std::make_unique<ImageAligner::FixedReference>(best->get_grayscale());
+
+  // Checkpoints wait until every held-back frame is in the stack, their
+  // sources are already marked as read
+  const size_t before = accumulator.count();
+  for (const auto &crop: held_back) {
+    stack_crop(crop);
+  }
+  held_back.clear();
+
+  if (checkpoint_interval > 0 &&
+      accumulator.count() / checkpoint_interval != before / checkpoint_interval) {
+    write_checkpoint();
+  }
+}
+
+void LiveStacker::stack_crop(const CroppedImage &crop) {
+  reference->align(crop, aligned);
+  {
+    ScopedStage stage("live.accumulate");
+    accumulator.add(aligned);
+  }
+
+  const size_t frames = accumulator.count();
+  if (preview_interval > 0 && frames % preview_interval == 0) {
+    write_preview();
+  }
+  if (checkpoint_interval > 0 && frames % checkpoint_interval == 0 &&
+      held_back.empty()) {
+    write_checkpoint();
+  }
+}
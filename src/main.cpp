@@ -1,25 +1,334 @@
+#include "analysis_index.hpp"
+#include "batch_scheduler.hpp"
 #include "cropped_image.hpp"
 #include "image_aligner.hpp"
 #include "image_stacker.hpp"
+#include "image_writer.hpp"
+#include "live_stacker.hpp"
+#include "out_of_core_stacker.hpp"
 #include "planet_detector.hpp"
+#include "profiler.hpp"
+#include "tile_store.hpp"
 #include "video_processor.hpp"
+#include <algorithm>
 #include <filesystem>
 #include <iostream>
-#include <opencv2/imgcodecs.hpp>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace fs = std::filesystem;
 
+namespace {
+void print_usage(const char *program) {
+  std::cerr << "Usage: " << program
+      << " <video_path> <crop_size> [frame_skip]"
+         "\n       " << program
+      << " --batch <directory|list.txt> <crop_size> [frame_skip]"
+         "\n       " << program
+      << " --live <capture|directory> <crop_size>"
+         "\n       "
+         " [--keep-percent <percent>] [--keep-count <count>]"
+         " [--sigma <kappa>] [--sigma-iterations <count>]"
+         " [--rejection <median|kappa|winsor|percentile|minmax>]"
+         " [--percentile <low> <high>]"
+         " [--ap-grid <count>] [--ap-size <pixels>]"
+         " [--pyramid <levels>] [--pyramid-window <pixels>]"
+         " [--profile <summary.json>] [--trace <trace.json>]"
+         " [--sharpness <laplacian|gradient>] [--score-step <rows>]"
+         " [--no-tracking] [--full-debayer] [--no-index] [--format <png|tiff|fits>]"
+         " [--scratch <directory>] [--decoders <count>]"
+         " [--preview-every <frames>] [--checkpoint-every <frames>]"
+         " [--idle-timeout <seconds>]\n";
+}
+
+bool parse_rejection_mode(const std::string &name,
+                          ImageStacker::RejectionMode &mode) {
+  if (name == "median") {
+    mode = ImageStacker::RejectionMode::ReplaceWithMedian;
+  } else if (name == "kappa") {
+    mode = ImageStacker::RejectionMode::KappaSigma;
+  } else if (name == "winsor") {
+    mode = ImageStacker::RejectionMode::Winsorized;
+  } else if (name == "percentile") {
+    mode = ImageStacker::RejectionMode::Percentile;
+  } else if (name == "minmax") {
+    mode = ImageStacker::RejectionMode::MinMax;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool write_profile(const std::string &profile_path,
+                   const std::string &trace_path) {
+  if (!profile_path.empty()) {
+    if (!Profiler::write_summary(profile_path)) {
+      std::cerr << "Error writing profile to: " << profile_path << std::endl;
+      return false;
+    }
+    std::cout << "Profile written to: " << profile_path << std::endl;
+  }
+  if (!trace_path.empty()) {
+    if (!Profiler::write_trace(trace_path)) {
+      std::cerr << "Error writing trace to: " << trace_path << std::endl;
+      return false;
+    }
+    std::cout << "Trace written to: " << trace_path << std::endl;
+  }
+  return true;
+}
+
+// Every capture of a directory or list through one shared scheduler
+int run_batch(const std::string &source,
+              const std::vector<std::string> &positional,
+              const double keep_percent, const size_t keep_count,
+              const std::string &output_format, const std::string &profile_path,
+              const std::string &trace_path) {
+  BatchOptions options;
+  options.crop_size = std::stoi(positional[0]);
+  options.frame_skip = positional.size() > 1 ? std::stoi(positional[1]) : 1;
+  options.keep_percent = keep_percent;
+  options.keep_count = keep_count;
+  options.output_format = output_format;
+
+  if (!profile_path.empty() || !trace_path.empty()) {
+    Profiler::enable();
+  }
+
+  try {
+    const std::vector<std::string> inputs = BatchScheduler::collect_inputs(source);
+    if (inputs.empty()) {
+      std::cerr << "No captures found in: " << source << std::endl;
+      return 1;
+    }
+    std::cout << "Batch of " << inputs.size() << " captures\nCrop size: "
+        << options.crop_size << "\nFrame skip: " << options.frame_skip
+        << std::endl;
+
+    size_t done = 0;
+    const BatchScheduler scheduler(options);
+    const std::vector<JobStatus> statuses = scheduler.run(
+      inputs, [&done, &inputs](const JobStatus &status) {
+        std::cout << "[" << ++done << "/" << inputs.size() << "] "
+            << status.input << ": ";
+        if (status.ok) {
+          std::cout << status.frames << " frames -> " << status.output << " ("
+              << status.crop_ms << " ms crop, " << status.stack_ms
+              << " ms stack)" << std::endl;
+        } else {
+          std::cout << "FAILED: " << status.error << std::endl;
+        }
+      });
+
+    const auto failed = static_cast<size_t>(
+      std::count_if(statuses.begin(), statuses.end(),
+                    [](const JobStatus &s) { return !s.ok; }));
+    std::cout << "Completed " << statuses.size() - failed << "/"
+        << statuses.size() << " captures successfully." << std::endl;
+
+    if (!write_profile(profile_path, trace_path)) {
+      return 1;
+    }
+    return failed == 0 ? 0 : 1;
+  } catch (const std::exception &e) {
+    std::cerr << "Exception: " << e.what() << std::endl;
+    return 1;
+  }
+}
+
+// Stack a running capture as its frames arrive, resuming the checkpoint of
+// an earlier run on the same source
+int run_live(const std::string &source,
+             const std::vector<std::string> &positional,
+             const std::string &output_format, const std::string &profile_path,
+             const std::string &trace_path) {
+  if (!fs::exists(source)) {
+    std::cerr << "No such capture or directory: " << source << std::endl;
+    return 1;
+  }
+  const int crop_size = std::stoi(positional[0]);
+
+  // A watched directory keeps its outputs in a subdirectory, which the
+  // non-recursive scan never reads back as frames
+  fs::path source_path(source);
+  if (!source_path.has_filename()) {
+    source_path = source_path.parent_path();
+  }
+  const bool is_directory = fs::is_directory(source_path);
+  const fs::path output_dir =
+      (is_directory ? source_path : source_path.parent_path()) / "output";
+  fs::create_directories(output_dir);
+  const std::string stem = is_directory ? source_path.filename().string()
+                                        : source_path.stem().string();
+  const std::string preview_path =
+      (output_dir / (stem + "_live." + output_format)).string();
+  const std::string checkpoint_path =
+      (output_dir / (stem + "_live.checkpoint")).string();
+
+  if (!profile_path.empty() || !trace_path.empty()) {
+    Profiler::enable();
+  }
+
+  try {
+    LiveStacker stacker(crop_size, preview_path, checkpoint_path,
+                        [&preview_path](const size_t frames) {
+                          std::cout << "  " << frames << " frames -> "
+                              << preview_path << std::endl;
+                        },
+                        [](const std::string &file, const size_t frame) {
+                          std::cerr << "  Skipped frame " << frame << " of "
+                              << file << ": no target found" << std::endl;
+                        });
+    if (stacker.resume()) {
+      std::cout << "Resuming " << checkpoint_path << " with "
+          << stacker.frame_count() << " frames" << std::endl;
+    }
+    std::cout << "Watching: " << source << "\nCrop size: " << crop_size
+        << std::endl;
+
+    stacker.watch(source);
+    std::cout << "Stacked " << stacker.frame_count() << " frames into: "
+        << preview_path << std::endl;
+
+    if (!write_profile(profile_path, trace_path)) {
+      return 1;
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Exception: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+} // namespace
+
 int main(const int argc, char *argv[]) {
-  if (argc < 3) {
-    std::cerr << "Usage: " << argv[0]
-        << " <video_path> <crop_size> [frame_skip]\n";
+  std::vector<std::string> positional;
+  double keep_percent = 0.0;
+  size_t keep_count = 0;
+  std::string profile_path;
+  std::string trace_path;
+  std::string output_format = "png";
+  std::string batch_source;
+  std::string live_source;
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--keep-percent" && i + 1 < argc) {
+      keep_percent = std::stod(argv[++i]);
+    } else if (arg == "--keep-count" && i + 1 < argc) {
+      keep_count = std::stoul(argv[++i]);
+    } else if (arg == "--sigma" && i + 1 < argc) {
+      ImageStacker::sigma_threshold = std::stof(argv[++i]);
+    } else if (arg == "--sigma-iterations" && i + 1 < argc) {
+      ImageStacker::sigma_iterations = std::stoi(argv[++i]);
+    } else if (arg == "--rejection" && i + 1 < argc) {
+      if (!parse_rejection_mode(argv[++i], ImageStacker::rejection_mode)) {
+        std::cerr << "Unknown rejection mode: " << argv[i] << "\n";
+        print_usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "--percentile" && i + 2 < argc) {
+      ImageStacker::percentile_low = std::stof(argv[++i]);
+      ImageStacker::percentile_high = std::stof(argv[++i]);
+    } else if (arg == "--ap-grid" && i + 1 < argc) {
+      ImageAligner::ap_grid = std::stoi(argv[++i]);
+    } else if (arg == "--ap-size" && i + 1 < argc) {
+      ImageAligner::ap_box_size = std::stoi(argv[++i]);
+    } else if (arg == "--pyramid" && i + 1 < argc) {
+      ImageAligner::pyramid_levels = std::stoi(argv[++i]);
+    } else if (arg == "--pyramid-window" && i + 1 < argc) {
+      ImageAligner::pyramid_window = std::stoi(argv[++i]);
+    } else if (arg == "--sharpness" && i + 1 < argc) {
+      const std::string metric = argv[++i];
+      if (metric == "laplacian") {
+        CroppedImage::sharpness_metric = CroppedImage::SharpnessMetric::Laplacian;
+      } else if (metric == "gradient") {
+        CroppedImage::sharpness_metric =
+            CroppedImage::SharpnessMetric::GradientEnergy;
+      } else {
+        std::cerr << "Unknown sharpness metric: " << metric << "\n";
+        print_usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "--score-step" && i + 1 < argc) {
+      CroppedImage::sample_step = std::stoi(argv[++i]);
+    } else if (arg == "--no-tracking") {
+      VideoProcessor::track_target = false;
+    } else if (arg == "--full-debayer") {
+      VideoProcessor::debayer_after_crop = false;
+    } else if (arg == "--no-index") {
+      AnalysisIndex::enabled = false;
+    } else if (arg == "--format" && i + 1 < argc) {
+      output_format = argv[++i];
+      if (output_format != "png" && output_format != "tiff" &&
+          output_format != "fits") {
+        std::cerr << "Unknown output format: " << output_format << "\n";
+        print_usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "--decoders" && i + 1 < argc) {
+      VideoProcessor::decode_segments = std::stoi(argv[++i]);
+    } else if (arg == "--scratch" && i + 1 < argc) {
+      TileStore::scratch_dir = argv[++i];
+    } else if (arg == "--batch" && i + 1 < argc) {
+      batch_source = argv[++i];
+    } else if (arg == "--live" && i + 1 < argc) {
+      live_source = argv[++i];
+    } else if (arg == "--preview-every" && i + 1 < argc) {
+      LiveStacker::preview_interval = std::stoi(argv[++i]);
+    } else if (arg == "--checkpoint-every" && i + 1 < argc) {
+      LiveStacker::checkpoint_interval = std::stoi(argv[++i]);
+    } else if (arg == "--idle-timeout" && i + 1 < argc) {
+      LiveStacker::idle_timeout_s = std::stoi(argv[++i]);
+    } else if (arg == "--profile" && i + 1 < argc) {
+      profile_path = argv[++i];
+    } else if (arg == "--trace" && i + 1 < argc) {
+      trace_path = argv[++i];
+    } else if (arg.rfind("--", 0) == 0) {
+      std::cerr << "Unknown or incomplete option: " << arg << "\n";
+      print_usage(argv[0]);
+      return 1;
+    } else {
+      positional.push_back(arg);
+    }
+  }
+
+  if (keep_percent < 0.0 || keep_percent > 100.0) {
+    std::cerr << "Keep percent must be between 0 and 100: " << keep_percent
+        << "\n";
+    print_usage(argv[0]);
+    return 1;
+  }
+  if (keep_percent > 0.0 && keep_count > 0) {
+    std::cerr << "Use either --keep-percent or --keep-count, not both.\n";
+    return 1;
+  }
+  if (!batch_source.empty()) {
+    if (positional.empty()) {
+      print_usage(argv[0]);
+      return 1;
+    }
+    return run_batch(batch_source, positional, keep_percent, keep_count,
+                     output_format, profile_path, trace_path);
+  }
+  if (!live_source.empty()) {
+    if (positional.empty()) {
+      print_usage(argv[0]);
+      return 1;
+    }
+    return run_live(live_source, positional, output_format, profile_path,
+                    trace_path);
+  }
+  if (positional.size() < 2) {
+    print_usage(argv[0]);
     return 1;
   }
 
-  std::string video_path = argv[1];
-  int crop_size = std::stoi(argv[2]);
-  int frame_skip = (argc > 3) ? std::stoi(argv[3]) : 1;
+  std::string video_path = positional[0];
+  int crop_size = std::stoi(positional[1]);
+  int frame_skip = (positional.size() > 2) ? std::stoi(positional[2]) : 1;
 
   std::cout << "Processing video: " << video_path
       << "\nCrop size: " << crop_size << "\nFrame skip: " << frame_skip
@@ -30,37 +339,108 @@ int main(const int argc, char *argv[]) {
   fs::path output_dir = input_path.parent_path() / "output";
   fs::create_directories(output_dir);
   fs::path output_path =
-      output_dir / (input_path.stem().string() + "_stacked.png");
+      output_dir / (input_path.stem().string() + "_stacked." + output_format);
+
+  if (!profile_path.empty() || !trace_path.empty()) {
+    Profiler::enable();
+  }
 
   try {
-    // Process video
-    std::cout << "Step 1/3: Cropping frames..." << std::endl;
-    std::vector<CroppedImage> cropped_images =
-        VideoProcessor::processVideo(video_path, crop_size, frame_skip);
-    std::cout << "  Cropped " << cropped_images.size() << " frames.\n";
-
-    if (cropped_images.empty()) {
-      std::cerr << "No images were cropped. Exiting." << std::endl;
-      return 1;
-    }
+    cv::Mat final_image;
+    int source_depth = CV_8U;
+    AnalysisIndex analysis(video_path, crop_size, frame_skip);
+    if (TileStore::scratch_dir.empty()) {
+      // Process video
+      std::cout << "Step 1/3: Cropping frames..." << std::endl;
+      std::vector<CroppedImage> cropped_images;
+      {
+        ScopedStage stage("pipeline.crop");
+        cropped_images = analysis.crop_best(keep_percent, keep_count);
+      }
+      std::cout << "  Cropped " << cropped_images.size() << " frames";
+      if (analysis.reused()) {
+        std::cout << " located by " << AnalysisIndex::sidecar_path(video_path);
+      }
+      std::cout << ".\n";
+
+      if (cropped_images.empty()) {
+        std::cerr << "No images were cropped. Exiting." << std::endl;
+        return 1;
+      }
+      source_depth = cropped_images.front().get_color().depth();
+
+      std::cout << "Step 2/3: Aligning images..." << std::endl;
+      if (ImageAligner::ap_grid == 0) {
+        // One global shift per frame, applied while stacking the crops
+        std::vector<cv::Point2d> shifts;
+        {
+          ScopedStage stage("pipeline.align");
+          shifts = analysis.shifts(cropped_images);
+        }
+        if (analysis.reused()) {
+          std::cout << "  Shifts taken from the analysis index." << std::endl;
+        }
 
-    // Align images
-    std::cout << "Step 2/3: Aligning images..." << std::endl;
-    std::vector<cv::Mat> aligned_images =
-        ImageAligner::align_images(cropped_images);
+        // Stack images, kept in float until the output format is known
+        std::cout << "Step 3/3: Stacking images..." << std::endl;
+        ScopedStage stage("pipeline.stack");
+        final_image = ImageStacker::stack_shifted(cropped_images, shifts);
+      } else {
+        // Multi-point alignment warps every frame with its own shift field
+        std::vector<cv::Mat> aligned_images;
+        {
+          ScopedStage stage("pipeline.align");
+          aligned_images = ImageAligner::align_images(cropped_images);
+        }
 
-    // Stack images
-    std::cout << "Step 3/3: Stacking images..." << std::endl;
-    cv::Mat final_image = ImageStacker::stack_images(aligned_images);
+        std::cout << "Step 3/3: Stacking images..." << std::endl;
+        ScopedStage stage("pipeline.stack");
+        final_image = ImageStacker::stack_images_float(aligned_images);
+      }
+    } else {
+      // Crops and aligned frames go to the scratch directory, never all
+      // in RAM, and the capture is decoded only once
+      const std::string &scratch = TileStore::scratch_dir;
+      std::cout << "Step 1/3: Cropping frames into " << scratch << "..."
+          << std::endl;
+      ScratchCrops crops;
+      {
+        ScopedStage stage("pipeline.crop");
+        crops = OutOfCoreStacker::crop(analysis, keep_percent, keep_count,
+                                       scratch);
+      }
+      std::cout << "  Cropped " << crops.count << " frames";
+      if (analysis.reused()) {
+        std::cout << " located by " << AnalysisIndex::sidecar_path(video_path);
+      }
+      std::cout << ".\n";
+      source_depth = crops.source_depth;
+
+      std::cout << "Step 2/3: Aligning images..." << std::endl;
+      if (crops.aligned) {
+        std::cout << "  Shifts taken from the analysis index." << std::endl;
+      }
+      const std::unique_ptr<TileStore> store =
+          OutOfCoreStacker::align(crops, analysis, scratch);
+      crops.spool.reset();
+
+      std::cout << "Step 3/3: Stacking " << store->band_count()
+          << " bands..." << std::endl;
+      final_image = OutOfCoreStacker::stack(*store);
+    }
 
     // Save the final image
-    if (!cv::imwrite(output_path.string(), final_image)) {
+    if (!ImageWriter::write(output_path.string(), final_image, source_depth)) {
       std::cerr << "Error saving image to: " << output_path << std::endl;
       return 1;
     }
 
     std::cout << "Successfully saved stacked image to: " << output_path
         << std::endl;
+
+    if (!write_profile(profile_path, trace_path)) {
+      return 1;
+    }
   } catch (const std::exception &e) {
     std::cerr << "Exception: " << e.what() << std::endl;
     return 1;
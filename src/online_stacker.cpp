@@ -0,0 +1,181 @@
+#include "online_stacker.hpp"
+#include <cmath>
+#include <omp.h>
+#include <opencv2/core/mat.hpp>
+#include <stdexcept>
+
+namespace {
+template <typename T>
+void welford_update(const cv::Mat &frame, cv::Mat &mean_acc, cv::Mat &m2_acc,
+                    const float inv_n) {
+  const int rows = frame.rows;
+  const int row_len = frame.cols * frame.channels();
+
+#pragma omp parallel for default(none) schedule(static) \
+  shared(frame, mean_acc, m2_acc, rows, row_len, inv_n)
+  for (int y = 0; y < rows; ++y) {
+    const T *src = frame.ptr<T>(y);
+    float *mean_row = mean_acc.ptr<float>(y);
+    float *m2_row = m2_acc.ptr<float>(y);
+
+    for (int i = 0; i < row_len; ++i) {
+      const auto value = static_cast<float>(src[i]);
+      const float delta = value - mean_row[i];
+      mean_row[i] += delta * inv_n;
+      m2_row[i] += delta * (value - mean_row[i]);
+    }
+  }
+}
+
+template <typename T>
+void accumulate_clipped(const cv::Mat &frame, const cv::Mat &mean_img,
+                        const cv::Mat &threshold_img, cv::Mat &sum_img,
+                        cv::Mat &count_img) {
+  const int rows = frame.rows;
+  const int row_len = frame.cols * frame.channels();
+
+#pragma omp parallel for default(none) schedule(static) \
+  shared(frame, mean_img, threshold_img, sum_img, count_img, rows, row_len)
+  for (int y = 0; y < rows; ++y) {
+    const T *src = frame.ptr<T>(y);
+    const float *mean_row = mean_img.ptr<float>(y);
+    const float *threshold_row = threshold_img.ptr<float>(y);
+    float *sum_row = sum_img.ptr<float>(y);
+    float *count_row = count_img.ptr<float>(y);
+
+    for (int i = 0; i < row_len; ++i) {
+      const auto value = static_cast<float>(src[i]);
+      const float keep =
+          std::abs(value - mean_row[i]) <= threshold_row[i] ? 1.0f : 0.0f;
+      sum_row[i] += keep * value;
+      count_row[i] += keep;
+    }
+  }
+}
+} // namespace
+
+void OnlineStacker::add(const cv::Mat &frame) {
+  if (frame.empty()) {
+    throw std::invalid_argument("Cannot stack an empty frame.");
+  }
+
+  if (frame_count == 0) {
+    input_type = frame.type();
+    mean_acc = cv::Mat::zeros(frame.size(), CV_MAKETYPE(CV_32F, frame.channels()));
+    m2_acc = cv::Mat::zeros(frame.size(), CV_MAKETYPE(CV_32F, frame.channels()));
+  } else if (frame.size() != mean_acc.size() || frame.type() != input_type) {
+    throw std::invalid_argument(
+      "All images must have same dimensions and type.");
+  }
+
+  ++frame_count;
+  const float inv_n = 1.0f / static_cast<float>(frame_count);
+
+  switch (frame.depth()) {
+    case CV_8U:
+      welford_update<uchar>(frame, mean_acc, m2_acc, inv_n);
+      break;
+    case CV_16U:
+      welford_update<ushort>(frame, mean_acc, m2_acc, inv_n);
+      break;
+    case CV_32F:
+      welford_update<float>(frame, mean_acc, m2_acc, inv_n);
+      break;
+    default:
+      --frame_count;
+      throw std::invalid_argument("Unsupported image depth for stacking.");
+  }
+}
+
+cv::Mat OnlineStacker::finalize() const {
+  if (frame_count == 0) {
+    throw std::logic_error("No frames have been added to the stacker.");
+  }
+
+  cv::Mat result;
+  mean_acc.convertTo(result, input_type);
+  return result;
+}
+
+cv::Mat OnlineStacker::finalize_clipped(const FrameSource &source,
+                                        const float kappa) const {
+  if (frame_count == 0) {
+    throw std::logic_error("No frames have been added to the stacker.");
+  }
+
+  const cv::Mat threshold_img = std_dev() * static_cast<double>(kappa);
+  cv::Mat sum_img = cv::Mat::zeros(mean_acc.size(), mean_acc.type());
+  cv::Mat count_img = cv::Mat::zeros(mean_acc.size(), mean_acc.type());
+
+  for (size_t i = 0; i < frame_count; ++i) {
+    const cv::Mat frame = source(i);
+    if (frame.size() != mean_acc.size() || frame.type() != input_type) {
+      throw std::invalid_argument(
+        "Frame source does not match the accumulated frames.");
+    }
+
+    switch (frame.depth()) {
+      case CV_8U:
+        accumulate_clipped<uchar>(frame, mean_acc, threshold_img, sum_img, count_img);
+        break;
+      case CV_16U:
+        accumulate_clipped<ushort>(frame, mean_acc, threshold_img, sum_img, count_img);
+        break;
+      default:
+        accumulate_clipped<float>(frame, mean_acc, threshold_img, sum_img, count_img);
+        break;
+    }
+  }
+
+  // Pixels where every sample was rejected fall back to the mean
+  cv::Mat clipped_mean;
+  cv::divide(sum_img, count_img, clipped_mean);
+  const cv::Mat rejected = count_img == 0;
+  mean_acc.copyTo(clipped_mean, rejected);
+
+  cv::Mat result;
+  clipped_mean.convertTo(result, input_type);
+  return result;
+}
+
+size_t OnlineStacker::count() const { return frame_count; }
+
+cv::Mat OnlineStacker::mean() const { return mean_acc.clone(); }
+
+cv::Mat OnlineStacker::std_dev() const {
+  cv::Mat std_img;
+  if (frame_count == 0) {
+    return std_img;
+  }
+  cv::sqrt(m2_acc / static_cast<double>(frame_count), std_img);
+  return std_img;
+}
+
+cv::Mat OnlineStacker::m2() const { return m2_acc.clone(); }
+
+int OnlineStacker::type() const { return input_type; }
+
+void OnlineStacker::restore(const cv::Mat &mean, const cv::Mat &m2,
+                            const size_t count, const int frame_type) {
+  if (count == 0) {
+    reset();
+    return;
+  }
+  const int acc_type = CV_MAKETYPE(CV_32F, CV_MAT_CN(frame_type));
+  if (mean.type() != acc_type || m2.type() != acc_type ||
+      mean.size() != m2.size()) {
+    throw std::invalid_argument("Accumulator state does not match the frame type.");
+  }
+
+  mean_acc = mean.clone();
+  m2_acc = m2.clone();
+  frame_count = count;
+  input_type = frame_type;
+}
+
+void OnlineStacker::reset() {
+  mean_acc.release();
+  m2_acc.release();
+  frame_count = 0;
+  input_type = -1;
+}
@@ -0,0 +1,98 @@
+#include "out_of_core_stacker.hpp"
+#include "analysis_index.hpp"
+#include "crop_spool.hpp"
+#include "cropped_image.hpp"
+#include "frame_pool.hpp"
+#include "image_aligner.hpp"
+#include "image_stacker.hpp"
+#include "profiler.hpp"
+#include "tile_store.hpp"
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+ScratchCrops OutOfCoreStacker::crop(AnalysisIndex &index,
+                                    const double keep_percent,
+                                    const size_t keep_count,
+                                    const std::string &directory) {
+  ScratchCrops crops;
+  if (ImageAligner::ap_grid == 0 &&
+      index.select_indexed(keep_percent, keep_count)) {
+    const std::vector<cv::Point2d> shifts = index.stored_shifts();
+    if (!shifts.empty()) {
+      // Nothing to estimate, each crop is translated into the store as
+      // soon as it is decoded and none is spooled
+      std::unique_ptr<TileStore> &store = crops.aligned;
+      cv::Mat aligned;
+      index.crop_selected([&](const size_t position, CroppedImage &&cropped) {
+        const cv::Mat &color = cropped.get_color();
+        if (!store) {
+          store = std::make_unique<TileStore>(directory, shifts.size(),
+                                              color.size(), color.type());
+        }
+        ImageAligner::translate(color, shifts[position], aligned);
+        store->write_frame(position, aligned);
+      });
+      crops.count = shifts.size();
+      crops.source_depth = CV_MAT_DEPTH(store->type());
+      return crops;
+    }
+  }
+
+  crops.spool = index.spool_best(keep_percent, keep_count, directory, crops.kept);
+  if (crops.kept.empty()) {
+    throw std::runtime_error("No images were cropped.");
+  }
+
+  // First best crop wins ties, as with max_element
+  for (size_t i = 1; i < crops.kept.size(); ++i) {
+    if (crops.kept[i].score > crops.kept[crops.template_index].score) {
+      crops.template_index = static_cast<int>(i);
+    }
+  }
+
+  crops.count = crops.kept.size();
+  crops.source_depth = CV_MAT_DEPTH(crops.spool->type());
+  return crops;
+}
+
+std::unique_ptr<TileStore> OutOfCoreStacker::align(ScratchCrops &crops,
+                                                   AnalysisIndex &index,
+                                                   const std::string &directory) {
+  if (crops.aligned) {
+    return std::move(crops.aligned);
+  }
+
+  const CropSpool &spool = *crops.spool;
+  const std::vector<CropSpool::Entry> &kept = crops.kept;
+
+  auto store = std::make_unique<TileStore>(directory, kept.size(),
+                                           spool.frame_size(), spool.type());
+  TileStore &tiles = *store;
+  std::vector<cv::Point2d> shifts;
+  std::vector<double> responses;
+  {
+    ScopedStage stage("pipeline.align");
+    ImageAligner::align_images(
+      static_cast<int>(kept.size()), crops.template_index,
+      [&spool, &kept](const int index) {
+        cv::Mat crop;
+        FramePool::attach(crop);
+        spool.read(kept[static_cast<size_t>(index)].slot, crop);
+        return crop;
+      },
+      [&tiles](const int index, cv::Mat &&aligned) {
+        tiles.write_frame(static_cast<size_t>(index), aligned);
+      },
+      &shifts, &responses);
+  }
+  index.store_shifts(shifts, responses);
+  return store;
+}
+
+cv::Mat OutOfCoreStacker::stack(const TileStore &store) {
+  ScopedStage stage("pipeline.stack");
+  return ImageStacker::stack_tiles(store);
+}
@@ -3,14 +3,48 @@
 #include <iostream>
 
 #include "cropped_image.hpp"
+#include "frame_pool.hpp"
+#include "profiler.hpp"
+#include <algorithm>
 #include <opencv2/core/mat.hpp>
 #include <opencv2/imgproc.hpp>
+#include <stdexcept>
+
+int PlanetTracker::detection_size = 512;
+
+namespace {
+// 8-bit luma for thresholding, deeper frames are scaled down so Otsu and
+// the tracking threshold work in one range whatever the capture depth
+void to_grayscale(const cv::Mat &color, cv::Mat &gray) {
+    if (color.channels() == 1) {
+        gray = color;
+    } else if (color.channels() == 4) {
+        cv::cvtColor(color, gray, cv::COLOR_BGRA2GRAY);
+    } else {
+        cv::cvtColor(color, gray, cv::COLOR_BGR2GRAY);
+    }
+    if (gray.depth() != CV_8U) {
+        gray = Image::to_8bit(gray);
+    }
+}
+} // namespace
 
 CroppedImage PlanetDetector::crop(const Image &image, int crop_size) {
     // Detect centroid first
-    auto [x, y] = detect(image);
-    int h = image.get_color().rows;
-    int w = image.get_color().cols;
+    const Centroid centroid = detect(image);
+    return crop_around(image.get_color(), image.get_grayscale(), centroid,
+                       crop_size);
+}
+
+CroppedImage PlanetDetector::crop_around(const cv::Mat &color,
+                                         const cv::Mat &gray,
+                                         const Centroid centroid,
+                                         int crop_size) {
+    ScopedStage stage("crop");
+
+    auto [x, y] = centroid;
+    int h = color.rows;
+    int w = color.cols;
 
     // Adjust crop size to fit within image bounds
     if (int min_dimension = std::min(h, w); crop_size > min_dimension) {
@@ -18,42 +52,99 @@ CroppedImage PlanetDetector::crop(const Image &image, int crop_size) {
     }
     int half_crop = crop_size / 2;
 
-    // Calculate source boundaries
-    int src_x_min = std::max(x - half_crop, 0);
-    int src_x_max = std::min(x + half_crop, w);
-    int src_y_min = std::max(y - half_crop, 0);
-    int src_y_max = std::min(y + half_crop, h);
-
-    // Crop the region of interest
-    cv::Rect crop_rect(src_x_min, src_y_min, src_x_max - src_x_min,
-                       src_y_max - src_y_min);
-
-    // Crop both color and grayscale images using the same rectangle
-    cv::Mat cropped_color = image.get_color()(crop_rect);
-    cv::Mat cropped_gray = image.get_grayscale()(crop_rect);
-
-    // Calculate the padding needed to make it pretty square
-    int top = std::max(0, half_crop - y);
-    int bottom = std::max(0, y + half_crop - h);
-    int left = std::max(0, half_crop - x);
-    int right = std::max(0, x + half_crop - w);
-
-    // Add black padding to both images cv::Mat padded_color, padded_gray;
-    cv::Mat padded_color, padded_gray;
-    cv::copyMakeBorder(cropped_color, padded_color, top, bottom, left, right,
-                       cv::BORDER_CONSTANT, cv::Scalar(0, 0, 0));
-    cv::copyMakeBorder(cropped_gray, padded_gray, top, bottom, left, right,
-                       cv::BORDER_CONSTANT, cv::Scalar(0));
-
-    // Resize both to ensure the output is exactly crop_size x crop_size
-    cv::Mat result_color, result_gray;
-    cv::resize(padded_color, result_color, cv::Size(crop_size, crop_size));
-    cv::resize(padded_gray, result_gray, cv::Size(crop_size, crop_size));
+    // Exactly crop_size x crop_size around the centroid, and the part of it
+    // that lies inside the frame
+    const cv::Rect target(x - half_crop, y - half_crop, crop_size, crop_size);
+    const cv::Rect inside = target & cv::Rect(0, 0, w, h);
+    const cv::Rect dst(inside.x - target.x, inside.y - target.y, inside.width,
+                       inside.height);
+
+    // One copy straight from the frame into pooled crop buffers, no border
+    // pass and no resize. A view into the frame would pin the whole frame
+    // for as long as the crop is kept. Mono crops are their own grayscale
+    // and share one buffer
+    const bool mono = color.channels() == 1;
+    cv::Mat result_color = FramePool::acquire(target.size(), color.type());
+    cv::Mat result_gray =
+        mono ? result_color
+             : FramePool::acquire(target.size(), CV_MAKETYPE(color.depth(), 1));
+
+    // Black padding is only written when the target is near the edge
+    if (inside != target) {
+        result_color.setTo(cv::Scalar::all(0));
+        if (!mono) {
+            result_gray.setTo(cv::Scalar::all(0));
+        }
+    }
+
+    if (!inside.empty()) {
+        cv::Mat color_dst = result_color(dst);
+        color(inside).copyTo(color_dst);
+        if (!mono) {
+            cv::Mat gray_dst = result_gray(dst);
+            if (!gray.empty()) {
+                gray(inside).copyTo(gray_dst);
+            } else {
+                cv::cvtColor(color(inside), gray_dst,
+                             color.channels() == 4 ? cv::COLOR_BGRA2GRAY
+                                                   : cv::COLOR_BGR2GRAY);
+            }
+        }
+    }
+
+    stage.add_bytes(result_color.total() * result_color.elemSize() +
+                    (mono ? 0 : result_gray.total() * result_gray.elemSize()));
 
     return {result_color, result_gray};
 }
 
+CroppedImage PlanetDetector::crop_bayer(const cv::Mat &mosaic,
+                                        const int bayer_code,
+                                        const Centroid centroid,
+                                        int crop_size, const int bit_depth) {
+    if (mosaic.channels() != 1) {
+        throw std::invalid_argument("Bayer mosaic must have one channel.");
+    }
+    if (int min_dimension = std::min(mosaic.rows, mosaic.cols);
+        crop_size > min_dimension) {
+        crop_size = min_dimension;
+    }
+
+    // Two pixels cover the neighbourhood of every demosaic algorithm in
+    // cvtColor, rounding the origin down to even keeps the Bayer phase
+    constexpr int margin = 2;
+    const int half_crop = crop_size / 2;
+    const int x0 = (centroid.x - half_crop - margin) & ~1;
+    const int y0 = (centroid.y - half_crop - margin) & ~1;
+    const cv::Rect padded(x0, y0, crop_size + 2 * margin + 2,
+                          crop_size + 2 * margin + 2);
+    cv::Rect inside = padded & cv::Rect(0, 0, mosaic.cols, mosaic.rows);
+    inside.width &= ~1;
+    inside.height &= ~1;
+    if (inside.width < 2 || inside.height < 2) {
+        throw std::runtime_error("Bayer crop lies outside the frame.");
+    }
+
+    cv::Mat patch;
+    {
+        ScopedStage stage("debayer");
+        cv::cvtColor(mosaic(inside), patch, bayer_code);
+        if (patch.depth() == CV_16U && bit_depth > 8 && bit_depth < 16) {
+            patch.convertTo(patch, -1, static_cast<double>(1 << (16 - bit_depth)));
+        }
+        stage.add_bytes(patch.total() * patch.elemSize());
+    }
+
+    // The padded patch is tiny, crop_around cuts the exact square out of it
+    // and pads whatever fell outside the sensor
+    return crop_around(patch, cv::Mat(),
+                       Centroid{centroid.x - inside.x, centroid.y - inside.y},
+                       crop_size);
+}
+
 Centroid PlanetDetector::detect(const Image &image) {
+    ScopedStage stage("detect");
+
     // Calculate moments of the binary image
     const cv::Moments M = cv::moments(image.get_binary(), true);
 
@@ -67,3 +158,90 @@ Centroid PlanetDetector::detect(const Image &image) {
 
     return Centroid{cx, cy};
 }
+
+PlanetTracker::PlanetTracker(const int crop_size) : crop_size(crop_size) {
+    if (crop_size < 1) {
+        throw std::invalid_argument("Crop size must be positive.");
+    }
+}
+
+Centroid PlanetTracker::locate(const cv::Mat &frame) {
+    if (frame.empty()) {
+        throw std::invalid_argument("Cannot locate a planet in an empty frame.");
+    }
+
+    Centroid centroid{};
+    if (tracking && track(frame, centroid)) {
+        last = centroid;
+        return centroid;
+    }
+
+    // First frame, or the target left the window: search the whole frame
+    last = detect_full(frame);
+    tracking = true;
+    window_area = -1.0;
+    return last;
+}
+
+void PlanetTracker::reset() {
+    tracking = false;
+    window_area = -1.0;
+}
+
+Centroid PlanetTracker::detect_full(const cv::Mat &frame) {
+    ScopedStage stage("detect.full");
+
+    // Downsample so detection cost does not grow with the sensor size
+    const int longest = std::max(frame.cols, frame.rows);
+    const double scale =
+        std::max(1.0, static_cast<double>(longest) / std::max(1, detection_size));
+    const cv::Size small_size(std::max(1, cvRound(frame.cols / scale)),
+                              std::max(1, cvRound(frame.rows / scale)));
+    cv::resize(frame, small, small_size, 0, 0, cv::INTER_AREA);
+    to_grayscale(small, small_gray);
+
+    // A planet on a dark sky is the bright class of a bimodal histogram
+    threshold = cv::threshold(small_gray, mask, 0, 255,
+                              cv::THRESH_BINARY | cv::THRESH_OTSU);
+    const cv::Moments M = cv::moments(mask, true);
+    if (M.m00 == 0) {
+        throw std::runtime_error("No planet detected in the image.");
+    }
+
+    const double scale_x = static_cast<double>(frame.cols) / small_size.width;
+    const double scale_y = static_cast<double>(frame.rows) / small_size.height;
+    return Centroid{static_cast<int>(M.m10 / M.m00 * scale_x),
+                    static_cast<int>(M.m01 / M.m00 * scale_y)};
+}
+
+bool PlanetTracker::track(const cv::Mat &frame, Centroid &centroid) {
+    ScopedStage stage("detect.track");
+
+    // The crop plus a quarter crop of drift on every side
+    const int half = crop_size / 2 + crop_size / 4;
+    const cv::Rect window = cv::Rect(last.x - half, last.y - half, 2 * half,
+                                     2 * half) &
+                            cv::Rect(0, 0, frame.cols, frame.rows);
+    if (window.empty()) {
+        return false;
+    }
+
+    to_grayscale(frame(window), window_gray);
+    cv::threshold(window_gray, mask, threshold, 255, cv::THRESH_BINARY);
+    const cv::Moments M = cv::moments(mask, true);
+    if (M.m00 == 0) {
+        return false;
+    }
+
+    // A sudden change of the bright area means the target left the window
+    // or something else entered it
+    if (window_area < 0.0) {
+        window_area = M.m00;
+    } else if (M.m00 < 0.5 * window_area || M.m00 > 2.0 * window_area) {
+        return false;
+    }
+
+    centroid = Centroid{window.x + static_cast<int>(M.m10 / M.m00),
+                        window.y + static_cast<int>(M.m01 / M.m00)};
+    return true;
+}
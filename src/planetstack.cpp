@@ -0,0 +1,182 @@
+#include "planetstack.h"
+#include "stacking_engine.hpp"
+#include <exception>
+#include <stdexcept>
+#include <opencv2/core/mat.hpp>
+#include <string>
+
+// Exceptions stop at this boundary and become error codes
+struct ps_engine {
+  explicit ps_engine(const EngineOptions &options) : engine(options) {}
+
+  StackingEngine engine;
+  cv::Mat result;
+  std::string error;
+};
+
+namespace {
+ImageStacker::RejectionMode to_rejection_mode(const int mode) {
+  switch (mode) {
+    case PS_REJECT_MEDIAN:
+      return ImageStacker::RejectionMode::ReplaceWithMedian;
+    case PS_REJECT_KAPPA_SIGMA:
+      return ImageStacker::RejectionMode::KappaSigma;
+    case PS_REJECT_WINSORIZED:
+      return ImageStacker::RejectionMode::Winsorized;
+    case PS_REJECT_PERCENTILE:
+      return ImageStacker::RejectionMode::Percentile;
+    case PS_REJECT_MINMAX:
+      return ImageStacker::RejectionMode::MinMax;
+    default:
+      throw std::invalid_argument("Unknown rejection mode.");
+  }
+}
+
+int from_rejection_mode(const ImageStacker::RejectionMode mode) {
+  switch (mode) {
+    case ImageStacker::RejectionMode::KappaSigma:
+      return PS_REJECT_KAPPA_SIGMA;
+    case ImageStacker::RejectionMode::Winsorized:
+      return PS_REJECT_WINSORIZED;
+    case ImageStacker::RejectionMode::Percentile:
+      return PS_REJECT_PERCENTILE;
+    case ImageStacker::RejectionMode::MinMax:
+      return PS_REJECT_MINMAX;
+    default:
+      return PS_REJECT_MEDIAN;
+  }
+}
+
+EngineOptions to_engine_options(const ps_options &options) {
+  EngineOptions converted;
+  converted.crop_size = options.crop_size;
+  converted.frame_skip = options.frame_skip;
+  converted.keep_percent = options.keep_percent;
+  converted.keep_count = options.keep_count;
+  converted.contrast_weight = options.contrast_weight;
+  converted.sharpness_weight = options.sharpness_weight;
+  converted.snr_weight = options.snr_weight;
+  converted.sigma_threshold = options.sigma_threshold;
+  converted.sigma_iterations = options.sigma_iterations;
+  converted.rejection_mode = to_rejection_mode(options.rejection_mode);
+  converted.percentile_low = options.percentile_low;
+  converted.percentile_high = options.percentile_high;
+  converted.ap_grid = options.ap_grid;
+  converted.ap_box_size = options.ap_box_size;
+  converted.pyramid_levels = options.pyramid_levels;
+  converted.pyramid_window = options.pyramid_window;
+  converted.track_target = options.track_target != 0;
+  converted.threads = options.threads;
+  return converted;
+}
+
+// Hand out the engine's copy of the stack, continuous so one stride fits
+int export_result(ps_engine *engine, cv::Mat &&stack, ps_image *result) {
+  engine->result = stack.isContinuous() ? std::move(stack) : stack.clone();
+  result->width = engine->result.cols;
+  result->height = engine->result.rows;
+  result->channels = engine->result.channels();
+  result->stride = engine->result.step;
+  result->data = engine->result.ptr<float>();
+  return 0;
+}
+
+int fail(ps_engine *engine, const char *message) {
+  engine->error = message;
+  return -1;
+}
+} // namespace
+
+void ps_options_init(ps_options *options) {
+  if (!options) {
+    return;
+  }
+  const EngineOptions defaults;
+  options->crop_size = defaults.crop_size;
+  options->frame_skip = defaults.frame_skip;
+  options->keep_percent = defaults.keep_percent;
+  options->keep_count = defaults.keep_count;
+  options->contrast_weight = defaults.contrast_weight;
+  options->sharpness_weight = defaults.sharpness_weight;
+  options->snr_weight = defaults.snr_weight;
+  options->sigma_threshold = defaults.sigma_threshold;
+  options->sigma_iterations = defaults.sigma_iterations;
+  options->rejection_mode = from_rejection_mode(defaults.rejection_mode);
+  options->percentile_low = defaults.percentile_low;
+  options->percentile_high = defaults.percentile_high;
+  options->ap_grid = defaults.ap_grid;
+  options->ap_box_size = defaults.ap_box_size;
+  options->pyramid_levels = defaults.pyramid_levels;
+  options->pyramid_window = defaults.pyramid_window;
+  options->track_target = defaults.track_target ? 1 : 0;
+  options->threads = defaults.threads;
+}
+
+ps_engine *ps_engine_create(const ps_options *options) {
+  if (!options) {
+    return nullptr;
+  }
+  try {
+    return new ps_engine(to_engine_options(*options));
+  } catch (const std::exception &) {
+    return nullptr;
+  }
+}
+
+void ps_engine_destroy(ps_engine *engine) { delete engine; }
+
+int ps_engine_add_frame(ps_engine *engine, const void *data, const int width,
+                        const int height, const int channels,
+                        const int bits_per_sample, const size_t stride) {
+  if (!engine) {
+    return -1;
+  }
+  if (!data || width < 1 || height < 1 || (channels != 1 && channels != 3) ||
+      (bits_per_sample != 8 && bits_per_sample != 16)) {
+    return fail(engine, "Frames must be 8- or 16-bit mono or BGR.");
+  }
+
+  try {
+    const int depth = bits_per_sample == 8 ? CV_8U : CV_16U;
+    // The view never outlives the call, the engine copies what it keeps
+    const cv::Mat frame(height, width, CV_MAKETYPE(depth, channels),
+                        const_cast<void *>(data), stride);
+    engine->engine.add_frame(frame);
+    return 0;
+  } catch (const std::exception &e) {
+    return fail(engine, e.what());
+  }
+}
+
+int ps_engine_stack(ps_engine *engine, ps_image *result) {
+  if (!engine) {
+    return -1;
+  }
+  if (!result) {
+    return fail(engine, "No result image given.");
+  }
+  try {
+    return export_result(engine, engine->engine.stack(), result);
+  } catch (const std::exception &e) {
+    return fail(engine, e.what());
+  }
+}
+
+int ps_engine_stack_capture(ps_engine *engine, const char *path,
+                            ps_image *result) {
+  if (!engine) {
+    return -1;
+  }
+  if (!path || !result) {
+    return fail(engine, "No capture path or result image given.");
+  }
+  try {
+    return export_result(engine, engine->engine.stack_capture(path), result);
+  } catch (const std::exception &e) {
+    return fail(engine, e.what());
+  }
+}
+
+const char *ps_engine_last_error(const ps_engine *engine) {
+  return engine ? engine->error.c_str() : "No engine.";
+}
@@ -0,0 +1,231 @@
+#include "profiler.hpp"
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+namespace {
+struct Event {
+  const char *stage;
+  Profiler::Clock::time_point start;
+  Profiler::Clock::time_point end;
+  double cpu_ms;
+  size_t bytes;
+};
+
+// Each thread appends to its own buffer, the mutex is only contended while
+// a report is being written
+struct ThreadBuffer {
+  int thread_id = 0;
+  std::mutex mutex;
+  std::vector<Event> events;
+};
+
+struct ThreadTotals {
+  size_t calls = 0;
+  double wall_ms = 0.0;
+  double cpu_ms = 0.0;
+};
+
+struct StageTotals {
+  size_t calls = 0;
+  double wall_ms = 0.0;
+  double cpu_ms = 0.0;
+  size_t bytes = 0;
+  Profiler::Clock::time_point first_start = Profiler::Clock::time_point::max();
+  Profiler::Clock::time_point last_end = Profiler::Clock::time_point::min();
+  std::map<int, ThreadTotals> threads;
+};
+
+std::atomic<bool> profiling_enabled{false};
+std::atomic<int> next_thread_id{0};
+std::mutex registry_mutex;
+std::vector<std::shared_ptr<ThreadBuffer> > registry;
+Profiler::Clock::time_point session_start = Profiler::Clock::now();
+
+ThreadBuffer &local_buffer() {
+  thread_local std::shared_ptr<ThreadBuffer> buffer = [] {
+    auto created = std::make_shared<ThreadBuffer>();
+    created->thread_id = next_thread_id++;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.push_back(created);
+    return created;
+  }();
+  return *buffer;
+}
+
+double to_ms(const Profiler::Clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+// Copy of every recorded event paired with the recording thread
+std::vector<std::pair<int, Event> > snapshot() {
+  std::vector<std::pair<int, Event> > events;
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (const auto &buffer: registry) {
+    std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+    for (const auto &event: buffer->events) {
+      events.emplace_back(buffer->thread_id, event);
+    }
+  }
+  return events;
+}
+} // namespace
+
+void Profiler::enable() {
+  reset();
+  profiling_enabled.store(true, std::memory_order_relaxed);
+}
+
+void Profiler::disable() {
+  profiling_enabled.store(false, std::memory_order_relaxed);
+}
+
+bool Profiler::enabled() {
+  return profiling_enabled.load(std::memory_order_relaxed);
+}
+
+void Profiler::reset() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (const auto &buffer: registry) {
+    std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+    buffer->events.clear();
+  }
+  session_start = Clock::now();
+}
+
+void Profiler::record(const char *stage, const Clock::time_point start,
+                      const Clock::time_point end, const double cpu_ms,
+                      const size_t bytes) {
+  ThreadBuffer &buffer = local_buffer();
+  std::lock_guard<std::mutex> lock(buffer.mutex);
+  buffer.events.push_back(Event{stage, start, end, cpu_ms, bytes});
+}
+
+bool Profiler::write_summary(const std::string &path) {
+  std::map<std::string, StageTotals> stages;
+  for (const auto &[thread_id, event]: snapshot()) {
+    StageTotals &totals = stages[event.stage];
+    const double wall_ms = to_ms(event.end - event.start);
+    ++totals.calls;
+    totals.wall_ms += wall_ms;
+    totals.cpu_ms += event.cpu_ms;
+    totals.bytes += event.bytes;
+    totals.first_start = std::min(totals.first_start, event.start);
+    totals.last_end = std::max(totals.last_end, event.end);
+
+    ThreadTotals &thread = totals.threads[thread_id];
+    ++thread.calls;
+    thread.wall_ms += wall_ms;
+    thread.cpu_ms += event.cpu_ms;
+  }
+
+  std::ofstream out(path);
+  if (!out) {
+    return false;
+  }
+
+  out << "{\n  \"session_ms\": " << to_ms(Clock::now() - session_start)
+      << ",\n  \"peak_rss_bytes\": " << peak_rss_bytes()
+      << ",\n  \"stages\": [\n";
+
+  size_t stage_index = 0;
+  for (const auto &[name, totals]: stages) {
+    // Span from the first start to the last end, so parallel stages report
+    // throughput rather than summed busy time
+    const double span_ms = to_ms(totals.last_end - totals.first_start);
+    const double per_sec = span_ms > 0.0 ? totals.calls * 1000.0 / span_ms : 0.0;
+
+    out << "    {\"name\": \"" << name << "\", \"calls\": " << totals.calls
+        << ", \"wall_ms\": " << totals.wall_ms << ", \"cpu_ms\": "
+        << totals.cpu_ms << ", \"span_ms\": " << span_ms
+        << ", \"calls_per_sec\": " << per_sec << ", \"bytes\": "
+        << totals.bytes << ",\n     \"threads\": [";
+
+    size_t thread_index = 0;
+    for (const auto &[thread_id, thread]: totals.threads) {
+      out << (thread_index++ > 0 ? ", " : "") << "{\"thread\": " << thread_id
+          << ", \"calls\": " << thread.calls << ", \"wall_ms\": "
+          << thread.wall_ms << ", \"cpu_ms\": " << thread.cpu_ms << "}";
+    }
+    out << "]}" << (++stage_index < stages.size() ? "," : "") << "\n";
+  }
+
+  out << "  ]\n}\n";
+  return static_cast<bool>(out);
+}
+
+bool Profiler::write_trace(const std::string &path) {
+  std::ofstream out(path);
+  if (!out) {
+    return false;
+  }
+
+  const auto events = snapshot();
+  out << "{\"traceEvents\": [\n";
+  for (size_t i = 0; i < events.size(); ++i) {
+    const auto &[thread_id, event] = events[i];
+    const auto ts_us =
+        std::chrono::duration<double, std::micro>(event.start - session_start).count();
+    const auto dur_us =
+        std::chrono::duration<double, std::micro>(event.end - event.start).count();
+    out << "  {\"name\": \"" << event.stage << "\", \"ph\": \"X\", \"pid\": 1"
+        << ", \"tid\": " << thread_id << ", \"ts\": " << ts_us
+        << ", \"dur\": " << dur_us << ", \"args\": {\"cpu_ms\": "
+        << event.cpu_ms << ", \"bytes\": " << event.bytes << "}}"
+        << (i + 1 < events.size() ? "," : "") << "\n";
+  }
+  out << "]}\n";
+  return static_cast<bool>(out);
+}
+
+double Profiler::thread_cpu_ms() {
+#if defined(__unix__) || defined(__APPLE__)
+  timespec ts{};
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1.0e6;
+  }
+#endif
+  return 0.0;
+}
+
+size_t Profiler::peak_rss_bytes() {
+#if defined(__unix__) || defined(__APPLE__)
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    // Linux reports kilobytes
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+  }
+#endif
+  return 0;
+}
+
+ScopedStage::ScopedStage(const char *stage)
+  : stage(stage), active(Profiler::enabled()) {
+  if (active) {
+    cpu_start_ms = Profiler::thread_cpu_ms();
+    start = Profiler::Clock::now();
+  }
+}
+
+ScopedStage::~ScopedStage() {
+  if (active) {
+    Profiler::record(stage, start, Profiler::Clock::now(),
+                     Profiler::thread_cpu_ms() - cpu_start_ms, bytes);
+  }
+}
+
+void ScopedStage::add_bytes(const size_t count) { bytes += count; }
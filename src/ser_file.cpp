@@ -0,0 +1,340 @@
+#include "ser_file.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/core/mat.hpp>
+#include <opencv2/imgproc.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+constexpr size_t header_size = 178;
+constexpr char file_id[] = "LUCAM-RECORDER";
+constexpr size_t file_id_size = 14;
+
+// Header offsets of the int32 fields following the file id
+constexpr size_t color_id_offset = 18;
+constexpr size_t endian_offset = 22;
+constexpr size_t width_offset = 26;
+constexpr size_t height_offset = 30;
+constexpr size_t depth_offset = 34;
+constexpr size_t frame_count_offset = 38;
+
+int32_t read_le32(const uchar *p) {
+  return static_cast<int32_t>(static_cast<uint32_t>(p[0]) |
+                              static_cast<uint32_t>(p[1]) << 8 |
+                              static_cast<uint32_t>(p[2]) << 16 |
+                              static_cast<uint32_t>(p[3]) << 24);
+}
+
+uint64_t read_le64(const uchar *p) {
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; --i) {
+    value = value << 8 | p[i];
+  }
+  return value;
+}
+
+void write_le32(std::ofstream &out, const int32_t value) {
+  const auto bits = static_cast<uint32_t>(value);
+  const char bytes[4] = {
+    static_cast<char>(bits & 0xff), static_cast<char>(bits >> 8 & 0xff),
+    static_cast<char>(bits >> 16 & 0xff), static_cast<char>(bits >> 24 & 0xff)
+  };
+  out.write(bytes, 4);
+}
+
+void write_le64(std::ofstream &out, const uint64_t value) {
+  char bytes[8];
+  for (int i = 0; i < 8; ++i) {
+    bytes[i] = static_cast<char>(value >> (8 * i) & 0xff);
+  }
+  out.write(bytes, 8);
+}
+
+bool host_is_little_endian() {
+  const uint16_t probe = 1;
+  uchar first;
+  std::memcpy(&first, &probe, 1);
+  return first == 1;
+}
+
+int planes_for(const SerColor color) {
+  return color == SerColor::RGB || color == SerColor::BGR ? 3 : 1;
+}
+
+bool valid_color(const int color_id) {
+  switch (static_cast<SerColor>(color_id)) {
+    case SerColor::Mono:
+    case SerColor::BayerRGGB:
+    case SerColor::BayerGRBG:
+    case SerColor::BayerGBRG:
+    case SerColor::BayerBGGR:
+    case SerColor::RGB:
+    case SerColor::BGR:
+      return true;
+  }
+  return false;
+}
+} // namespace
+
+SerReader::SerReader(const std::string &path) {
+  map_file(path);
+  parse_header(path);
+}
+
+SerReader::~SerReader() {
+#if defined(__unix__) || defined(__APPLE__)
+  if (mapped && data) {
+    munmap(const_cast<uchar *>(data), file_size);
+  }
+#endif
+}
+
+bool SerReader::is_ser_file(const std::string &path) {
+  std::string extension = std::filesystem::path(path).extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return extension == ".ser";
+}
+
+void SerReader::map_file(const std::string &path) {
+#if defined(__unix__) || defined(__APPLE__)
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Could not open SER file: " + path);
+  }
+  struct stat info{};
+  if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+    ::close(fd);
+    throw std::runtime_error("Could not read SER file size: " + path);
+  }
+  file_size = static_cast<size_t>(info.st_size);
+
+  // Private writable mapping: pages are shared with the page cache until
+  // someone writes into a frame view, which then only touches a copy
+  void *mapping = mmap(nullptr, file_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    throw std::runtime_error("Could not map SER file: " + path);
+  }
+  data = static_cast<const uchar *>(mapping);
+  mapped = true;
+#else
+  // No mmap: read the file once, frame views point into the buffer
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  if (!in) {
+    throw std::runtime_error("Could not open SER file: " + path);
+  }
+  file_size = static_cast<size_t>(in.tellg());
+  fallback_buffer.resize(file_size);
+  in.seekg(0);
+  in.read(reinterpret_cast<char *>(fallback_buffer.data()),
+          static_cast<std::streamsize>(file_size));
+  data = fallback_buffer.data();
+#endif
+}
+
+void SerReader::parse_header(const std::string &path) {
+  if (file_size < header_size ||
+      std::memcmp(data, file_id, file_id_size) != 0) {
+    throw std::runtime_error("Not a SER file: " + path);
+  }
+
+  const int color_value = read_le32(data + color_id_offset);
+  width = read_le32(data + width_offset);
+  height = read_le32(data + height_offset);
+  depth = read_le32(data + depth_offset);
+  frames = read_le32(data + frame_count_offset);
+
+  if (!valid_color(color_value)) {
+    throw std::runtime_error("Unsupported SER color layout in: " + path);
+  }
+  if (width <= 0 || height <= 0 || depth < 1 || depth > 16 || frames < 0) {
+    throw std::runtime_error("Corrupt SER header in: " + path);
+  }
+  color_id = static_cast<SerColor>(color_value);
+
+  const int bytes_per_sample = depth > 8 ? 2 : 1;
+  const int planes = planes_for(color_id);
+  frame_bytes = static_cast<size_t>(width) * height * planes * bytes_per_sample;
+  raw_type = CV_MAKETYPE(bytes_per_sample == 2 ? CV_16U : CV_8U, planes);
+
+  // Captures cut short keep the header count, trust the file size instead.
+  // A capture still being written has no count yet, take every whole frame
+  const size_t available = (file_size - header_size) / frame_bytes;
+  frames = frames == 0 ? static_cast<int>(available)
+                       : static_cast<int>(std::min(available, static_cast<size_t>(frames)));
+
+  // Capture software writes 0 for little-endian 16-bit data, the opposite
+  // of what the format description says. Follow the software
+  const bool file_little_endian = read_le32(data + endian_offset) == 0;
+  swap_bytes = bytes_per_sample == 2 && file_little_endian != host_is_little_endian();
+}
+
+int SerReader::frame_count() const { return frames; }
+
+cv::Size SerReader::frame_size() const { return {width, height}; }
+
+int SerReader::bit_depth() const { return depth; }
+
+SerColor SerReader::color() const { return color_id; }
+
+bool SerReader::is_bayer() const {
+  return color_id == SerColor::BayerRGGB || color_id == SerColor::BayerGRBG ||
+         color_id == SerColor::BayerGBRG || color_id == SerColor::BayerBGGR;
+}
+
+cv::Mat SerReader::raw_frame(const int index) const {
+  if (index < 0 || index >= frames) {
+    throw std::out_of_range("SER frame index out of range.");
+  }
+
+  const uchar *frame_data = data + header_size + frame_bytes * index;
+  const cv::Mat view(height, width, raw_type, const_cast<uchar *>(frame_data));
+  if (!swap_bytes) {
+    return view;
+  }
+
+  cv::Mat swapped(height, width, raw_type);
+  const auto *src = reinterpret_cast<const uint16_t *>(frame_data);
+  auto *dst = swapped.ptr<uint16_t>();
+  const size_t samples = frame_bytes / 2;
+  for (size_t i = 0; i < samples; ++i) {
+    dst[i] = static_cast<uint16_t>(src[i] << 8 | src[i] >> 8);
+  }
+  return swapped;
+}
+
+cv::Mat SerReader::frame(const int index) const {
+  const cv::Mat raw = raw_frame(index);
+  if (is_bayer()) {
+    cv::Mat bgr;
+    cv::cvtColor(raw, bgr, bayer_to_bgr_code(color_id));
+    return bgr;
+  }
+  if (color_id == SerColor::RGB) {
+    cv::Mat bgr;
+    cv::cvtColor(raw, bgr, cv::COLOR_RGB2BGR);
+    return bgr;
+  }
+  return raw;
+}
+
+bool SerReader::has_timestamps() const {
+  return file_size >= header_size + frame_bytes * frames + sizeof(uint64_t) * frames &&
+         frames > 0;
+}
+
+uint64_t SerReader::timestamp(const int index) const {
+  if (!has_timestamps() || index < 0 || index >= frames) {
+    throw std::out_of_range("SER timestamp not available.");
+  }
+  return read_le64(data + header_size + frame_bytes * frames +
+                   sizeof(uint64_t) * index);
+}
+
+// OpenCV names Bayer layouts after the second row, so RGGB is "BG"
+int SerReader::bayer_to_bgr_code(const SerColor color) {
+  switch (color) {
+    case SerColor::BayerRGGB:
+      return cv::COLOR_BayerBG2BGR;
+    case SerColor::BayerGRBG:
+      return cv::COLOR_BayerGB2BGR;
+    case SerColor::BayerGBRG:
+      return cv::COLOR_BayerGR2BGR;
+    case SerColor::BayerBGGR:
+      return cv::COLOR_BayerRG2BGR;
+    default:
+      throw std::invalid_argument("Not a Bayer layout.");
+  }
+}
+
+SerWriter::SerWriter(const std::string &path, const cv::Size size,
+                     const SerColor color, const int bit_depth)
+  : out(path, std::ios::binary), size(size), color(color),
+    bit_depth(bit_depth) {
+  if (!out) {
+    throw std::runtime_error("Could not create SER file: " + path);
+  }
+  if (bit_depth < 1 || bit_depth > 16) {
+    throw std::invalid_argument("SER bit depth must be in [1, 16].");
+  }
+
+  // Placeholder header, rewritten with the frame count on close
+  const std::vector<char> header(header_size, 0);
+  out.write(header.data(), static_cast<std::streamsize>(header.size()));
+}
+
+SerWriter::~SerWriter() {
+  try {
+    close();
+  } catch (...) {
+    // Destructors must not throw, call close() to see errors
+  }
+}
+
+void SerWriter::add(const cv::Mat &frame, const uint64_t timestamp) {
+  const int expected_type = CV_MAKETYPE(bit_depth > 8 ? CV_16U : CV_8U,
+                                        planes_for(color));
+  if (frame.size() != size || frame.type() != expected_type) {
+    throw std::invalid_argument("Frame does not match the SER geometry.");
+  }
+
+  // Samples are written little-endian whatever the host order
+  for (int y = 0; y < frame.rows; ++y) {
+    if (frame.depth() == CV_8U || host_is_little_endian()) {
+      out.write(reinterpret_cast<const char *>(frame.ptr(y)),
+                static_cast<std::streamsize>(frame.cols * frame.elemSize()));
+    } else {
+      const auto *row = frame.ptr<uint16_t>(y);
+      for (int i = 0; i < frame.cols * frame.channels(); ++i) {
+        const char bytes[2] = {static_cast<char>(row[i] & 0xff),
+                               static_cast<char>(row[i] >> 8)};
+        out.write(bytes, 2);
+      }
+    }
+  }
+  timestamps.push_back(timestamp);
+  ++frames;
+}
+
+void SerWriter::close() {
+  if (!out.is_open()) {
+    return;
+  }
+
+  for (const uint64_t timestamp: timestamps) {
+    write_le64(out, timestamp);
+  }
+
+  out.seekp(0);
+  out.write(file_id, file_id_size);
+  write_le32(out, 0); // LuID
+  write_le32(out, static_cast<int32_t>(color));
+  write_le32(out, 0); // little-endian, as capture software writes it
+  write_le32(out, size.width);
+  write_le32(out, size.height);
+  write_le32(out, bit_depth);
+  write_le32(out, frames);
+  const std::vector<char> text(120, 0); // observer, instrument, telescope
+  out.write(text.data(), static_cast<std::streamsize>(text.size()));
+  write_le64(out, 0); // DateTime
+  write_le64(out, 0); // DateTime_UTC
+
+  out.close();
+  if (!out) {
+    throw std::runtime_error("Could not finish writing SER file.");
+  }
+}
@@ -0,0 +1,157 @@
+#include "stacking_engine.hpp"
+#include "frame_selector.hpp"
+#include "image.hpp"
+#include "image_aligner.hpp"
+#include "profiler.hpp"
+#include "video_processor.hpp"
+#include <omp.h>
+#include <stdexcept>
+#include <utility>
+
+namespace {
+// OpenMP thread count of the calling thread for one call, other threads
+// keep their own
+class ThreadCount {
+public:
+  explicit ThreadCount(const int threads) : previous(omp_get_max_threads()) {
+    if (threads > 0) {
+      omp_set_num_threads(threads);
+    }
+  }
+
+  ~ThreadCount() { omp_set_num_threads(previous); }
+
+  ThreadCount(const ThreadCount &) = delete;
+  ThreadCount &operator=(const ThreadCount &) = delete;
+
+private:
+  int previous;
+};
+} // namespace
+
+StackingEngine::StackingEngine(EngineOptions options)
+  : settings(std::move(options)),
+    capture_settings{settings.track_target,
+                     {settings.contrast_weight, settings.sharpness_weight,
+                      settings.snr_weight}},
+    aligner_settings{settings.ap_grid, settings.ap_box_size,
+                     settings.pyramid_levels, settings.pyramid_window},
+    stacker_settings{settings.sigma_threshold, settings.sigma_iterations,
+                     settings.rejection_mode, settings.percentile_low,
+                     settings.percentile_high},
+    tracker(settings.crop_size) {
+  if (settings.crop_size < 1 || settings.frame_skip < 1) {
+    throw std::invalid_argument("Crop size and frame skip must be positive.");
+  }
+  if (settings.keep_percent < 0.0 || settings.keep_percent > 100.0) {
+    throw std::invalid_argument("Keep percent must be in [0, 100].");
+  }
+  if (settings.keep_percent > 0.0 && settings.keep_count > 0) {
+    throw std::invalid_argument("Use either keep_percent or keep_count, not both.");
+  }
+  if (!(settings.percentile_low >= 0.0f &&
+        settings.percentile_low <= settings.percentile_high &&
+        settings.percentile_high <= 1.0f)) {
+    throw std::invalid_argument("Percentiles must satisfy 0 <= low <= high <= 1.");
+  }
+  if (settings.ap_grid < 0 || settings.pyramid_levels < 0) {
+    throw std::invalid_argument("Alignment grid and pyramid levels must not be negative.");
+  }
+  if (settings.threads < 0) {
+    throw std::invalid_argument("Thread count must not be negative.");
+  }
+}
+
+const EngineOptions &StackingEngine::options() const { return settings; }
+
+void StackingEngine::add_frame(const cv::Mat &frame) {
+  const ThreadCount threads(settings.threads);
+  CroppedImage cropped = [&]() {
+    if (capture_settings.track_target) {
+      const Centroid centroid = tracker.locate(frame);
+      return PlanetDetector::crop_around(frame, cv::Mat(), centroid,
+                                         settings.crop_size);
+    }
+    // Detected from scratch in every frame, like an untracked capture
+    const Image image(frame);
+    return PlanetDetector::crop_around(image.get_color(), image.get_grayscale(),
+                                       PlanetDetector::detect(image),
+                                       settings.crop_size);
+  }();
+  cropped.reweigh(capture_settings.weights);
+  crops.push_back(std::move(cropped));
+}
+
+size_t StackingEngine::frame_count() const { return crops.size(); }
+
+cv::Mat StackingEngine::stack() {
+  const ThreadCount threads(settings.threads);
+
+  size_t keep = settings.keep_count;
+  if (keep == 0 && settings.keep_percent > 0.0) {
+    keep = FrameSelector::capacity_for_percent(crops.size(), settings.keep_percent);
+  }
+  if (keep > 0 && keep < crops.size()) {
+    crops = FrameSelector::select(std::move(crops), keep);
+  }
+  return stack_crops();
+}
+
+cv::Mat StackingEngine::stack_capture(const std::string &path) {
+  const ThreadCount threads(settings.threads);
+  reset();
+
+  // The selection happens while decoding, only kept frames are cropped
+  {
+    ScopedStage stage("pipeline.crop");
+    crops = VideoProcessor::processBestFrames(
+      path, settings.crop_size, settings.frame_skip, settings.keep_percent,
+      settings.keep_count, capture_settings);
+  }
+  return stack_crops();
+}
+
+void StackingEngine::reset() {
+  crops.clear();
+  aligned.clear();
+  tracker.reset();
+}
+
+cv::Mat StackingEngine::stack_crops() {
+  if (crops.empty()) {
+    throw std::runtime_error("No frames to stack.");
+  }
+
+  cv::Mat result;
+  if (settings.ap_grid == 0) {
+    // Global shifts are applied while the crops are stacked
+    std::vector<cv::Point2d> shifts;
+    {
+      ScopedStage stage("pipeline.align");
+      shifts = ImageAligner::compute_shifts(crops, nullptr, aligner_settings);
+    }
+    ScopedStage stage("pipeline.stack");
+    result = ImageStacker::stack_shifted(crops, shifts, stacker_settings);
+  } else {
+    // Aligned frames land in slots that keep their capacity across runs,
+    // their pixels go back to the FramePool when the run is done
+    aligned.resize(crops.size());
+    {
+      ScopedStage stage("pipeline.align");
+      ImageAligner::align_images(
+        crops,
+        [this](const int index, cv::Mat &&frame) {
+          aligned[index] = std::move(frame);
+        },
+        aligner_settings);
+    }
+    crops.clear();
+
+    ScopedStage stage("pipeline.stack");
+    result = ImageStacker::stack_images_float(aligned, stacker_settings);
+  }
+  crops.clear();
+  aligned.clear();
+  tracker.reset();
+  return result;
+}
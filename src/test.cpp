@@ -1,12 +1,39 @@
+#include "analysis_index.hpp"
+#include "batch_scheduler.hpp"
+#include "crop_spool.hpp"
 #include "cropped_image.hpp"
+#include "frame_selector.hpp"
 #include "image.hpp"
 #include "image_aligner.hpp"
 #include "image_stacker.hpp"
+#include "image_writer.hpp"
+#include "frame_pool.hpp"
+#include "live_stacker.hpp"
+#include "online_stacker.hpp"
+#include "out_of_core_stacker.hpp"
 #include "planet_detector.hpp"
+#include "planetstack.h"
+#include "profiler.hpp"
+#include "ser_file.hpp"
+#include "stacking_engine.hpp"
+#include "tile_store.hpp"
+#include "video_processor.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <future>
+#include <iterator>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <opencv2/opencv.hpp>
+#include <regex>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace fs = std::filesystem;
@@ -68,6 +95,1551 @@ bool process_image_set(const std::string &input_dir,
   return true;
 }
 
+bool test_frame_selection(const std::string &input_dir) {
+  std::cout << "Checking frame selection: " << input_dir << std::endl;
+
+  std::vector<CroppedImage> cropped_images;
+  std::vector<double> scores;
+  try {
+    for (int i = 1; i <= 10; ++i) {
+      Image img(input_dir + std::to_string(i) + ".png");
+      cropped_images.push_back(PlanetDetector::crop(img, 480));
+      scores.push_back(cropped_images.back().get_quality_score());
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "  Error loading frames: " << e.what() << std::endl;
+    return false;
+  }
+
+  // Expected frames are the 3 best scores, reported back in frame order
+  std::vector<size_t> order(scores.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&scores](size_t a, size_t b) { return scores[a] > scores[b]; });
+  order.resize(3);
+  std::sort(order.begin(), order.end());
+
+  const std::vector<CroppedImage> selected =
+      FrameSelector::select(std::move(cropped_images), 3);
+  if (selected.size() != order.size()) {
+    std::cerr << "  Expected 3 frames, got " << selected.size() << std::endl;
+    return false;
+  }
+  for (size_t i = 0; i < selected.size(); ++i) {
+    if (selected[i].get_quality_score() != scores[order[i]]) {
+      std::cerr << "  Frame " << i << " is not among the best 3" << std::endl;
+      return false;
+    }
+  }
+
+  std::cout << "  Selection kept the best 3 of 10 frames" << std::endl;
+  return true;
+}
+
+bool test_online_stacker() {
+  std::cout << "Checking online stacker against a two-pass reference"
+      << std::endl;
+
+  // Bright frames with small noise are where sum_sq / n - mean^2 breaks down
+  std::vector<cv::Mat> frames(50);
+  cv::RNG rng(42);
+  for (auto &frame: frames) {
+    frame.create(64, 64, CV_32FC3);
+    rng.fill(frame, cv::RNG::NORMAL, cv::Scalar::all(4000.0),
+             cv::Scalar::all(2.0));
+  }
+
+  OnlineStacker stacker;
+  for (const auto &frame: frames) {
+    stacker.add(frame);
+  }
+
+  cv::Mat mean_ref = cv::Mat::zeros(frames[0].size(), CV_64FC3);
+  for (const auto &frame: frames) {
+    cv::Mat frame_64;
+    frame.convertTo(frame_64, CV_64F);
+    mean_ref += frame_64;
+  }
+  mean_ref /= static_cast<double>(frames.size());
+
+  cv::Mat var_ref = cv::Mat::zeros(frames[0].size(), CV_64FC3);
+  for (const auto &frame: frames) {
+    cv::Mat diff;
+    frame.convertTo(diff, CV_64F);
+    diff -= mean_ref;
+    var_ref += diff.mul(diff);
+  }
+  cv::Mat std_ref;
+  cv::sqrt(var_ref / static_cast<double>(frames.size()), std_ref);
+
+  cv::Mat mean_64, std_64;
+  stacker.mean().convertTo(mean_64, CV_64F);
+  stacker.std_dev().convertTo(std_64, CV_64F);
+  const double mean_err = cv::norm(mean_64, mean_ref, cv::NORM_INF);
+  const double std_err = cv::norm(std_64, std_ref, cv::NORM_INF);
+  if (mean_err > 1e-2 || std_err > 1e-2) {
+    std::cerr << "  Mean error " << mean_err << ", std error " << std_err
+        << std::endl;
+    return false;
+  }
+
+  // With a huge kappa nothing is clipped, so the clipped mean is the mean
+  const cv::Mat clipped = stacker.finalize_clipped(
+    [&frames](size_t index) { return frames[index]; }, 1e6f);
+  if (cv::norm(clipped, stacker.finalize(), cv::NORM_INF) > 1e-3) {
+    std::cerr << "  Clipped mean differs from plain mean" << std::endl;
+    return false;
+  }
+
+  std::cout << "  Welford mean/std match within " << std::max(mean_err, std_err)
+      << std::endl;
+  return true;
+}
+
+bool test_median_kernel() {
+  std::cout << "Checking tiled median against nth_element" << std::endl;
+
+  // Sizes cover every sorting network, odd/even counts and introselect
+  const std::vector<int> frame_counts = {1, 2, 3, 5, 8, 13, 16, 31, 32, 33, 100};
+  cv::RNG rng(7);
+
+  for (const int count: frame_counts) {
+    std::vector<cv::Mat> frames(count);
+    for (auto &frame: frames) {
+      frame.create(37, 29, CV_32FC3);
+      rng.fill(frame, cv::RNG::UNIFORM, cv::Scalar::all(0.0),
+               cv::Scalar::all(255.0));
+    }
+
+    const cv::Mat median = ImageStacker::compute_median(frames);
+    const int row_len = frames[0].cols * frames[0].channels();
+    for (int y = 0; y < frames[0].rows; ++y) {
+      for (int x = 0; x < row_len; ++x) {
+        std::vector<float> values;
+        for (const auto &frame: frames) {
+          values.push_back(frame.ptr<float>(y)[x]);
+        }
+        std::sort(values.begin(), values.end());
+        const size_t mid = values.size() / 2;
+        const float expected = values.size() % 2 == 0
+                                 ? (values[mid - 1] + values[mid]) * 0.5f
+                                 : values[mid];
+        if (median.ptr<float>(y)[x] != expected) {
+          std::cerr << "  Median mismatch for " << count << " frames at ("
+              << x << ", " << y << ")" << std::endl;
+          return false;
+        }
+      }
+    }
+  }
+
+  std::cout << "  Median matches for " << frame_counts.size()
+      << " frame counts" << std::endl;
+  return true;
+}
+
+bool test_sigma_rejection() {
+  std::cout << "Checking sigma rejection modes against a hot outlier frame"
+      << std::endl;
+
+  // 19 quiet frames around 100 and one frame of 10000
+  std::vector<cv::Mat> frames(20);
+  cv::RNG rng(11);
+  for (auto &frame: frames) {
+    frame.create(33, 45, CV_32FC3);
+    rng.fill(frame, cv::RNG::UNIFORM, cv::Scalar::all(99.0),
+             cv::Scalar::all(101.0));
+  }
+  frames[0].setTo(cv::Scalar::all(10000.0));
+
+  const auto saved_mode = ImageStacker::rejection_mode;
+  const int saved_iterations = ImageStacker::sigma_iterations;
+  bool ok = true;
+
+  const std::vector<std::pair<ImageStacker::RejectionMode, std::string> > modes = {
+    {ImageStacker::RejectionMode::ReplaceWithMedian, "median replacement"},
+    {ImageStacker::RejectionMode::KappaSigma, "kappa-sigma"},
+  };
+  for (const auto &[mode, name]: modes) {
+    for (const int iterations: {1, 3}) {
+      ImageStacker::rejection_mode = mode;
+      ImageStacker::sigma_iterations = iterations;
+      const cv::Mat stacked = ImageStacker::stack_images(frames);
+      double min_val, max_val;
+      cv::minMaxLoc(stacked.reshape(1), &min_val, &max_val);
+      if (min_val < 99.0 || max_val > 101.0) {
+        std::cerr << "  " << name << " with " << iterations
+            << " iterations kept the outlier: [" << min_val << ", "
+            << max_val << "]" << std::endl;
+        ok = false;
+      }
+    }
+  }
+
+  // Winsorizing only clamps, but it must still pull below the plain mean
+  ImageStacker::rejection_mode = ImageStacker::RejectionMode::Winsorized;
+  ImageStacker::sigma_iterations = 3;
+  const cv::Mat winsorized = ImageStacker::stack_images(frames);
+  double max_val;
+  cv::minMaxLoc(winsorized.reshape(1), nullptr, &max_val);
+  if (max_val >= 595.0) {
+    std::cerr << "  Winsorized mean did not clamp the outlier: " << max_val
+        << std::endl;
+    ok = false;
+  }
+
+  ImageStacker::rejection_mode = saved_mode;
+  ImageStacker::sigma_iterations = saved_iterations;
+
+  if (ok) {
+    std::cout << "  All rejection modes suppressed the outlier" << std::endl;
+  }
+  return ok;
+}
+
+// Mean of the sorted samples lo..hi of every pixel, the slow way
+cv::Mat brute_force_rank_mean(const std::vector<cv::Mat> &frames,
+                              const size_t lo, const size_t hi) {
+  std::vector<cv::Mat> widened(frames.size());
+  for (size_t i = 0; i < frames.size(); ++i) {
+    frames[i].convertTo(widened[i], CV_32F);
+    widened[i] = widened[i].reshape(1);
+  }
+
+  cv::Mat result(widened[0].size(), CV_32F);
+  std::vector<double> samples(frames.size());
+  for (int y = 0; y < result.rows; ++y) {
+    for (int x = 0; x < result.cols; ++x) {
+      for (size_t i = 0; i < frames.size(); ++i) {
+        samples[i] = widened[i].at<float>(y, x);
+      }
+      std::sort(samples.begin(), samples.end());
+      double sum = 0.0;
+      for (size_t r = lo; r <= hi; ++r) {
+        sum += samples[r];
+      }
+      result.at<float>(y, x) = static_cast<float>(sum / static_cast<double>(hi - lo + 1));
+    }
+  }
+  return result.reshape(frames[0].channels());
+}
+
+bool test_rank_rejection() {
+  std::cout << "Checking histogram medians and rank rejection against sorting"
+      << std::endl;
+
+  // Enough frames that integer medians take the counting path, narrow value
+  // ranges so that ties and shared radix buckets are common
+  cv::RNG rng(23);
+  std::vector<cv::Mat> frames_8u(50), frames_16u(101), frames_32f(12);
+  for (auto &frame: frames_8u) {
+    frame.create(9, 100, CV_8UC3);
+    rng.fill(frame, cv::RNG::UNIFORM, cv::Scalar::all(90), cv::Scalar::all(140));
+  }
+  for (auto &frame: frames_16u) {
+    frame.create(7, 100, CV_16UC1);
+    rng.fill(frame, cv::RNG::UNIFORM, cv::Scalar::all(1000), cv::Scalar::all(1300));
+  }
+  frames_16u[3].setTo(cv::Scalar::all(65535));
+  frames_16u[4].setTo(cv::Scalar::all(1200));
+  frames_16u[5].setTo(cv::Scalar::all(1200));
+  for (auto &frame: frames_32f) {
+    frame.create(5, 30, CV_32FC3);
+    rng.fill(frame, cv::RNG::UNIFORM, cv::Scalar::all(0.0), cv::Scalar::all(1.0));
+  }
+
+  const auto saved_mode = ImageStacker::rejection_mode;
+  const float saved_low = ImageStacker::percentile_low;
+  const float saved_high = ImageStacker::percentile_high;
+  bool ok = true;
+
+  const auto check = [&ok](const std::string &name, const cv::Mat &actual,
+                           const cv::Mat &expected) {
+    const double error = cv::norm(actual, expected, cv::NORM_INF);
+    if (error > 0.01) {
+      std::cerr << "  " << name << " differs from sorting by " << error
+          << std::endl;
+      ok = false;
+    }
+  };
+
+  const std::vector<std::pair<const std::vector<cv::Mat> *, std::string> > sets = {
+    {&frames_8u, "8-bit"}, {&frames_16u, "16-bit"}, {&frames_32f, "float"}
+  };
+  for (const auto &[frames, name]: sets) {
+    const size_t n = frames->size();
+    check(name + " median", ImageStacker::compute_median(*frames),
+          brute_force_rank_mean(*frames, (n - 1) / 2, n / 2));
+
+    ImageStacker::rejection_mode = ImageStacker::RejectionMode::MinMax;
+    check(name + " min/max rejection", ImageStacker::stack_images_float(*frames),
+          brute_force_rank_mean(*frames, 1, n - 2));
+
+    // 0.2 and 0.8 land exactly on ranks for 101 frames
+    ImageStacker::rejection_mode = ImageStacker::RejectionMode::Percentile;
+    ImageStacker::percentile_low = 0.2f;
+    ImageStacker::percentile_high = 0.8f;
+    const auto last = static_cast<double>(n - 1);
+    check(name + " percentile rejection", ImageStacker::stack_images_float(*frames),
+          brute_force_rank_mean(*frames,
+                                static_cast<size_t>(std::ceil(0.2 * last - 1e-6)),
+                                static_cast<size_t>(std::floor(0.8 * last + 1e-6))));
+  }
+
+  ImageStacker::rejection_mode = saved_mode;
+  ImageStacker::percentile_low = saved_low;
+  ImageStacker::percentile_high = saved_high;
+
+  if (ok) {
+    std::cout << "  Counted and selected ranks match a full sort" << std::endl;
+  }
+  return ok;
+}
+
+bool test_alignment_shift() {
+  std::cout << "Checking alignment of a frame shifted by a known offset"
+      << std::endl;
+
+  cv::Mat color, gray;
+  try {
+    const CroppedImage base = PlanetDetector::crop(
+      Image("../test/input/jupiter_sample_frames/1.png"), 480);
+    color = base.get_color();
+    gray = base.get_grayscale();
+  } catch (const std::exception &e) {
+    std::cerr << "  Error loading frame: " << e.what() << std::endl;
+    return false;
+  }
+
+  // Shift a copy by a fixed offset, alignment must bring both together
+  const cv::Mat translation = (cv::Mat_<double>(2, 3) << 1, 0, 7, 0, 1, -4);
+  cv::Mat shifted_color, shifted_gray;
+  cv::warpAffine(color, shifted_color, translation, color.size());
+  cv::warpAffine(gray, shifted_gray, translation, gray.size());
+
+  // Full-resolution correlation and the coarse-to-fine pyramid must agree
+  const int saved_levels = ImageAligner::pyramid_levels;
+  const int saved_window = ImageAligner::pyramid_window;
+  ImageAligner::pyramid_window = 128;
+  bool ok = true;
+
+  for (const int levels: {0, 2}) {
+    ImageAligner::pyramid_levels = levels;
+    std::vector<CroppedImage> images = {
+      CroppedImage(color, gray), CroppedImage(shifted_color, shifted_gray)
+    };
+    const std::vector<cv::Mat> aligned = ImageAligner::align_images(images);
+
+    // Compare away from the border, which the shift filled with black
+    const cv::Rect interior(40, 40, color.cols - 80, color.rows - 80);
+    const double error = cv::norm(aligned[0](interior), aligned[1](interior),
+                                  cv::NORM_L1) /
+                         static_cast<double>(interior.area() * color.channels());
+    if (error > 2.0) {
+      std::cerr << "  Mean absolute difference after alignment with "
+          << levels << " pyramid levels: " << error << std::endl;
+      ok = false;
+    } else {
+      std::cout << "  Aligned frames with " << levels
+          << " pyramid levels differ by " << error << " per sample"
+          << std::endl;
+    }
+  }
+
+  ImageAligner::pyramid_levels = saved_levels;
+  ImageAligner::pyramid_window = saved_window;
+  return ok;
+}
+
+bool test_multi_point_alignment() {
+  std::cout << "Checking multi-point alignment on a non-rigid distortion"
+      << std::endl;
+
+  cv::Mat color, gray;
+  try {
+    const CroppedImage base = PlanetDetector::crop(
+      Image("../test/input/jupiter_sample_frames/1.png"), 480);
+    color = base.get_color();
+    gray = base.get_grayscale();
+  } catch (const std::exception &e) {
+    std::cerr << "  Error loading frame: " << e.what() << std::endl;
+    return false;
+  }
+
+  // Horizontal shift varying smoothly from -3 px on the left to +3 px on
+  // the right, which no single translation can undo
+  cv::Mat map(color.size(), CV_32FC2);
+  for (int y = 0; y < map.rows; ++y) {
+    for (int x = 0; x < map.cols; ++x) {
+      const float dx = 6.0f * static_cast<float>(x) / map.cols - 3.0f;
+      map.at<cv::Vec2f>(y, x) = cv::Vec2f(x - dx, static_cast<float>(y));
+    }
+  }
+  cv::Mat warped_color, warped_gray;
+  cv::remap(color, warped_color, map, cv::noArray(), cv::INTER_LINEAR);
+  cv::remap(gray, warped_gray, map, cv::noArray(), cv::INTER_LINEAR);
+
+  // Displacement left between the aligned frames, measured by phase
+  // correlation on boxes with enough signal, as an RMS in pixels
+  const cv::Rect interior(40, 40, color.cols - 80, color.rows - 80);
+  constexpr int box = 64;
+  cv::Mat window;
+  cv::createHanningWindow(window, cv::Size(box, box), CV_32F);
+  const auto residual = [&](int grid) {
+    const int saved_grid = ImageAligner::ap_grid;
+    ImageAligner::ap_grid = grid;
+    std::vector<CroppedImage> images = {
+      CroppedImage(color, gray), CroppedImage(warped_color, warped_gray)
+    };
+    const std::vector<cv::Mat> aligned = ImageAligner::align_images(images);
+    ImageAligner::ap_grid = saved_grid;
+
+    cv::Mat reference, moved;
+    cv::cvtColor(aligned[0], reference, cv::COLOR_BGR2GRAY);
+    cv::cvtColor(aligned[1], moved, cv::COLOR_BGR2GRAY);
+    reference.convertTo(reference, CV_32F);
+    moved.convertTo(moved, CV_32F);
+
+    double sum_sq = 0.0;
+    int boxes = 0;
+    for (int y = interior.y; y + box <= interior.br().y; y += box) {
+      for (int x = interior.x; x + box <= interior.br().x; x += box) {
+        const cv::Rect r(x, y, box, box);
+        cv::Scalar mean, stddev;
+        cv::meanStdDev(reference(r), mean, stddev);
+        if (stddev[0] < 8.0) {
+          continue;
+        }
+        const cv::Point2d shift = cv::phaseCorrelate(reference(r), moved(r), window);
+        sum_sq += shift.dot(shift);
+        ++boxes;
+      }
+    }
+    return boxes > 0 ? std::sqrt(sum_sq / boxes)
+                     : std::numeric_limits<double>::infinity();
+  };
+
+  const double global_rms = residual(0);
+  const double local_rms = residual(6);
+  if (local_rms >= 0.5 || local_rms > global_rms) {
+    std::cerr << "  Multi-point residual " << local_rms
+        << " px RMS (global " << global_rms << " px), expected under 0.5 px"
+        << std::endl;
+    return false;
+  }
+
+  std::cout << "  Residual " << global_rms << " px RMS (global) -> "
+      << local_rms << " px RMS (6x6 alignment points)" << std::endl;
+  return true;
+}
+
+bool test_quality_metrics() {
+  std::cout << "Checking fused quality metrics against OpenCV" << std::endl;
+
+  for (int i = 1; i <= 3; ++i) {
+    const std::string filename =
+        "../test/input/saturn_sample_frames/" + std::to_string(i) + ".png";
+    CroppedImage cropped = [&filename] {
+      return PlanetDetector::crop(Image(filename), 480);
+    }();
+    const cv::Mat gray = cropped.get_grayscale();
+
+    cv::Scalar mean, stddev;
+    cv::meanStdDev(gray, mean, stddev);
+    cv::Mat laplacian;
+    cv::Laplacian(gray, laplacian, CV_64F);
+    cv::Scalar lap_mean, lap_stddev;
+    cv::meanStdDev(laplacian, lap_mean, lap_stddev);
+
+    const auto close = [](double a, double b) {
+      return std::abs(a - b) <= 1e-6 * std::max(1.0, std::abs(b));
+    };
+    if (!close(cropped.get_contrast(), stddev[0]) ||
+        !close(cropped.get_sharpness(), lap_stddev[0]) ||
+        !close(cropped.get_snr(), mean[0] / (stddev[0] + 1e-8f))) {
+      std::cerr << "  Metrics differ for " << filename << ": contrast "
+          << cropped.get_contrast() << " vs " << stddev[0] << ", sharpness "
+          << cropped.get_sharpness() << " vs " << lap_stddev[0] << std::endl;
+      return false;
+    }
+  }
+
+  std::cout << "  Contrast, sharpness and SNR match the reference"
+      << std::endl;
+  return true;
+}
+
+bool test_planet_tracker() {
+  std::cout << "Checking planet tracking across drifting frames" << std::endl;
+
+  cv::Mat frame;
+  try {
+    frame = Image("../test/input/jupiter_sample_frames/1.png").get_color();
+  } catch (const std::exception &e) {
+    std::cerr << "  Error loading frame: " << e.what() << std::endl;
+    return false;
+  }
+
+  // Drift the frame a few pixels per step, the tracked centroid must follow
+  PlanetTracker tracker(360);
+  Centroid first{};
+  for (int k = 0; k < 5; ++k) {
+    const cv::Mat translation =
+        (cv::Mat_<double>(2, 3) << 1, 0, 3 * k, 0, 1, -2 * k);
+    cv::Mat drifted;
+    cv::warpAffine(frame, drifted, translation, frame.size());
+
+    Centroid centroid{};
+    try {
+      centroid = tracker.locate(drifted);
+    } catch (const std::exception &e) {
+      std::cerr << "  Tracking failed at step " << k << ": " << e.what()
+          << std::endl;
+      return false;
+    }
+    if (k == 0) {
+      first = centroid;
+      continue;
+    }
+
+    const int dx = centroid.x - first.x;
+    const int dy = centroid.y - first.y;
+    if (std::abs(dx - 3 * k) > 1 || std::abs(dy + 2 * k) > 1) {
+      std::cerr << "  Step " << k << " moved (" << dx << ", " << dy
+          << "), expected (" << 3 * k << ", " << -2 * k << ")" << std::endl;
+      return false;
+    }
+  }
+
+  std::cout << "  Tracked centroid followed the drift" << std::endl;
+  return true;
+}
+
+bool test_frame_pool() {
+  std::cout << "Checking frame pool reuse and edge crops" << std::endl;
+
+  // A released buffer is handed to the next Mat of the same geometry
+  cv::Mat first = FramePool::acquire(cv::Size(64, 48), CV_8UC3);
+  const uchar *first_data = first.data;
+  first.release();
+  const cv::Mat second = FramePool::acquire(cv::Size(64, 48), CV_8UC3);
+  if (second.data != first_data) {
+    std::cerr << "  Released buffer was not reused" << std::endl;
+    return false;
+  }
+
+  // Released on a worker that is still running, the buffer must come back
+  // to the thread that allocated it instead of idling in the worker's cache
+  cv::Mat produced = FramePool::acquire(cv::Size(80, 60), CV_16UC1);
+  const uchar *produced_data = produced.data;
+  std::promise<void> released;
+  std::promise<void> reacquired;
+  std::thread worker([&produced, &released, &reacquired] {
+    produced.release();
+    released.set_value();
+    reacquired.get_future().wait();
+  });
+  released.get_future().wait();
+  const cv::Mat again = FramePool::acquire(cv::Size(80, 60), CV_16UC1);
+  reacquired.set_value();
+  worker.join();
+  if (again.data != produced_data) {
+    std::cerr << "  Buffer released on another thread was not reused"
+        << std::endl;
+    return false;
+  }
+
+  // Near the corner the crop is padded with black, elsewhere it is a copy
+  const cv::Mat frame(100, 100, CV_8UC3, cv::Scalar::all(200));
+  const CroppedImage corner =
+      PlanetDetector::crop_around(frame, cv::Mat(), Centroid{5, 5}, 40);
+  const cv::Mat color = corner.get_color();
+  const cv::Mat gray = corner.get_grayscale();
+  if (color.size() != cv::Size(40, 40) || gray.size() != cv::Size(40, 40)) {
+    std::cerr << "  Edge crop has the wrong size" << std::endl;
+    return false;
+  }
+  if (color.at<cv::Vec3b>(0, 0) != cv::Vec3b(0, 0, 0) ||
+      color.at<cv::Vec3b>(39, 39) != cv::Vec3b(200, 200, 200) ||
+      gray.at<uchar>(0, 0) != 0 || gray.at<uchar>(39, 39) != 200) {
+    std::cerr << "  Edge crop padding is wrong" << std::endl;
+    return false;
+  }
+
+  std::cout << "  Buffers are recycled and edge crops are padded" << std::endl;
+  return true;
+}
+
+bool test_ser_round_trip() {
+  std::cout << "Checking SER write and memory-mapped read" << std::endl;
+
+  const std::string path =
+      (fs::temp_directory_path() / "planetary_stacker_test.ser").string();
+
+  // 12-bit mono capture stored in 16-bit samples, with timestamps
+  std::vector<cv::Mat> frames;
+  {
+    SerWriter writer(path, cv::Size(33, 17), SerColor::Mono, 12);
+    for (int i = 0; i < 3; ++i) {
+      cv::Mat frame(17, 33, CV_16UC1);
+      cv::randu(frame, cv::Scalar(0), cv::Scalar(4096));
+      writer.add(frame, 1000 + i);
+      frames.push_back(frame);
+    }
+  }
+
+  {
+    const SerReader reader(path);
+    if (reader.frame_count() != 3 || reader.frame_size() != cv::Size(33, 17) ||
+        reader.bit_depth() != 12 || reader.color() != SerColor::Mono ||
+        !reader.has_timestamps()) {
+      std::cerr << "  SER header was not read back" << std::endl;
+      return false;
+    }
+    for (int i = 0; i < 3; ++i) {
+      if (cv::norm(reader.raw_frame(i), frames[i], cv::NORM_INF) != 0.0 ||
+          reader.timestamp(i) != static_cast<uint64_t>(1000 + i)) {
+        std::cerr << "  SER frame " << i << " differs" << std::endl;
+        return false;
+      }
+    }
+  }
+
+  // Bayer mosaics come back demosaiced to BGR
+  {
+    SerWriter writer(path, cv::Size(16, 16), SerColor::BayerRGGB, 8);
+    writer.add(cv::Mat(16, 16, CV_8UC1, cv::Scalar(128)));
+  }
+  const SerReader bayer(path);
+  if (!bayer.is_bayer() || bayer.frame(0).type() != CV_8UC3) {
+    std::cerr << "  Bayer SER frame was not demosaiced" << std::endl;
+    return false;
+  }
+
+  fs::remove(path);
+  std::cout << "  Frames and timestamps survive the round trip" << std::endl;
+  return true;
+}
+
+bool test_bayer_crop() {
+  std::cout << "Checking crop-before-debayer against a full demosaic" << std::endl;
+
+  // Smooth colour gradients sampled through an RGGB pattern
+  cv::Mat mosaic(120, 160, CV_8UC1);
+  for (int y = 0; y < mosaic.rows; ++y) {
+    for (int x = 0; x < mosaic.cols; ++x) {
+      const bool red = y % 2 == 0 && x % 2 == 0;
+      const bool blue = y % 2 == 1 && x % 2 == 1;
+      mosaic.at<uchar>(y, x) = static_cast<uchar>(red ? x : blue ? y + 40 : x + y / 2);
+    }
+  }
+
+  const int code = SerReader::bayer_to_bgr_code(SerColor::BayerRGGB);
+  cv::Mat full;
+  cv::cvtColor(mosaic, full, code);
+
+  // Odd centroids exercise the phase alignment, the second one the edge
+  for (const Centroid centroid: {Centroid{71, 53}, Centroid{3, 60}}) {
+    const CroppedImage expected =
+        PlanetDetector::crop_around(full, cv::Mat(), centroid, 48);
+    const CroppedImage cropped =
+        PlanetDetector::crop_bayer(mosaic, code, centroid, 48);
+    // The outermost sensor rows and columns differ by the demosaic border
+    const cv::Rect interior = centroid.x < 24 ? cv::Rect(24, 0, 24, 48)
+                                              : cv::Rect(0, 0, 48, 48);
+    if (cropped.get_color().size() != cv::Size(48, 48) ||
+        cv::norm(cropped.get_color()(interior), expected.get_color()(interior),
+                 cv::NORM_INF) > 0.0) {
+      std::cerr << "  Bayer crop differs from the full demosaic" << std::endl;
+      return false;
+    }
+  }
+
+  std::cout << "  Crop-then-demosaic matches demosaic-then-crop" << std::endl;
+  return true;
+}
+
+bool test_high_bit_depth_stack() {
+  std::cout << "Checking 16-bit stacking and FITS output" << std::endl;
+
+  // Values far above the 8-bit range with a little noise
+  std::vector<cv::Mat> frames;
+  for (int i = 0; i < 9; ++i) {
+    cv::Mat frame(24, 32, CV_16UC3, cv::Scalar(40000, 30000, 20000));
+    cv::Mat noise(frame.size(), CV_16SC3);
+    cv::randu(noise, cv::Scalar::all(-50), cv::Scalar::all(51));
+    cv::add(frame, noise, frame, cv::noArray(), CV_16U);
+    frames.push_back(frame);
+  }
+
+  const cv::Mat stacked = ImageStacker::stack_images(frames);
+  const cv::Mat stacked_float = ImageStacker::stack_images_float(frames);
+  if (stacked.type() != CV_16UC3 || stacked_float.type() != CV_32FC3) {
+    std::cerr << "  Stack lost the 16-bit input type" << std::endl;
+    return false;
+  }
+  const cv::Scalar mean = cv::mean(stacked_float);
+  if (std::abs(mean[0] - 40000.0) > 50.0 || std::abs(mean[2] - 20000.0) > 50.0) {
+    std::cerr << "  16-bit stack values are wrong" << std::endl;
+    return false;
+  }
+
+  // A FITS file is whole 2880-byte blocks starting with the SIMPLE card
+  const std::string path =
+      (fs::temp_directory_path() / "planetary_stacker_test.fits").string();
+  if (!ImageWriter::write(path, stacked_float, CV_16U)) {
+    std::cerr << "  FITS file could not be written" << std::endl;
+    return false;
+  }
+  std::ifstream in(path, std::ios::binary);
+  std::string card(80, ' ');
+  in.read(card.data(), 80);
+  const auto size = fs::file_size(path);
+  fs::remove(path);
+  if (card.rfind("SIMPLE  =                    T", 0) != 0 || size % 2880 != 0 ||
+      size < 2880 + 24 * 32 * 3 * sizeof(float)) {
+    std::cerr << "  FITS file layout is wrong" << std::endl;
+    return false;
+  }
+
+  std::cout << "  16-bit frames stack without truncation" << std::endl;
+  return true;
+}
+
+bool test_batch_scheduler() {
+  std::cout << "Checking batch scheduling of several captures" << std::endl;
+
+  const fs::path dir = fs::temp_directory_path() / "planetary_stacker_batch";
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+
+  // Two short synthetic captures of a drifting disc, and one broken file
+  for (const std::string name: {"a.ser", "b.ser"}) {
+    SerWriter writer((dir / name).string(), cv::Size(96, 80), SerColor::BGR, 8);
+    for (int i = 0; i < 6; ++i) {
+      cv::Mat frame(80, 96, CV_8UC3, cv::Scalar::all(5));
+      cv::circle(frame, cv::Point(45 + i % 3, 38 + i % 2), 14,
+                 cv::Scalar(180, 200, 220), cv::FILLED);
+      writer.add(frame);
+    }
+  }
+  std::ofstream(dir / "c.ser") << "not a capture";
+
+  BatchOptions options;
+  options.crop_size = 48;
+  size_t reported = 0;
+  const std::vector<JobStatus> statuses =
+      BatchScheduler(options).run(BatchScheduler::collect_inputs(dir.string()),
+                                  [&reported](const JobStatus &) { ++reported; });
+
+  // A keep percent outside [0, 100] is refused up front
+  bool rejected = false;
+  try {
+    options.keep_percent = 150.0;
+    BatchScheduler scheduler(options);
+  } catch (const std::invalid_argument &) {
+    rejected = true;
+  }
+
+  const bool ok = statuses.size() == 3 && reported == 3 && statuses[0].ok &&
+                  statuses[1].ok && !statuses[2].ok &&
+                  !statuses[2].error.empty() && rejected &&
+                  fs::exists(statuses[0].output) && fs::exists(statuses[1].output);
+  fs::remove_all(dir);
+  if (!ok) {
+    std::cerr << "  Batch statuses or outputs are wrong" << std::endl;
+    return false;
+  }
+
+  std::cout << "  Good captures are stacked, the broken one is reported" << std::endl;
+  return true;
+}
+
+bool test_out_of_core_stack() {
+  std::cout << "Checking out-of-core stacking against the in-memory stack" << std::endl;
+
+  std::vector<cv::Mat> frames(12);
+  for (auto &frame: frames) {
+    frame.create(37, 29, CV_16UC3);
+    cv::randu(frame, cv::Scalar::all(0), cv::Scalar::all(65535));
+  }
+
+  // A tiny band budget forces several bands, the last one partial
+  const size_t saved_budget = TileStore::max_band_bytes;
+  TileStore::max_band_bytes = 29 * 3 * sizeof(ushort) * frames.size() * 5;
+  TileStore store(fs::temp_directory_path().string(), frames.size(),
+                  frames[0].size(), frames[0].type());
+  TileStore::max_band_bytes = saved_budget;
+  for (size_t i = 0; i < frames.size(); ++i) {
+    store.write_frame(i, frames[i]);
+  }
+
+  const cv::Mat expected = ImageStacker::stack_images_float(frames);
+  const cv::Mat streamed = ImageStacker::stack_tiles(store);
+  if (store.band_count() != 8 || streamed.size() != expected.size() ||
+      cv::norm(streamed, expected, cv::NORM_INF) > 1e-3) {
+    std::cerr << "  Out-of-core stack differs from the in-memory stack" << std::endl;
+    return false;
+  }
+
+  std::cout << "  Band-by-band stacking matches, " << store.band_count()
+      << " bands" << std::endl;
+  return true;
+}
+
+bool test_scratch_pipeline() {
+  std::cout << "Checking the spooled --scratch pipeline against the in-memory one"
+      << std::endl;
+
+  // Crops of rising contrast, the spool must keep the best two and reuse
+  // the slots of evicted ones
+  std::vector<CroppedImage> crops;
+  for (int i = 0; i < 8; ++i) {
+    cv::Mat color(24, 32, CV_8UC3, cv::Scalar::all(10));
+    cv::circle(color, cv::Point(16, 12), 8, cv::Scalar::all(40 + 25 * (i % 5)),
+               cv::FILLED);
+    cv::Mat gray;
+    cv::cvtColor(color, gray, cv::COLOR_BGR2GRAY);
+    crops.emplace_back(color, gray);
+  }
+  const std::string scratch = fs::temp_directory_path().string();
+  bool ok = true;
+  {
+    CropSpool spool(scratch, 2);
+    for (int i = 0; i < static_cast<int>(crops.size()); ++i) {
+      spool.offer(i, crops[i]);
+    }
+    std::vector<CroppedImage> expected =
+        FrameSelector::select(std::vector<CroppedImage>(crops), 2);
+    const std::vector<CropSpool::Entry> kept = spool.kept();
+    ok = kept.size() == 2 && spool.offered() == crops.size();
+    for (size_t i = 0; ok && i < kept.size(); ++i) {
+      cv::Mat crop;
+      spool.read(kept[i].slot, crop);
+      ok = kept[i].slot < 3 &&
+           cv::norm(crop, expected[i].get_color(), cv::NORM_INF) == 0.0;
+    }
+  }
+  if (!ok) {
+    std::cerr << "  Spool kept the wrong crops or lost their pixels" << std::endl;
+    return false;
+  }
+
+  const std::string path =
+      (fs::temp_directory_path() / "planetary_stacker_scratch.ser").string();
+  {
+    SerWriter writer(path, cv::Size(96, 80), SerColor::BGR, 8);
+    for (int i = 0; i < 12; ++i) {
+      cv::Mat frame(80, 96, CV_8UC3, cv::Scalar::all(5));
+      cv::circle(frame, cv::Point(42 + i % 5, 36 + i % 3), 12 + i % 4,
+                 cv::Scalar(170, 190, 210), cv::FILLED);
+      cv::circle(frame, cv::Point(40 + i % 5, 34 + i % 3), 3,
+                 cv::Scalar(60, 70, 80), cv::FILLED);
+      writer.add(frame);
+    }
+  }
+
+  std::vector<CroppedImage> selected =
+      VideoProcessor::processBestFrames(path, 48, 1, 0.0, 5);
+  const cv::Mat expected =
+      ImageStacker::stack_images_float(ImageAligner::align_images(selected));
+
+  // Without a sidecar the capture is analysed and spooled in one pass
+  const bool indexing = AnalysisIndex::enabled;
+  AnalysisIndex::enabled = false;
+  AnalysisIndex index(path, 48, 1);
+  ScratchCrops spooled = OutOfCoreStacker::crop(index, 0.0, 5, scratch);
+  const std::unique_ptr<TileStore> store =
+      OutOfCoreStacker::align(spooled, index, scratch);
+  const cv::Mat streamed = OutOfCoreStacker::stack(*store);
+  AnalysisIndex::enabled = indexing;
+  fs::remove(path);
+
+  if (spooled.kept.size() != selected.size() || streamed.size() != expected.size() ||
+      cv::norm(streamed, expected, cv::NORM_INF) > 1e-3) {
+    std::cerr << "  Spooled stack differs from the in-memory stack" << std::endl;
+    return false;
+  }
+
+  std::cout << "  Spool keeps the best crops and the stacks match" << std::endl;
+  return true;
+}
+
+bool test_segmented_decoding() {
+  std::cout << "Checking segment-parallel decoding against one decoder" << std::endl;
+
+  const std::string path =
+      (fs::temp_directory_path() / "planetary_stacker_segments.ser").string();
+  {
+    SerWriter writer(path, cv::Size(96, 80), SerColor::BGR, 8);
+    for (int i = 0; i < 41; ++i) {
+      cv::Mat frame(80, 96, CV_8UC3, cv::Scalar::all(5));
+      cv::circle(frame, cv::Point(40 + i % 7, 36 + i % 5), 12 + i % 3,
+                 cv::Scalar(170, 190, 210), cv::FILLED);
+      writer.add(frame);
+    }
+  }
+
+  const int saved_segments = VideoProcessor::decode_segments;
+  const int saved_min = VideoProcessor::min_segment_frames;
+  VideoProcessor::min_segment_frames = 1;
+
+  VideoProcessor::decode_segments = 1;
+  const std::vector<CroppedImage> sequential = VideoProcessor::processVideo(path, 48, 2);
+  VideoProcessor::decode_segments = 4;
+  const std::vector<CroppedImage> segmented = VideoProcessor::processVideo(path, 48, 2);
+
+  VideoProcessor::decode_segments = saved_segments;
+  VideoProcessor::min_segment_frames = saved_min;
+  fs::remove(path);
+
+  // Segments re-detect on their first frame, the tracker converges to the
+  // same centroid on this clean target, so the crops must be identical
+  bool same = sequential.size() == 21 && segmented.size() == sequential.size();
+  for (size_t i = 0; same && i < sequential.size(); ++i) {
+    same = cv::norm(sequential[i].get_color(), segmented[i].get_color(),
+                    cv::NORM_INF) == 0.0;
+  }
+  if (!same) {
+    std::cerr << "  Segmented decoding changed frames or their order" << std::endl;
+    return false;
+  }
+
+  std::cout << "  Four segments deliver the same frames in frame order" << std::endl;
+  return true;
+}
+
+bool test_segmented_video_decoding() {
+  std::cout << "Checking segment-parallel decoding of a seeked video" << std::endl;
+
+  // Motion JPEG frames decode on their own, so the frame a segment seeks
+  // to decodes exactly as in a sequential read. The brightness tells the
+  // frames apart once the disc is cropped to the center
+  const std::string path =
+      (fs::temp_directory_path() / "planetary_stacker_segments.avi").string();
+  {
+    cv::VideoWriter writer(path, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'),
+                           25.0, cv::Size(96, 80));
+    if (!writer.isOpened()) {
+      std::cerr << "  Could not write test video: " << path << std::endl;
+      return false;
+    }
+    for (int i = 0; i < 81; ++i) {
+      cv::Mat frame(80, 96, CV_8UC3, cv::Scalar::all(5));
+      cv::circle(frame, cv::Point(40 + i % 7, 36 + i % 5), 14,
+                 cv::Scalar::all(90 + 2 * i), cv::FILLED);
+      writer.write(frame);
+    }
+  }
+
+  const int saved_segments = VideoProcessor::decode_segments;
+  const int saved_min = VideoProcessor::min_segment_frames;
+  VideoProcessor::min_segment_frames = 1;
+
+  VideoProcessor::decode_segments = 1;
+  const std::vector<CroppedImage> sequential = VideoProcessor::processVideo(path, 48, 2);
+  VideoProcessor::decode_segments = 4;
+  const std::vector<CroppedImage> segmented = VideoProcessor::processVideo(path, 48, 2);
+
+  VideoProcessor::decode_segments = saved_segments;
+  VideoProcessor::min_segment_frames = saved_min;
+  fs::remove(path);
+
+  bool same = sequential.size() == 41 && segmented.size() == sequential.size();
+  for (size_t i = 0; same && i < sequential.size(); ++i) {
+    same = cv::norm(sequential[i].get_color(), segmented[i].get_color(),
+                    cv::NORM_INF) == 0.0;
+  }
+  if (!same) {
+    std::cerr << "  Seeked segments changed frames or their order" << std::endl;
+    return false;
+  }
+
+  std::cout << "  Seeked segments deliver the same frames in frame order"
+      << std::endl;
+  return true;
+}
+
+bool test_live_stacking() {
+  std::cout << "Checking live stacking and resuming from a checkpoint" << std::endl;
+
+  const fs::path dir = fs::temp_directory_path() / "planetary_stacker_live";
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const auto write_capture = [&dir](const std::string &name, const int frames) {
+    SerWriter writer((dir / name).string(), cv::Size(96, 80), SerColor::BGR, 8);
+    for (int i = 0; i < frames; ++i) {
+      cv::Mat frame(80, 96, CV_8UC3, cv::Scalar::all(5));
+      cv::circle(frame, cv::Point(40 + i % 7, 36 + i % 5), 14,
+                 cv::Scalar(170, 190, 210), cv::FILLED);
+      writer.add(frame);
+    }
+  };
+
+  const int saved_reference = LiveStacker::reference_frames;
+  const int saved_preview = LiveStacker::preview_interval;
+  const int saved_checkpoint = LiveStacker::checkpoint_interval;
+  LiveStacker::reference_frames = 4;
+  LiveStacker::preview_interval = 0;
+  LiveStacker::checkpoint_interval = 5;
+
+  const std::string preview = (dir / "output" / "live.png").string();
+  const std::string checkpoint = (dir / "output" / "live.checkpoint").string();
+  fs::create_directories(dir / "output");
+
+  bool ok = true;
+  write_capture("a.ser", 12);
+  cv::Mat first_stack;
+  {
+    LiveStacker stacker(48, preview, checkpoint);
+    ok = stacker.poll(dir.string()) == 12;
+    stacker.finish();
+    ok = ok && stacker.frame_count() == 12 && fs::exists(preview);
+    first_stack = stacker.stack().clone();
+  }
+
+  // A second run picks up the same stack and only adds the new capture
+  LiveStacker resumed(48, preview, checkpoint);
+  ok = ok && resumed.resume() && resumed.frame_count() == 12 &&
+       cv::norm(resumed.stack(), first_stack, cv::NORM_INF) == 0.0 &&
+       resumed.poll(dir.string()) == 0;
+  write_capture("b.ser", 6);
+  ok = ok && resumed.poll(dir.string()) == 6 && resumed.frame_count() == 18;
+
+  // Every frame was shifted onto the reference disc, so its centre stays
+  // the disc's colour instead of smearing into the background
+  const cv::Vec3f centre = resumed.stack().at<cv::Vec3f>(24, 24);
+  ok = ok && std::abs(centre[0] - 170.0f) < 2.0f && std::abs(centre[2] - 210.0f) < 2.0f;
+
+  // A blank frame is reported and skipped, the frames after it still count
+  resumed.finish();
+  {
+    SerWriter writer((dir / "c.ser").string(), cv::Size(96, 80), SerColor::BGR, 8);
+    for (int i = 0; i < 3; ++i) {
+      cv::Mat frame(80, 96, CV_8UC3, cv::Scalar::all(0));
+      if (i != 1) {
+        cv::circle(frame, cv::Point(42, 38), 14, cv::Scalar(170, 190, 210),
+                   cv::FILLED);
+      }
+      writer.add(frame);
+    }
+  }
+  std::vector<size_t> skipped;
+  LiveStacker cloudy(48, preview, checkpoint, {},
+                     [&skipped](const std::string &, const size_t frame) {
+                       skipped.push_back(frame);
+                     });
+  ok = ok && cloudy.resume() && cloudy.poll(dir.string()) == 3 &&
+       cloudy.frame_count() == 20 && skipped == std::vector<size_t>{1};
+
+  LiveStacker::reference_frames = saved_reference;
+  LiveStacker::preview_interval = saved_preview;
+  LiveStacker::checkpoint_interval = saved_checkpoint;
+  fs::remove_all(dir);
+
+  if (!ok) {
+    std::cerr << "  Live stack lost, repeated or misaligned frames" << std::endl;
+    return false;
+  }
+  std::cout << "  Resumed stack matches and only new frames were added" << std::endl;
+  return true;
+}
+
+bool test_mono_pipeline() {
+  std::cout << "Checking that mono captures stay single-channel" << std::endl;
+
+  const std::string path =
+      (fs::temp_directory_path() / "planetary_stacker_mono.ser").string();
+  {
+    SerWriter writer(path, cv::Size(96, 80), SerColor::Mono, 8);
+    for (int i = 0; i < 6; ++i) {
+      cv::Mat frame(80, 96, CV_8UC1, cv::Scalar(5));
+      cv::circle(frame, cv::Point(40 + i, 36), 14, cv::Scalar(200), cv::FILLED);
+      writer.add(frame);
+    }
+  }
+  const std::vector<CroppedImage> crops = VideoProcessor::processVideo(path, 48);
+  fs::remove(path);
+
+  bool ok = crops.size() == 6;
+  for (const auto &crop: crops) {
+    ok = ok && crop.get_color().type() == CV_8UC1;
+  }
+  if (!ok) {
+    std::cerr << "  Mono SER frames were expanded or lost" << std::endl;
+    return false;
+  }
+
+  // The typed kernels must give a mono stack exactly what one channel of
+  // the same data stacked as BGR gets
+  cv::RNG rng(31);
+  std::vector<cv::Mat> mono(9), bgr(9);
+  for (size_t i = 0; i < mono.size(); ++i) {
+    mono[i].create(21, 37, CV_16UC1);
+    rng.fill(mono[i], cv::RNG::UNIFORM, cv::Scalar(0), cv::Scalar(60000));
+    cv::merge(std::vector<cv::Mat>{mono[i], mono[i], mono[i]}, bgr[i]);
+  }
+  const cv::Mat mono_stack = ImageStacker::stack_images_float(mono);
+  std::vector<cv::Mat> bgr_planes;
+  cv::split(ImageStacker::stack_images_float(bgr), bgr_planes);
+  for (const auto &plane: bgr_planes) {
+    if (cv::norm(plane, mono_stack, cv::NORM_INF) > 0.01) {
+      std::cerr << "  Mono and BGR stacks of the same data differ" << std::endl;
+      return false;
+    }
+  }
+
+  std::cout << "  Mono crops stay single-channel and stack like one BGR plane"
+      << std::endl;
+  return true;
+}
+
+bool test_stacking_engine() {
+  std::cout << "Checking that a reused engine and its C interface agree" << std::endl;
+
+  std::vector<cv::Mat> frames;
+  for (int i = 0; i < 8; ++i) {
+    cv::Mat frame(80, 96, CV_8UC3, cv::Scalar::all(5));
+    cv::circle(frame, cv::Point(40 + i % 5, 36 + i % 3), 14,
+               cv::Scalar(170, 190, 210), cv::FILLED);
+    frames.push_back(frame);
+  }
+
+  EngineOptions options;
+  options.crop_size = 48;
+  options.keep_count = 6;
+  StackingEngine engine(options);
+  const auto run = [&engine, &frames]() {
+    for (const auto &frame: frames) {
+      engine.add_frame(frame);
+    }
+    return engine.stack();
+  };
+  const cv::Mat first = run();
+  const cv::Mat second = run();
+
+  bool ok = first.size() == cv::Size(48, 48) && first.type() == CV_32FC3 &&
+            engine.frame_count() == 0 &&
+            cv::norm(first, second, cv::NORM_INF) == 0.0;
+
+  ps_options c_options;
+  ps_options_init(&c_options);
+  c_options.crop_size = 48;
+  c_options.keep_count = 6;
+  ps_engine *c_engine = ps_engine_create(&c_options);
+  ok = ok && c_engine != nullptr;
+  if (c_engine) {
+    for (const auto &frame: frames) {
+      ok = ok && ps_engine_add_frame(c_engine, frame.data, frame.cols,
+                                     frame.rows, frame.channels(), 8,
+                                     frame.step) == 0;
+    }
+    ps_image result{};
+    ok = ok && ps_engine_stack(c_engine, &result) == 0 && result.width == 48 &&
+         result.height == 48 && result.channels == 3;
+    if (ok) {
+      const cv::Mat c_stack(result.height, result.width, CV_32FC3,
+                            const_cast<float *>(result.data), result.stride);
+      ok = cv::norm(first, c_stack, cv::NORM_INF) == 0.0;
+    }
+    // An empty engine reports the failure instead of throwing
+    ok = ok && ps_engine_stack(c_engine, &result) == -1 &&
+         std::string(ps_engine_last_error(c_engine)) == "No frames to stack.";
+    ps_engine_destroy(c_engine);
+  }
+
+  // The rejection mode defaults to the median and unknown modes are refused
+  ok = ok && c_options.rejection_mode == PS_REJECT_MEDIAN;
+  c_options.rejection_mode = 42;
+  ok = ok && ps_engine_create(&c_options) == nullptr;
+
+  if (!ok) {
+    std::cerr << "  Engine runs or the C interface gave different stacks"
+        << std::endl;
+    return false;
+  }
+
+  // Engines keep their own settings: one keeping only the darkest sample
+  // stacks next to one with the defaults, each on its own thread
+  std::vector<cv::Mat> noisy;
+  cv::RNG rng(7);
+  for (const auto &frame: frames) {
+    cv::Mat noise(frame.size(), CV_16SC3);
+    rng.fill(noise, cv::RNG::NORMAL, 0, 8);
+    cv::Mat sum;
+    cv::add(frame, noise, sum, cv::noArray(), CV_8U);
+    noisy.push_back(sum);
+  }
+  EngineOptions darkest = options;
+  darkest.rejection_mode = ImageStacker::RejectionMode::Percentile;
+  darkest.percentile_low = 0.0f;
+  darkest.percentile_high = 0.0f;
+  darkest.pyramid_levels = 1;
+  darkest.pyramid_window = 32;
+  StackingEngine default_engine(options);
+  StackingEngine darkest_engine(darkest);
+  const auto stack_noisy = [&noisy](StackingEngine &target) {
+    for (const auto &frame: noisy) {
+      target.add_frame(frame);
+    }
+    return target.stack();
+  };
+  const cv::Mat default_alone = stack_noisy(default_engine);
+  const cv::Mat darkest_alone = stack_noisy(darkest_engine);
+  cv::Mat darkest_parallel;
+  std::thread other([&] { darkest_parallel = stack_noisy(darkest_engine); });
+  const cv::Mat default_parallel = stack_noisy(default_engine);
+  other.join();
+
+  cv::Mat gap;
+  cv::subtract(default_alone, darkest_alone, gap);
+  const double mean_gap = cv::mean(gap.reshape(1))[0];
+  if (cv::norm(default_alone, default_parallel, cv::NORM_INF) != 0.0 ||
+      cv::norm(darkest_alone, darkest_parallel, cv::NORM_INF) != 0.0 ||
+      mean_gap < 1.0 ||
+      ImageStacker::rejection_mode != ImageStacker::RejectionMode::ReplaceWithMedian ||
+      ImageAligner::pyramid_levels != 0) {
+    std::cerr << "  Engine settings leaked between engines or into the process"
+        << " (darkest stack " << mean_gap << " below the default)" << std::endl;
+    return false;
+  }
+  std::cout << "  Repeated runs and the C interface give the same stack,"
+      << " engines with other settings run in parallel" << std::endl;
+  return true;
+}
+
+bool test_fused_stack() {
+  std::cout << "Checking the fused shift-and-stack against warped copies" << std::endl;
+
+  cv::RNG rng(47);
+  bool ok = true;
+  const ImageStacker::RejectionMode saved_mode = ImageStacker::rejection_mode;
+  // 21 frames take the histogram median for 8-bit frames and the sorting
+  // network for 16-bit ones
+  for (const int type: {CV_8UC3, CV_16UC1}) {
+    std::vector<CroppedImage> crops;
+    for (int i = 0; i < 21; ++i) {
+      cv::Mat color(40, 52, type);
+      rng.fill(color, cv::RNG::UNIFORM, cv::Scalar::all(0),
+               cv::Scalar::all(type == CV_8UC3 ? 255 : 65535));
+      cv::Mat gray;
+      if (color.channels() == 3) {
+        cv::cvtColor(color, gray, cv::COLOR_BGR2GRAY);
+      } else {
+        gray = color;
+      }
+      crops.emplace_back(color, gray);
+    }
+
+    // Whole-pixel shifts, some far enough to leave the frame, must match
+    // warpAffine exactly, sub-pixel ones up to its fixed-point rounding
+    const std::vector<cv::Point2d> whole_cycle = {
+      {0, 0}, {3, -2}, {-5, 4}, {60, 0}, {1, 1}, {-2, -7}, {0, 45}};
+    const std::vector<cv::Point2d> fractional_cycle = {
+      {0.25, 0}, {2.5, -1.75}, {-3.125, 0.5}, {0.0, -0.40625},
+      {7.75, 2.25}, {-0.5, -0.5}, {1.03125, 3.96875}};
+    std::vector<cv::Point2d> whole, fractional;
+    for (size_t i = 0; i < crops.size(); ++i) {
+      whole.push_back(whole_cycle[i % whole_cycle.size()]);
+      fractional.push_back(fractional_cycle[i % fractional_cycle.size()]);
+    }
+
+    for (const auto *shifts: {&whole, &fractional}) {
+      std::vector<cv::Mat> warped(crops.size());
+      for (size_t i = 0; i < crops.size(); ++i) {
+        const cv::Mat translation = (cv::Mat_<double>(2, 3) << 1, 0,
+                                     (*shifts)[i].x, 0, 1, (*shifts)[i].y);
+        cv::warpAffine(crops[i].get_color(), warped[i], translation,
+                       crops[i].get_color().size());
+      }
+      // Every clipping mode reads the shifted tiles through all its passes
+      for (const auto mode: {ImageStacker::RejectionMode::ReplaceWithMedian,
+                             ImageStacker::RejectionMode::KappaSigma,
+                             ImageStacker::RejectionMode::Winsorized}) {
+        ImageStacker::rejection_mode = mode;
+        const double error =
+            cv::norm(ImageStacker::stack_shifted(crops, *shifts),
+                     ImageStacker::stack_images_float(warped), cv::NORM_INF);
+        ok = ok && (shifts == &whole ? error == 0.0 : error <= 1.01);
+      }
+    }
+  }
+  ImageStacker::rejection_mode = saved_mode;
+
+  if (!ok) {
+    std::cerr << "  Fused stack differs from stacking warped frames" << std::endl;
+    return false;
+  }
+  std::cout << "  Whole-pixel shifts match exactly, sub-pixel ones within rounding"
+      << std::endl;
+  return true;
+}
+
+bool test_analysis_index() {
+  std::cout << "Checking that a second run is served by the analysis index" << std::endl;
+
+  const fs::path dir = fs::temp_directory_path() / "planetary_stacker_index";
+  fs::remove_all(dir);
+  fs::create_directories(dir);
+  const std::string path = (dir / "capture.ser").string();
+  {
+    SerWriter writer(path, cv::Size(96, 80), SerColor::BGR, 8);
+    for (int i = 0; i < 20; ++i) {
+      cv::Mat frame(80, 96, CV_8UC3, cv::Scalar::all(5));
+      cv::circle(frame, cv::Point(42 + i % 5, 37 + i % 3), 12 + i % 4,
+                 cv::Scalar(170, 190, 210), cv::FILLED);
+      cv::circle(frame, cv::Point(38 + i % 5, 35 + i % 3), 3,
+                 cv::Scalar(90, 100, 110), cv::FILLED);
+      writer.add(frame);
+    }
+  }
+
+  AnalysisIndex first(path, 48, 1);
+  const std::vector<CroppedImage> analysed = first.crop_best(50.0, 0);
+  const std::vector<cv::Point2d> estimated = first.shifts(analysed);
+
+  AnalysisIndex second(path, 48, 1);
+  const std::vector<CroppedImage> indexed = second.crop_best(50.0, 0);
+  const bool crops_reused = second.reused();
+  const std::vector<cv::Point2d> cached = second.shifts(indexed);
+  const bool shifts_reused = second.reused();
+
+  // --scratch with stored shifts translates the decoded crops straight
+  // into the tile store, nothing is spooled or estimated again
+  AnalysisIndex scratched(path, 48, 1);
+  ScratchCrops direct = OutOfCoreStacker::crop(scratched, 50.0, 0,
+                                               fs::temp_directory_path().string());
+  const bool scratch_reused = direct.aligned != nullptr && scratched.reused();
+  const std::unique_ptr<TileStore> store = OutOfCoreStacker::align(
+    direct, scratched, fs::temp_directory_path().string());
+  const cv::Mat scratch_stack = OutOfCoreStacker::stack(*store);
+  std::vector<CroppedImage> in_memory = indexed;
+  const cv::Mat memory_stack =
+      ImageStacker::stack_images_float(ImageAligner::align_images(in_memory));
+
+  // Another selection still needs no analysis and keeps the same frames
+  // as a run without an index
+  AnalysisIndex third(path, 48, 1);
+  const std::vector<CroppedImage> reselected = third.crop_best(0.0, 3);
+  const bool reselection_reused = third.reused();
+  const std::vector<CroppedImage> expected =
+      VideoProcessor::processBestFrames(path, 48, 1, 0.0, 3);
+
+  // Shifts estimated for a selection ranked by other weights leave the
+  // stored ones of the first selection usable
+  const float contrast_weight = CroppedImage::contrast_weight;
+  const float sharpness_weight = CroppedImage::sharpness_weight;
+  const float snr_weight = CroppedImage::snr_weight;
+  CroppedImage::contrast_weight = 1.0f;
+  CroppedImage::sharpness_weight = 0.0f;
+  CroppedImage::snr_weight = 0.0f;
+  AnalysisIndex reweighed(path, 48, 1);
+  reweighed.shifts(reweighed.crop_best(50.0, 0));
+  CroppedImage::contrast_weight = contrast_weight;
+  CroppedImage::sharpness_weight = sharpness_weight;
+  CroppedImage::snr_weight = snr_weight;
+  AnalysisIndex restored(path, 48, 1);
+  const std::vector<cv::Point2d> kept_shifts =
+    restored.shifts(restored.crop_best(50.0, 0));
+  bool shifts_kept = restored.reused() && kept_shifts.size() == estimated.size();
+  for (size_t i = 0; shifts_kept && i < kept_shifts.size(); ++i) {
+    shifts_kept = cv::norm(kept_shifts[i] - estimated[i]) < 0.25;
+  }
+
+  // Malformed sidecars are only a cache miss, the capture is analysed again
+  const std::string sidecar = AnalysisIndex::sidecar_path(path);
+  std::string pristine;
+  {
+    std::ifstream in(sidecar, std::ios::binary);
+    pristine.assign(std::istreambuf_iterator<char>(in), {});
+  }
+  const size_t record_size = 65;
+  const size_t records = pristine.size() - 20 * record_size;
+  const auto patched = [&](const size_t offset, const int32_t value) {
+    std::string bytes = pristine;
+    std::memcpy(&bytes[offset], &value, sizeof(value));
+    return bytes;
+  };
+  int32_t second_index = 0;
+  std::memcpy(&second_index, &pristine[records + record_size], sizeof(second_index));
+  const std::vector<std::string> malformed = {
+    pristine + '\0',                                        // trailing bytes
+    patched(records, second_index),                          // not ascending
+    patched(records + 19 * record_size, 1000),               // past the capture
+    pristine.substr(0, pristine.size() - record_size / 2),   // truncated
+  };
+  bool malformed_rejected = true;
+  for (const std::string &bytes: malformed) {
+    std::ofstream(sidecar, std::ios::binary | std::ios::trunc) << bytes;
+    AnalysisIndex damaged(path, 48, 1);
+    const std::vector<CroppedImage> reanalysed = damaged.crop_best(50.0, 0);
+    malformed_rejected = malformed_rejected && !damaged.reused() &&
+                         reanalysed.size() == analysed.size();
+  }
+  fs::remove_all(dir);
+
+  if (!shifts_kept) {
+    std::cerr << "  Shifts of the first selection were lost to another one"
+        << std::endl;
+    return false;
+  }
+  if (!malformed_rejected) {
+    std::cerr << "  A malformed sidecar was served instead of analysing again"
+        << std::endl;
+    return false;
+  }
+
+  bool ok = crops_reused && shifts_reused && reselection_reused &&
+            scratch_reused && first.frames().size() == 20 &&
+            analysed.size() == 10 && indexed.size() == analysed.size() &&
+            reselected.size() == expected.size() &&
+            direct.count == indexed.size() &&
+            cv::norm(scratch_stack, memory_stack, cv::NORM_INF) < 1e-3;
+  for (size_t i = 0; ok && i < analysed.size(); ++i) {
+    ok = cv::norm(analysed[i].get_color(), indexed[i].get_color(),
+                  cv::NORM_INF) == 0.0 &&
+         cv::norm(estimated[i] - cached[i]) < 1e-9;
+  }
+  for (size_t i = 0; ok && i < expected.size(); ++i) {
+    ok = cv::norm(expected[i].get_color(), reselected[i].get_color(),
+                  cv::NORM_INF) == 0.0;
+  }
+  if (!ok) {
+    std::cerr << "  Indexed run differs from the analysed one or was not reused"
+        << std::endl;
+    return false;
+  }
+
+  std::cout << "  Crops and shifts come from the index and match the first run,"
+      " with or without --scratch, malformed sidecars are analysed again"
+      << std::endl;
+  return true;
+}
+
+bool test_profiler() {
+  std::cout << "Checking profiler stage timings and reports" << std::endl;
+
+  const auto pause = [] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  };
+
+  // Two outer stages with two nested inner stages each, plus one inner
+  // stage from another thread
+  Profiler::enable();
+  for (int i = 0; i < 2; ++i) {
+    ScopedStage outer("test.outer");
+    outer.add_bytes(1000);
+    for (int j = 0; j < 2; ++j) {
+      ScopedStage inner("test.inner");
+      inner.add_bytes(100);
+      pause();
+    }
+  }
+  std::thread([&pause] {
+    ScopedStage inner("test.inner");
+    inner.add_bytes(100);
+    pause();
+  }).join();
+  Profiler::disable();
+  {
+    ScopedStage ignored("test.disabled");
+  }
+
+  const fs::path summary_path =
+      fs::temp_directory_path() / "planetary_stacker_profile.json";
+  const fs::path trace_path =
+      fs::temp_directory_path() / "planetary_stacker_trace.json";
+  if (!Profiler::write_summary(summary_path.string()) ||
+      !Profiler::write_trace(trace_path.string())) {
+    std::cerr << "  Could not write the profiler reports" << std::endl;
+    return false;
+  }
+
+  const auto read = [](const fs::path &path) {
+    std::ifstream in(path);
+    return std::string(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  };
+  const std::string summary = read(summary_path);
+  const std::string trace = read(trace_path);
+  fs::remove(summary_path);
+  fs::remove(trace_path);
+
+  struct Totals {
+    size_t calls = 0;
+    double wall_ms = 0.0;
+    size_t bytes = 0;
+    size_t threads = 0;
+  };
+  const auto totals_of = [&summary](const std::string &name) {
+    Totals totals;
+    const std::regex line(
+      "\\{\"name\": \"" + name + "\", \"calls\": (\\d+), "
+      "\"wall_ms\": ([^,]+),.*\"bytes\": (\\d+),\n\\s*\"threads\": \\[([^\\]]*)\\]");
+    std::smatch match;
+    if (std::regex_search(summary, match, line)) {
+      totals.calls = std::stoul(match[1]);
+      totals.wall_ms = std::stod(match[2]);
+      totals.bytes = std::stoul(match[3]);
+      const std::string threads = match[4];
+      for (size_t at = threads.find("\"thread\""); at != std::string::npos;
+           at = threads.find("\"thread\"", at + 1)) {
+        ++totals.threads;
+      }
+    }
+    return totals;
+  };
+  const auto count_of = [](const std::string &text, const std::string &needle) {
+    size_t count = 0;
+    for (size_t at = text.find(needle); at != std::string::npos;
+         at = text.find(needle, at + 1)) {
+      ++count;
+    }
+    return count;
+  };
+
+  const Totals outer = totals_of("test.outer");
+  const Totals inner = totals_of("test.inner");
+  bool ok = true;
+  if (outer.calls != 2 || outer.bytes != 2000 || outer.threads != 1) {
+    std::cerr << "  Outer stage recorded " << outer.calls << " calls, "
+        << outer.bytes << " bytes on " << outer.threads
+        << " threads, expected 2, 2000 and 1" << std::endl;
+    ok = false;
+  }
+  if (inner.calls != 5 || inner.bytes != 500 || inner.threads != 2) {
+    std::cerr << "  Inner stage recorded " << inner.calls << " calls, "
+        << inner.bytes << " bytes on " << inner.threads
+        << " threads, expected 5, 500 and 2" << std::endl;
+    ok = false;
+  }
+  // Nested time is counted in both stages, each outer stage waits twice
+  if (inner.wall_ms < 25.0 || outer.wall_ms < 20.0) {
+    std::cerr << "  Stage wall times " << outer.wall_ms << " ms (outer) and "
+        << inner.wall_ms << " ms (inner) miss the sleeps" << std::endl;
+    ok = false;
+  }
+  if (summary.find("test.disabled") != std::string::npos) {
+    std::cerr << "  A stage was recorded while the profiler was disabled"
+        << std::endl;
+    ok = false;
+  }
+  if (count_of(trace, "\"name\": \"test.outer\"") != 2 ||
+      count_of(trace, "\"name\": \"test.inner\"") != 5) {
+    std::cerr << "  Trace is missing stage events" << std::endl;
+    ok = false;
+  }
+
+  if (ok) {
+    std::cout << "  Recorded " << outer.calls << " outer (" << outer.wall_ms
+        << " ms) and " << inner.calls << " nested stages (" << inner.wall_ms
+        << " ms)" << std::endl;
+  }
+  return ok;
+}
+
 int main() {
   const std::vector<std::pair<std::string, std::string> > test_cases = {
     {
@@ -92,8 +1664,154 @@ int main() {
     std::cout << std::endl;
   }
 
-  std::cout << "Completed " << successful_tests << "/" << test_cases.size()
+  int total_tests = static_cast<int>(test_cases.size());
+
+  total_tests++;
+  if (test_frame_selection("../test/input/jupiter_sample_frames/")) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_online_stacker()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_median_kernel()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_sigma_rejection()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_rank_rejection()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_alignment_shift()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_multi_point_alignment()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_quality_metrics()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_planet_tracker()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_frame_pool()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_ser_round_trip()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_bayer_crop()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_high_bit_depth_stack()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_batch_scheduler()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_out_of_core_stack()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_scratch_pipeline()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_segmented_decoding()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_segmented_video_decoding()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_live_stacking()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_mono_pipeline()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_stacking_engine()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_fused_stack()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_analysis_index()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  total_tests++;
+  if (test_profiler()) {
+    successful_tests++;
+  }
+  std::cout << std::endl;
+
+  std::cout << "Completed " << successful_tests << "/" << total_tests
       << " test cases successfully." << std::endl;
 
-  return (successful_tests == test_cases.size()) ? 0 : 1;
+  return (successful_tests == total_tests) ? 0 : 1;
 }
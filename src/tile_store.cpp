@@ -0,0 +1,136 @@
+#include "tile_store.hpp"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <opencv2/core/mat.hpp>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+std::string TileStore::scratch_dir;
+size_t TileStore::max_band_bytes = 64 * 1024 * 1024;
+
+TileStore::TileStore(const std::string &directory, const size_t count,
+                     const cv::Size frame_size, const int type)
+  : count(count), size(frame_size), mat_type(type) {
+  if (count == 0 || frame_size.area() <= 0) {
+    throw std::invalid_argument("Tile store needs at least one non-empty frame.");
+  }
+
+  row_bytes = static_cast<size_t>(size.width) * CV_ELEM_SIZE(mat_type);
+  rows_per_band = static_cast<int>(std::clamp<size_t>(
+    max_band_bytes / (row_bytes * count), 1, static_cast<size_t>(size.height)));
+  bands = (size.height + rows_per_band - 1) / rows_per_band;
+  total_bytes = row_bytes * size.height * count;
+
+#if defined(__unix__) || defined(__APPLE__)
+  std::string name =
+      (std::filesystem::path(directory.empty() ? "." : directory) /
+       "planetary_stack_XXXXXX")
+          .string();
+  const int fd = mkstemp(name.data());
+  if (fd < 0) {
+    throw std::runtime_error("Could not create scratch file in: " + directory);
+  }
+  // Unlinked right away, the space is returned even if the process dies
+  unlink(name.c_str());
+  if (ftruncate(fd, static_cast<off_t>(total_bytes)) != 0) {
+    close(fd);
+    throw std::runtime_error("Could not size scratch file in: " + directory);
+  }
+  void *mapping =
+      mmap(nullptr, total_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    throw std::runtime_error("Could not map scratch file in: " + directory);
+  }
+  data = static_cast<uchar *>(mapping);
+  mapped = true;
+#else
+  // No mmap: same layout on the heap, only the access pattern is kept
+  (void)directory;
+  fallback_buffer.resize(total_bytes);
+  data = fallback_buffer.data();
+#endif
+}
+
+TileStore::~TileStore() {
+#if defined(__unix__) || defined(__APPLE__)
+  if (mapped && data) {
+    munmap(data, total_bytes);
+  }
+#endif
+}
+
+void TileStore::write_frame(const size_t index, const cv::Mat &frame) {
+  if (index >= count) {
+    throw std::out_of_range("Tile store frame index out of range.");
+  }
+  if (frame.size() != size || frame.type() != mat_type) {
+    throw std::invalid_argument("Frame does not match the tile store geometry.");
+  }
+
+  for (int b = 0; b < bands; ++b) {
+    const cv::Range rows = band_rows(b);
+    uchar *dst = data + band_offset(b) + index * row_bytes * rows.size();
+    for (int y = rows.start; y < rows.end; ++y) {
+      std::memcpy(dst, frame.ptr(y), row_bytes);
+      dst += row_bytes;
+    }
+  }
+}
+
+size_t TileStore::frame_count() const { return count; }
+
+cv::Size TileStore::frame_size() const { return size; }
+
+int TileStore::type() const { return mat_type; }
+
+int TileStore::band_count() const { return bands; }
+
+cv::Range TileStore::band_rows(const int band) const {
+  const int start = band * rows_per_band;
+  return {start, std::min(size.height, start + rows_per_band)};
+}
+
+std::vector<cv::Mat> TileStore::band(const int band) const {
+  const cv::Range rows = band_rows(band);
+  const size_t frame_bytes = row_bytes * rows.size();
+  uchar *base = data + band_offset(band);
+
+  std::vector<cv::Mat> frames;
+  frames.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    frames.emplace_back(rows.size(), size.width, mat_type, base + i * frame_bytes);
+  }
+  return frames;
+}
+
+void TileStore::release_band(const int band) const {
+#if defined(__unix__) || defined(__APPLE__)
+  if (!mapped) {
+    return;
+  }
+  // Only whole pages inside the band may be dropped
+  const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  const size_t begin = band_offset(band);
+  const size_t end = begin + row_bytes * band_rows(band).size() * count;
+  const size_t first = (begin + page - 1) / page * page;
+  const size_t last = end / page * page;
+  if (last > first) {
+    madvise(data + first, last - first, MADV_DONTNEED);
+  }
+#else
+  (void)band;
+#endif
+}
+
+size_t TileStore::band_offset(const int band) const {
+  // Every band before the last one is full
+  return static_cast<size_t>(band) * rows_per_band * row_bytes * count;
+}
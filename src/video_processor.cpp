@@ -1,43 +1,522 @@
 #include "video_processor.hpp"
+#include "bounded_queue.hpp"
 #include "cropped_image.hpp"
+#include "frame_pool.hpp"
+#include "frame_selector.hpp"
 #include "planet_detector.hpp"
+#include "profiler.hpp"
+#include "ser_file.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <omp.h>
 #include <opencv2/opencv.hpp>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
+int VideoProcessor::queue_depth = 32;
+bool VideoProcessor::track_target = true;
+bool VideoProcessor::debayer_after_crop = true;
+int VideoProcessor::decode_segments = 0;
+int VideoProcessor::min_segment_frames = 32;
+
+VideoProcessor::Settings VideoProcessor::currentSettings() {
+  return Settings{track_target, CroppedImage::current_weights()};
+}
+
+namespace {
+struct DecodedFrame {
+  int index = 0;
+  cv::Mat frame;
+  Centroid centroid{0, 0};
+  bool located = false;
+  int bayer_code = -1; // frame is a raw mosaic when set
+};
+
+// Gain that stretches SER samples of bit_depth to the full 16-bit range,
+// the usual convention for 10/12/14-bit cameras stored in 16-bit words
+double ser_gain(const SerReader &reader) {
+  const int depth = reader.bit_depth();
+  return depth > 8 && depth < 16 ? static_cast<double>(1 << (16 - depth)) : 1.0;
+}
+
+// Frames [start, end) of the capture, end < 0 reads to the end of the stream
+struct Segment {
+  int start = 0;
+  int end = -1;
+};
+
+// Settings shared by every decoder thread of one stream
+struct DecodeContext {
+  const std::string &video_path;
+  const SerReader *ser;
+  int frame_skip;
+  int crop_size;
+  bool tracking;
+  bool raw_bayer;
+  int bayer_code;
+  int bit_depth;
+};
+
+// Position a fresh capture on frame start. Containers that cannot seek
+// exactly are read up to it instead, which is slower but still correct
+void seek_to(cv::VideoCapture &cap, const std::string &video_path,
+             const int start) {
+  if (VideoProcessor::seekToFrame(cap, video_path, start)) {
+    return;
+  }
+  for (int i = 0; i < start; ++i) {
+    if (!cap.grab()) {
+      return;
+    }
+  }
+}
+
+// Decode one segment in frame order, locate the target and queue every
+// kept frame. Tracking needs frames in order, so each segment has its own
+// tracker and detects the target from scratch on its first frame. opened,
+// when given, is a capture already positioned on the segment start
+void decode_segment(const DecodeContext &ctx, const Segment segment,
+                    cv::VideoCapture *opened, BoundedQueue<DecodedFrame> &queue) {
+  const SerReader *ser = ctx.ser;
+  cv::VideoCapture own;
+  cv::VideoCapture *cap = opened;
+  if (!ser && !cap) {
+    if (!own.open(ctx.video_path)) {
+      throw std::runtime_error("Could not open video file: " + ctx.video_path);
+    }
+    cap = &own;
+    if (segment.start > 0) {
+      seek_to(own, ctx.video_path, segment.start);
+    }
+  }
+
+  PlanetTracker tracker(std::max(1, ctx.crop_size));
+  PlanetTracker binned_tracker(std::max(1, ctx.crop_size / 2));
+  cv::Mat binned;
+
+  // SER frames are addressed by index, skipped frames are never read
+  const int step = ser ? ctx.frame_skip : 1;
+  for (int frame_count = segment.start;
+       segment.end < 0 || frame_count < segment.end; frame_count += step) {
+    // Fresh buffer per frame, the previous one may still be queued.
+    // Released frames go back to the pool, so this is a recycled buffer
+    cv::Mat frame;
+    {
+      ScopedStage stage("decode");
+      if (ser) {
+        if (frame_count >= ser->frame_count()) {
+          return;
+        }
+        frame = ctx.raw_bayer ? ser->raw_frame(frame_count)
+                              : readSerFrame(*ser, frame_count);
+      } else if (frame_count % ctx.frame_skip != 0) {
+        // Skipped frames are only grabbed, never converted or copied out
+        if (!cap->grab()) {
+          return;
+        }
+        continue;
+      } else {
+        FramePool::attach(frame);
+        if (!cap->grab() || !cap->retrieve(frame)) {
+          return;
+        }
+      }
+      stage.add_bytes(frame.total() * frame.elemSize());
+    }
+
+    DecodedFrame decoded{frame_count, std::move(frame)};
+    if (ctx.raw_bayer) {
+      // Averaging each 2x2 cell mixes one full pattern into a luma
+      // sample, so the mosaic never has to be demosaiced to be located
+      cv::resize(decoded.frame, binned,
+                 cv::Size(decoded.frame.cols / 2, decoded.frame.rows / 2), 0,
+                 0, cv::INTER_AREA);
+      if (binned.depth() != CV_8U) {
+        binned.convertTo(binned, CV_8U,
+                         1.0 / (1 << std::max(0, ctx.bit_depth - 8)));
+      }
+      if (!ctx.tracking) {
+        binned_tracker.reset();
+      }
+      const Centroid centroid = binned_tracker.locate(binned);
+      decoded.centroid = Centroid{2 * centroid.x, 2 * centroid.y};
+      decoded.located = true;
+      decoded.bayer_code = ctx.bayer_code;
+    } else if (ctx.tracking) {
+      decoded.centroid = tracker.locate(decoded.frame);
+      decoded.located = true;
+    }
+    if (!queue.push(std::move(decoded))) {
+      return;
+    }
+  }
+}
+
+// Split the kept frames into contiguous segments that start on a kept
+// frame, the last one runs to the end of the stream whatever the count says
+std::vector<Segment> plan_segments(const int total_frames, const int frame_skip,
+                                   const int requested) {
+  const int kept = total_frames > 0 ? (total_frames + frame_skip - 1) / frame_skip : 0;
+  const int count = std::clamp(
+    std::min(requested, kept / VideoProcessor::min_segment_frames), 1,
+    std::max(1, requested));
+
+  std::vector<Segment> segments(count);
+  const int per_segment = (kept + count - 1) / std::max(1, count);
+  for (int s = 0; s < count; ++s) {
+    segments[s].start = s * per_segment * frame_skip;
+    segments[s].end = s + 1 < count ? (s + 1) * per_segment * frame_skip : -1;
+  }
+  return segments;
+}
+} // namespace
+
 std::vector<CroppedImage> VideoProcessor::processVideo(const std::string &video_path,
                                                        int crop_size,
-                                                       int frame_skip) {
+                                                       int frame_skip,
+                                                       const Settings &settings) {
+  std::vector<std::pair<int, CroppedImage> > indexed_images;
+
+  streamVideo(video_path, crop_size, frame_skip,
+              [&indexed_images](int frame_index, Centroid,
+                                CroppedImage &&cropped) {
+#pragma omp critical
+                {
+                  indexed_images.emplace_back(frame_index, std::move(cropped));
+                }
+              },
+              settings);
+
+  // Workers finish out of order, restore the decode order
+  std::sort(indexed_images.begin(), indexed_images.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+
+  std::vector<CroppedImage> cropped_images;
+  cropped_images.reserve(indexed_images.size());
+  for (auto &[index, cropped]: indexed_images) {
+    cropped_images.push_back(std::move(cropped));
+  }
+
+  return cropped_images;
+}
+
+std::vector<CroppedImage>
+VideoProcessor::processBestFrames(const std::string &video_path,
+                                  const int crop_size, const int frame_skip,
+                                  const double keep_percent,
+                                  const size_t keep_count,
+                                  const Settings &settings) {
+  if (keep_count == 0 && keep_percent <= 0.0) {
+    return processVideo(video_path, crop_size, frame_skip, settings);
+  }
+
+  size_t capacity = keep_count;
+  if (capacity == 0) {
+    const int total_frames = estimateFrameCount(video_path, frame_skip);
+    if (total_frames > 0) {
+      capacity = FrameSelector::capacity_for_percent(
+        static_cast<size_t>(total_frames), keep_percent);
+    }
+  }
+
+  // Unknown video length: crop everything, then select
+  if (capacity == 0) {
+    std::vector<CroppedImage> cropped_images =
+        processVideo(video_path, crop_size, frame_skip, settings);
+    capacity = FrameSelector::capacity_for_percent(cropped_images.size(),
+                                                   keep_percent);
+    return FrameSelector::select(std::move(cropped_images), capacity);
+  }
+
+  FrameSelector selector(capacity);
+  streamVideo(video_path, crop_size, frame_skip,
+              [&selector](int frame_index, Centroid, CroppedImage &&cropped) {
+                selector.offer(frame_index, std::move(cropped));
+              },
+              settings);
+  return selector.take();
+}
+
+void VideoProcessor::streamVideo(const std::string &video_path, int crop_size,
+                                 int frame_skip, const FrameSink &sink,
+                                 const Settings &settings) {
+  if (frame_skip < 1) {
+    throw std::invalid_argument("Frame skip must be at least 1.");
+  }
+
+  // SER captures are read straight from a mapping, everything else goes
+  // through the OpenCV decoders
+  std::unique_ptr<SerReader> ser;
+  cv::VideoCapture cap;
+  if (SerReader::is_ser_file(video_path)) {
+    ser = std::make_unique<SerReader>(video_path);
+  } else if (!cap.open(video_path)) {
+    throw std::runtime_error("Could not open video file: " + video_path);
+  }
+
+  // Raw Bayer captures are located on a 2x2 binned luma of the mosaic and
+  // only the crop is demosaiced
+  const bool raw_bayer = ser && ser->is_bayer() && debayer_after_crop;
+  const int bayer_code = raw_bayer ? SerReader::bayer_to_bgr_code(ser->color()) : -1;
+  const int bit_depth = ser ? ser->bit_depth() : 8;
+
+  // Segments need a frame count to split on, streams without one are
+  // decoded by a single thread
+  const int total_frames =
+      ser ? ser->frame_count()
+          : static_cast<int>(cap.get(cv::CAP_PROP_FRAME_COUNT));
+  const int requested = decode_segments > 0
+                          ? decode_segments
+                          : std::clamp(omp_get_max_threads() / 4, 1, 8);
+  std::vector<Segment> segments =
+      plan_segments(total_frames, frame_skip, requested);
+
+  // Without a confirmed seek every segment would read from the first
+  // frame, a single decoder then does that work only once
+  cv::VideoCapture probe;
+  if (!ser && segments.size() > 1 &&
+      (!probe.open(video_path) ||
+       !seekToFrame(probe, video_path, segments[1].start))) {
+    segments.assign(1, Segment{});
+  }
+
+  BoundedQueue<DecodedFrame> queue(static_cast<size_t>(std::max(1, queue_depth)));
+  std::exception_ptr decode_error;
+  std::exception_ptr crop_error;
+  std::mutex decode_error_mutex;
+  std::atomic<int> running_decoders{static_cast<int>(segments.size())};
+
+  // Step 1: Decode on dedicated threads, one per segment, so reading
+  // overlaps with cropping and is not limited to one core. Frames arrive
+  // out of order, every frame carries its index
+  const DecodeContext context{video_path, ser.get(), frame_skip, crop_size,
+                              settings.track_target, raw_bayer, bayer_code,
+                              bit_depth};
+  std::vector<std::thread> decoders;
+  decoders.reserve(segments.size());
+  for (size_t s = 0; s < segments.size(); ++s) {
+    // The first two segments reuse the captures opened above, which are
+    // already on their start frames
+    cv::VideoCapture *opened =
+        ser ? nullptr : s == 0 ? &cap : s == 1 ? &probe : nullptr;
+    decoders.emplace_back([&context, &queue, &decode_error, &decode_error_mutex,
+                           &running_decoders, segment = segments[s], opened] {
+      try {
+        decode_segment(context, segment, opened, queue);
+      } catch (...) {
+        {
+          std::lock_guard<std::mutex> lock(decode_error_mutex);
+          if (!decode_error) {
+            decode_error = std::current_exception();
+          }
+        }
+        queue.cancel();
+      }
+      if (--running_decoders == 0) {
+        queue.close();
+      }
+    });
+  }
+
+  // Step 2: Crop workers drain the queue, full-size frames are dropped as
+  // soon as their crop exists
+#pragma omp parallel default(none) \
+    shared(queue, crop_size, bit_depth, sink, settings, crop_error)
+  {
+    DecodedFrame decoded;
+    while (queue.pop(decoded)) {
+      try {
+        CroppedImage cropped = [&]() {
+          if (decoded.bayer_code >= 0) {
+            return PlanetDetector::crop_bayer(decoded.frame, decoded.bayer_code,
+                                              decoded.centroid, crop_size,
+                                              bit_depth);
+          }
+          if (decoded.located) {
+            return PlanetDetector::crop_around(decoded.frame, cv::Mat(),
+                                               decoded.centroid, crop_size);
+          }
+          // Without tracking the full-frame grayscale is made for detection
+          // anyway, the crop reuses it
+          const Image image(decoded.frame);
+          decoded.centroid = PlanetDetector::detect(image);
+          return PlanetDetector::crop_around(image.get_color(),
+                                             image.get_grayscale(),
+                                             decoded.centroid, crop_size);
+        }();
+        cropped.reweigh(settings.weights);
+        decoded.frame.release();
+        sink(decoded.index, decoded.centroid, std::move(cropped));
+      } catch (...) {
+#pragma omp critical
+        {
+          if (!crop_error) {
+            crop_error = std::current_exception();
+          }
+        }
+        queue.cancel();
+      }
+    }
+  }
+
+  for (auto &decoder: decoders) {
+    decoder.join();
+  }
+
+  if (decode_error) {
+    std::rethrow_exception(decode_error);
+  }
+  if (crop_error) {
+    std::rethrow_exception(crop_error);
+  }
+}
+
+bool VideoProcessor::seekToFrame(cv::VideoCapture &cap,
+                                 const std::string &video_path,
+                                 const int frame) {
+  // The position a backend reports after set() proves nothing, FFmpeg
+  // echoes the requested frame even when it landed on an earlier keyframe.
+  // Decoding the frame before the target and checking its timestamp does
+  const double fps = cap.get(cv::CAP_PROP_FPS);
+  if (frame > 0 && fps > 0.0 &&
+      cap.set(cv::CAP_PROP_POS_FRAMES, frame - 1) && cap.grab()) {
+    const double period_ms = 1000.0 / fps;
+    const double expected_ms = (frame - 1) * period_ms;
+    if (std::abs(cap.get(cv::CAP_PROP_POS_MSEC) - expected_ms) <
+        0.5 * period_ms) {
+      return true;
+    }
+  }
+  cap.open(video_path);
+  return frame <= 0;
+}
+
+int VideoProcessor::estimateFrameCount(const std::string &video_path,
+                                       int frame_skip) {
+  if (frame_skip < 1) {
+    throw std::invalid_argument("Frame skip must be at least 1.");
+  }
+
+  if (SerReader::is_ser_file(video_path)) {
+    const SerReader ser(video_path);
+    return (ser.frame_count() + frame_skip - 1) / frame_skip;
+  }
+
   cv::VideoCapture cap(video_path);
   if (!cap.isOpened()) {
     throw std::runtime_error("Could not open video file: " + video_path);
   }
 
-  std::vector<cv::Mat> frames;
-  cv::Mat frame;
-  int frame_count = 0;
+  const auto frame_count = static_cast<int>(cap.get(cv::CAP_PROP_FRAME_COUNT));
+  if (frame_count <= 0) {
+    return -1;
+  }
+  return (frame_count + frame_skip - 1) / frame_skip;
+}
+
+std::vector<CroppedImage>
+VideoProcessor::cropFrames(const std::string &video_path, const int crop_size,
+                           const std::vector<LocatedFrame> &frames) {
+  std::vector<CroppedImage> cropped;
+  cropped.reserve(frames.size());
+  cropFrames(video_path, crop_size, frames,
+             [&cropped](size_t, CroppedImage &&crop) {
+               cropped.push_back(std::move(crop));
+             });
+  return cropped;
+}
 
-  // Step 1: Read frames sequentially
-  while (cap.read(frame)) {
-    if (frame_count % frame_skip == 0) {
-      frames.push_back(frame.clone());
+void VideoProcessor::cropFrames(const std::string &video_path,
+                                const int crop_size,
+                                const std::vector<LocatedFrame> &frames,
+                                const CropSink &sink) {
+  if (SerReader::is_ser_file(video_path)) {
+    const SerReader ser(video_path);
+    const bool raw_bayer = ser.is_bayer() && debayer_after_crop;
+    const int bayer_code =
+        raw_bayer ? SerReader::bayer_to_bgr_code(ser.color()) : -1;
+    for (size_t i = 0; i < frames.size(); ++i) {
+      const auto &[index, centroid] = frames[i];
+      if (index < 0 || index >= ser.frame_count()) {
+        throw std::runtime_error("Frame " + std::to_string(index) +
+                                 " is not in " + video_path);
+      }
+      std::optional<CroppedImage> crop;
+      {
+        ScopedStage stage("decode");
+        crop.emplace(
+          raw_bayer ? PlanetDetector::crop_bayer(ser.raw_frame(index), bayer_code,
+                                                 centroid, crop_size,
+                                                 ser.bit_depth())
+                    : PlanetDetector::crop_around(readSerFrame(ser, index),
+                                                  cv::Mat(), centroid, crop_size));
+      }
+      sink(i, std::move(*crop));
     }
-    frame_count++;
+    return;
   }
 
-  // Step 2: Parallel cropping
-  std::vector<CroppedImage> cropped_images;
-  cropped_images.reserve(frames.size());
+  cv::VideoCapture cap(video_path);
+  if (!cap.isOpened()) {
+    throw std::runtime_error("Could not open video file: " + video_path);
+  }
 
-#pragma omp parallel for default(none) shared(frames, crop_size, cropped_images)
-  for (const auto &f: frames) {
-    Image image(f);
-    CroppedImage cropped = PlanetDetector::crop(image, crop_size);
-#pragma omp critical
+  // Frames in between are only grabbed, long gaps are seeked over until a
+  // seek cannot be confirmed, from then on everything is grabbed
+  constexpr int max_grab_gap = 64;
+  bool seekable = true;
+  int position = 0;
+  cv::Mat frame;
+  FramePool::attach(frame);
+  for (size_t i = 0; i < frames.size(); ++i) {
+    const auto &[index, centroid] = frames[i];
+    if (index < position) {
+      throw std::invalid_argument("Frames must be in ascending order.");
+    }
     {
-      cropped_images.push_back(cropped);
+      ScopedStage stage("decode");
+      if (seekable && index - position > max_grab_gap) {
+        seekable = seekToFrame(cap, video_path, index);
+        position = seekable ? index : 0;
+      }
+      for (; position < index; ++position) {
+        if (!cap.grab()) {
+          break;
+        }
+      }
+      if (position != index || !cap.grab() || !cap.retrieve(frame)) {
+        throw std::runtime_error("Frame " + std::to_string(index) +
+                                 " is not in " + video_path);
+      }
+      ++position;
     }
+    sink(i, PlanetDetector::crop_around(frame, cv::Mat(), centroid, crop_size));
   }
+}
 
-  return cropped_images;
+// Full-range captures stay views into the mapping, anything else is scaled
+// once into a pooled buffer
+cv::Mat VideoProcessor::readSerFrame(const SerReader &reader, const int index) {
+  cv::Mat frame;
+  {
+    ScopedStage stage("debayer");
+    frame = reader.frame(index);
+  }
+  const double gain = ser_gain(reader);
+  if (gain == 1.0) {
+    return frame;
+  }
+
+  cv::Mat scaled;
+  FramePool::attach(scaled);
+  frame.convertTo(scaled, -1, gain);
+  return scaled;
 }